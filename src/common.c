@@ -1,9 +1,16 @@
 #include "common.h"
 
+__thread error_trap* current_trap = NULL;
+
 void file_error(const char* msg, const char* fname)
 {
-    fprintf(stderr, "%sError! %s: %s%s\n", ERR_COL, msg, fname, DEF_COL);
-    exit(0);
+    char buf[512];
+    snprintf(buf, sizeof(buf), "%s: %s", msg, fname);
+
+    if (current_trap == NULL) {
+        fprintf(stderr, "%sError! %s%s\n", ERR_COL, buf, DEF_COL);
+    }
+    error_exit(buf);
 }
 
 const char* read_file(const char* filepath)
@@ -80,6 +87,19 @@ size_t strhash(const char *str)
 
 void failure(const char* msg)
 {
-    fprintf(stderr, "%s %s\n", ERROR, msg);
-    exit(0);
+    if (current_trap == NULL) {
+        fprintf(stderr, "%s %s\n", ERROR, msg);
+    }
+    error_exit(msg);
+}
+
+void error_exit(const char* msg)
+{
+    if (current_trap == NULL) {
+        exit(0);
+    }
+
+    snprintf(current_trap->message, sizeof(current_trap->message), "%s", msg);
+    current_trap->raised = true;
+    longjmp(current_trap->env, 1);
 }
\ No newline at end of file
@@ -4,6 +4,8 @@
 #include <ctype.h>
 #include <libgen.h>
 #include <math.h>
+#include <pthread.h>
+#include <setjmp.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,6 +38,12 @@
 #define MAX_HEAP_SIZE 0xfff
 #define MAX_LOCAL_CONSTANTS 0xff
 #define MAX_LOCAL_VARIABLES 0xff
+#define MAX_NODE_INSTRUCTIONS 32
+#define MAX_INLINE_INSTRUCTIONS 16
+#define MAX_PARSE_WORKERS 16
+#define MIN_SWITCH_CASES 3
+#define MAX_SWITCH_CASES 64
+#define MAX_REGION_SIZE 0xffff
 
 // #define HE_DEBUG_MODE
 
@@ -45,6 +53,17 @@ typedef unsigned char boolean;
 #define true 1
 #define false 0
 
+// recovery point of an embedding program, errors raised while it is set
+// return to it with their message instead of ending the process
+typedef struct error_trap {
+    jmp_buf env;
+    boolean raised;
+    char message[512];
+} error_trap;
+
+// innermost error trap of the calling thread, NULL outside the library
+extern __thread error_trap* current_trap;
+
 /**
  * @brief Prints file error and terminates program.
  * 
@@ -98,4 +117,13 @@ size_t strhash(const char *str);
  */
 void failure(const char* msg);
 
+/**
+ * @brief Ends the process after an error has been reported. Within an
+ *      error trap, the message is recorded and control returns to the
+ *      trap instead, and errors are not printed.
+ * 
+ * @param msg Error message
+ */
+void error_exit(const char* msg);
+
 #endif
\ No newline at end of file
@@ -1,7 +1,37 @@
 #include "compiler.h"
+#include "optimiser.h"
+#include "peephole.h"
+#include "specialise.h"
+#include "inliner.h"
+#include "escape.h"
+#include "lib.h"
+#include "image.h"
+
+// included file read and parsed ahead of its inclusion
+typedef struct module {
+    const char* path;
+    const char* src;
+    astnode* block;
+    vector tokens;
+    vector nodes;       // syntax nodes made by the worker which parsed it
+    boolean failed;     // the worker parsing it raised an error
+} module;
 
 vm_op decode_binary_op(const char* operator);
+uint64_t constant_key(Value v);
 vm_op decode_unary_op(const char* operator);
+void compile_logical(program* p, astnode* expression);
+boolean compile_update(program* p, astnode* s, int16_t address, vm_scope scope);
+void clear_buffers(program* p, astnode* node);
+void reset_deferred(program* p);
+boolean contains_call(astnode* node);
+boolean first_inclusion(const char* path);
+symbol canonical_path(const char* path);
+char* include_path(astnode* filepath);
+void find_includes(astnode* block, vector* includes);
+module* module_new(char* path);
+void parse_module(module* m);
+void* parse_worker(void* arg);
 void runtimeerr(virtual_machine* vm, const char* msg);
 
 vm_op scope_load_op_map[] = {
@@ -20,12 +50,103 @@ vm_op scope_store_op_map[] = {
 
 // -------------- COMPILER METHODS --------------
 
+program* compile_script(const char* path, const char* src, vector* tokens, boolean fuse)
+{
+    image_add_source(path, src);
+    reset_includes();
+
+#ifdef HE_DEBUG_MODE
+    printf("\n%s Reading code:\n\n%s\n", MESSAGE, src);
+
+    printf("%s Beginning lexical anaylsis:\n\n", MESSAGE);
+#endif
+
+    lexer lx = lexer_new(src, path);
+    lexify(&lx, tokens);
+    
+#ifdef HE_DEBUG_MODE
+    for (size_t i = 0; i < tokens->size; i++) {
+        lxtoken_display(tokens->items[i]);
+    }
+
+    printf("\n%s Beginning syntax parsing:\n\n", MESSAGE);
+#endif
+
+    parser ps = {
+        .position = 0,
+        .source = src,
+        .tokens = *tokens
+    };
+
+    astnode* tree = parse(&ps);
+
+    parse_includes(tree);
+    expand_includes(tree);
+
+    if (snapshot_marker != NULL && !image_mark_snapshot(tree, snapshot_marker)) {
+        failure("Snapshot marker is not assigned in global scope!");
+    }
+
+    if (tree_shaking) {
+        shake_tree(tree);
+    }
+
+    optimise(tree);
+    inline_prepare(tree);
+    collect_owned_strings(tree);
+
+#ifdef HE_DEBUG_MODE
+    printf("%s\n", astnode_tostr(tree));
+    
+    print_ast(tree, 0, 0, true);
+
+    printf("\n%s Beginning compilation:\n\n", MESSAGE);
+#endif
+
+    program* pp = malloc(sizeof(program));
+    *pp = (program) {
+        .code = malloc(sizeof(instruction) * MAX_LOCAL_VARIABLES),
+        .length = 0,
+        .capacity = MAX_LOCAL_VARIABLES,
+        .argc = 0,
+        .constants = malloc(sizeof(Value) * MAX_LOCAL_CONSTANTS),
+        .constant_capacity = MAX_LOCAL_CONSTANTS,
+        .prev = NULL,
+        .deferred = NULL,
+        .globals = SIZE_MAX,
+
+        .constant_table = idmap_new(37),
+        .symbol_table = idmap_new(37),
+        .closure_table = idmap_new(8),
+        .line_address_table = map_new(37),
+        .jump_tables = vector_new(1),
+        .invoke_caches = vector_new(1),
+    };
+    
+    compile(pp, tree);
+    specialise(pp);
+    peephole(pp);
+
+    if (fuse) {
+        fuse_superinstructions(pp);
+    }
+
+#ifdef HE_DEBUG_MODE
+    printf(disassemble_program(pp));
+#endif
+
+    return pp;
+}
+
 void compile(program* p, astnode* block)
 {
     for (size_t i = 0; i < block->children.size; i++)
     {
+        reserve_instructions(p, MAX_NODE_INSTRUCTIONS);
         compile_statement(p, vector_get(&block->children, i));
     }
+
+    reserve_instructions(p, MAX_NODE_INSTRUCTIONS);
 }
 
 void compile_statement(program* p, astnode* statement)
@@ -60,6 +181,14 @@ void compile_statement(program* p, astnode* statement)
             compile_loop(p, statement);
             break;
 
+        case AST_RANGE_LOOP:
+            compile_range_loop(p, statement);
+            break;
+
+        case AST_EACH_LOOP:
+            compile_each_loop(p, statement);
+            break;
+
         case AST_BRANCHES:
             compile_branches(p, statement);
             break;
@@ -68,6 +197,10 @@ void compile_statement(program* p, astnode* statement)
             compile_table_put(p, statement);
             break;
 
+        case AST_SNAPSHOT:
+            p->code[p->length++].stackop.op = OP_SNAPSHOT;
+            break;
+
         default:
             compilererr(p, statement->pos, "Failed to compile statement into bytecode!");
     }
@@ -77,13 +210,22 @@ void compile_assignment(program* p, astnode* s)
 {
     vm_scope scope;
     astnode* rhs = vector_get(&s->children, 0);
-    int16_t address = register_variable(p, s->value, &scope);
+    int16_t address = register_variable(p, s->sym, &scope);
 
     if (address >= MAX_LOCAL_VARIABLES) {
         compilererr(p, s->pos, "Maxmum variables in local scope achieved!");
     }
 
+    if (compile_update(p, s, address, scope)) {
+        return;
+    }
+
     compile_expression(p, rhs);
+
+    if (rhs->type == AST_FUNCTION) {
+        inline_register(p, s, scope);
+    }
+
     p->code[p->length].sx.sx = address;
     p->code[p->length].sx.op = scope_store_op_map[scope];
     p->length++;
@@ -91,10 +233,24 @@ void compile_assignment(program* p, astnode* s)
 
 void compile_call(program* p, astnode* call)
 {
+    program* f = inline_candidate(p, call);
+
+    if (f != NULL) {
+        compile_inline(p, call, f);
+        return;
+    }
+
+    vm_op intrinsic = intrinsic_candidate(p, call);
+
     for (size_t i = 1; i < call->children.size; i++)
     {
         compile_expression(p, vector_get(&call->children, i));   
     }
+
+    if (intrinsic != OP_NOP) {
+        p->code[p->length++].stackop.op = intrinsic;
+        return;
+    }
     
     // vm_scope scope;
     // p->code[p->length].sx.sx = dereference_variable(p, call->value, &scope);
@@ -105,24 +261,51 @@ void compile_call(program* p, astnode* call)
     //     compilererr(p, call->pos, "Unknown function name!");
     // }
 
-    compile_expression(p, vector_rm(&call->children, 0));
+    // the callee stays in the tree, which is compiled again if compiling
+    // a deferred function fails while trying to inline it
+    astnode* callee = vector_get(&call->children, 0);
+    astnode* key = callee->children.size == 2 ? vector_get(&callee->children, 1) : NULL;
+    size_t argc = call->children.size - 1;
+
+    // methods t.name are looked up and called in one dispatch, through
+    // a cache of where the key was found for this call site
+    if (callee->type == AST_BINARY_EXPRESSION && streq(callee->value, "[]") && key->type == AST_STRING
+            && argc <= 0xff) {
+        compile_expression(p, vector_get(&callee->children, 0));
+
+        p->code[p->length].ax.op = OP_INVOKE;
+        p->code[p->length].ax.a = argc;
+        p->code[p->length].ax.sx = register_invoke_cache(p, invoke_cache_new(value_from_node(key)));
+        p->length++;
+        return;
+    }
+
+    compile_expression(p, callee);
 
     p->code[p->length].ux.op = OP_CALL;
-    p->code[p->length].ux.ux = call->children.size;
+    p->code[p->length].ux.ux = argc;
     p->length++;
 }
 
 void compile_function(program* p, astnode* function)
 {
     program* p0 = malloc(sizeof(program));
-    p0->code = malloc(sizeof(instruction) * 0xff);
+    p0->code = NULL;
     p0->length = 0;
-    p0->constants = malloc(sizeof(Value) * 0xff);
+    p0->capacity = 0;
+    p0->constants = NULL;
+    p0->constant_capacity = 0;
     p0->prev = p;
-    p0->constant_table = map_new(37);
-    p0->symbol_table = map_new(37);
-    p0->line_address_table = map_new(37);
+    p0->constant_table = idmap_new(8);
+    p0->symbol_table = idmap_new(8);
+    p0->closure_table = idmap_new(1);
+    p0->line_address_table = map_new(8);
+    p0->jump_tables = vector_new(1);
+    p0->invoke_caches = vector_new(1);
     p0->native = NULL;
+    p0->variadic = false;
+    p0->deferred = function;
+    p0->globals = p->prev == NULL ? p->symbol_table.size : p->globals;
 
     // register parameter names
     astnode* params = vector_get(&function->children, 0);
@@ -130,23 +313,21 @@ void compile_function(program* p, astnode* function)
     {
         vm_scope scope;
         astnode* param = vector_get(&params->children, p0->argc);
-        register_unique_variable_local(p0, param->value, &scope);  
+        register_unique_variable_local(p0, param->sym, &scope);
     
         if (scope == VM_DUPLICATE_IN_SCOPE) {
             compilererr(p0, param->pos, "Duplicate variable name in function definition!");
         }
     }
 
-    // compiles program code
-    compile(p0, vector_get(&function->children, 1));;
-
-    if (p0->code[p0->length-1].stackop.op != OP_RET) {
-        p0->code[p0->length].ux.op = OP_PUSHK;
-        p0->code[p0->length++].ux.ux = register_constant(p0, vNull());
-        p0->code[p0->length++].stackop.op = OP_RET;
+    // nested functions may capture variables, so their closures are only
+    // known once their body is compiled
+    if (p->prev != NULL) {
+        compile_deferred(p0);
     }
 
     // stores code object as local constant
+    reserve_instructions(p, p0->closure_table.size + 2);
     p->code[p->length].ux.op = OP_PUSHK;
     p->code[p->length].ux.ux = register_constant(p, vCode(p0, NULL));
     p->length++;
@@ -167,13 +348,146 @@ void compile_function(program* p, astnode* function)
     }
 }
 
+void compile_deferred(program* p)
+{
+    // code is allocated once compilation begins
+    if (p->deferred == NULL || p->code != NULL) {
+        return;
+    }
+
+    astnode* body = vector_get(&p->deferred->children, 1);
+
+    reserve_instructions(p, MAX_NODE_INSTRUCTIONS);
+    p->constant_capacity = 8;
+    p->constants = malloc(sizeof(Value) * p->constant_capacity);
+
+    // compiles program code
+    replace_scalars(p, body);
+    clear_buffers(p, body);
+    compile(p, body);
+
+    // implicit null return, removed by peephole pass if unreachable
+    p->code[p->length].ux.op = OP_PUSHK;
+    p->code[p->length++].ux.ux = register_constant(p, vNull());
+    p->code[p->length++].stackop.op = OP_RET;
+
+    specialise(p);
+    peephole(p);
+    allocate_regions(p);
+
+    // functions compiled after the program was fused are fused alike
+    if (superinstructions_fused) {
+        fuse_superinstructions(p);
+    }
+
+    p->deferred = NULL;
+}
+
+boolean try_compile_deferred(program* p)
+{
+    if (p->deferred == NULL || p->code != NULL) {
+        return true;
+    }
+
+    error_trap trap = { .raised = false };
+    error_trap* outer = current_trap;
+
+    current_trap = &trap;
+    if (setjmp(trap.env) == 0) {
+        compile_deferred(p);
+    }
+    current_trap = outer;
+
+    if (trap.raised) {
+        reset_deferred(p);
+    }
+
+    return !trap.raised;
+}
+
+// Discards the partly compiled code of a deferred function, leaving it
+// as it was defined so its next compilation starts over
+void reset_deferred(program* p)
+{
+    for (size_t i = 0; i < p->constant_table.size; i++)
+    {
+        Value k = p->constants[i];
+
+        if (k.type == VM_PROGRAM && k.value.to_code->p->native == NULL) {
+            program_delete(k.value.to_code->p);
+            free(k.value.to_code);
+        }
+    }
+
+    for (size_t i = 0; i < p->line_address_table.size; i++) {
+        free((char*) p->line_address_table.keys[i]);
+        line_entry_free(p->line_address_table.values[i]);
+    }
+
+    for (size_t i = 0; i < p->jump_tables.size; i++)
+    {
+        jump_table* t = vector_get(&p->jump_tables, i);
+        free(t->keys);
+        free(t->cases);
+        free(t);
+    }
+
+    for (size_t i = 0; i < p->invoke_caches.size; i++) {
+        free(vector_get(&p->invoke_caches, i));
+    }
+
+    free(p->code);
+    free(p->constants);
+    p->code = NULL;
+    p->length = 0;
+    p->capacity = 0;
+    p->constants = NULL;
+    p->constant_capacity = 0;
+    p->line_address_table.size = 0;
+    p->jump_tables.size = 0;
+    p->invoke_caches.size = 0;
+
+    idmap_delete(&p->constant_table);
+    idmap_delete(&p->symbol_table);
+    p->constant_table = idmap_new(8);
+    p->symbol_table = idmap_new(8);
+
+    // parameters keep the first slots
+    astnode* params = vector_get(&p->deferred->children, 0);
+
+    for (size_t i = 0; i < params->children.size; i++) {
+        vm_scope scope;
+        astnode* param = vector_get(&params->children, i);
+        register_unique_variable_local(p, param->sym, &scope);
+    }
+}
+
+void compile_all(program* p)
+{
+    for (size_t i = 0; i < p->constant_table.size; i++)
+    {
+        Value k = p->constants[i];
+
+        if (k.type == VM_PROGRAM && k.value.to_code->p->native == NULL) {
+            compile_deferred(k.value.to_code->p);
+            compile_all(k.value.to_code->p);
+        }
+    }
+}
+
 void compile_expression(program* p, astnode* expression)
 {
     vm_scope scope;
+    reserve_instructions(p, MAX_NODE_INSTRUCTIONS);
 
     switch (expression->type)
     {
         case AST_BINARY_EXPRESSION:
+            if (streq(expression->value, "&&") || streq(expression->value, "||")) {
+                compile_logical(p, expression);
+                break;
+            }
+
             compile_expression(p, vector_get(&expression->children, 0));
             compile_expression(p, vector_get(&expression->children, 1));
             p->code[p->length++].stackop.op = decode_binary_op(expression->value);
@@ -193,7 +507,7 @@ void compile_expression(program* p, astnode* expression)
             break;
 
         case AST_REFERENCE:
-            p->code[p->length].sx.sx = dereference_variable(p, expression->value, &scope);
+            p->code[p->length].sx.sx = dereference_variable(p, expression->sym, &scope);
             p->code[p->length].sx.op = scope_load_op_map[scope];
             p->length++;
 
@@ -218,43 +532,182 @@ void compile_expression(program* p, astnode* expression)
         default:
             compilererr(p, expression->pos, "Failed to compile expression!");
     }
+
+    reserve_instructions(p, MAX_NODE_INSTRUCTIONS);
 }
 
 void compile_loop(program* p, astnode* loop)
 {
-    int pos0 = p->length;
+    idmap exits = idmap_new(4);
+    idmap repeats = idmap_new(4);
+    astnode* cond = vector_get(&loop->children, 0);
+
+    // preheader with hoisted invariants, skipped along with the loop
+    // if its values were hoisted from the body, in which case the guard
+    // is also the entry test
+    if (loop->children.size > 3) {
+        compile_condition(p, vector_get(&loop->children, 3), false, &exits);
+        compile(p, vector_get(&loop->children, 2));
+    } else {
+        if (loop->children.size > 2) compile(p, vector_get(&loop->children, 2));
+        compile_condition(p, cond, false, &exits);
+    }
+
+    // condition is tested again after the body, so every iteration
+    // takes a single branch back to the top
+    size_t top = p->length;
+
+    compile(p, vector_get(&loop->children, 1));
+    compile_condition(p, cond, true, &repeats);
+
+    patch_jumps(p, &repeats, top);
+    patch_jumps(p, &exits, p->length);
+
+    idmap_delete(&exits);
+    idmap_delete(&repeats);
+}
+
+void compile_range_loop(program* p, astnode* loop)
+{
+    vm_scope scope;
+    astnode* counter = vector_get(&loop->children, 0);
+    int16_t address = register_variable(p, counter->sym, &scope);
+
+    if (address >= MAX_LOCAL_VARIABLES) {
+        compilererr(p, counter->pos, "Maxmum variables in local scope achieved!");
+    }
+
+    compile_expression(p, vector_get(&counter->children, 0));
+    compile_expression(p, vector_get(&loop->children, 1));
+    compile_expression(p, vector_get(&loop->children, 2));
+
+    size_t prep = p->length++;
+    size_t top = p->length;
+
+    p->code[p->length].sx.sx = address;
+    p->code[p->length].sx.op = scope_store_op_map[scope];
+    p->length++;
+
+    compile(p, vector_get(&loop->children, 3));
+
+    p->code[p->length].sx.op = OP_FORLOOP;
+    p->code[p->length].sx.sx = top - p->length - 1;
+    p->length++;
+
+    p->code[prep].sx.op = OP_FORPREP;
+    p->code[prep].sx.sx = p->length - prep - 1;
+
+    // discards the counter pushed on exit along with the loop state
+    for (size_t i = 0; i < 4; i++) {
+        p->code[p->length++].stackop.op = OP_POP;
+    }
+}
+
+void compile_each_loop(program* p, astnode* loop)
+{
+    vm_scope key_scope, value_scope;
+    astnode* key = vector_get(&loop->children, 2);
+    astnode* value = loop->children.size > 3 ? vector_get(&loop->children, 3) : NULL;
+    int16_t key_address = register_variable(p, key->sym, &key_scope);
+    int16_t value_address = value == NULL ? 0 : register_variable(p, value->sym, &value_scope);
+
+    if (key_address >= MAX_LOCAL_VARIABLES || value_address >= MAX_LOCAL_VARIABLES) {
+        compilererr(p, loop->pos, "Maxmum variables in local scope achieved!");
+    }
 
     compile_expression(p, vector_get(&loop->children, 0));
-    p->code[p->length++].stackop.op = OP_JIF;
 
-    int pos1 = p->length++;
-    
+    size_t iter = p->length++;
+    size_t top = p->length;
+
+    if (value != NULL) {
+        p->code[p->length].sx.sx = value_address;
+        p->code[p->length].sx.op = scope_store_op_map[value_scope];
+        p->length++;
+    } else {
+        p->code[p->length++].stackop.op = OP_POP;
+    }
+
+    // the key stays on the stack to locate the entry on the next step
+    p->code[p->length].sx.sx = key_address;
+    p->code[p->length].sx.op = key_scope == VM_LOCAL_SCOPE ? OP_STORLK : OP_STORGK;
+    p->length++;
+
     compile(p, vector_get(&loop->children, 1));
 
-    // restart loop
-    p->code[p->length].sx.op = OP_JMP;
-    p->code[p->length].sx.sx = pos0 - p->length - 1;
+    p->code[p->length].sx.op = OP_TNEXT;
+    p->code[p->length].sx.sx = top - p->length - 1;
     p->length++;
 
-    // jump to end
-    p->code[pos1].sx.op = OP_JMP;
-    p->code[pos1].sx.sx = p->length - pos1 - 1;
+    p->code[iter].sx.op = OP_TITER;
+    p->code[iter].sx.sx = p->length - iter - 1;
+
+    // discards the value pushed on exit along with the loop state
+    for (size_t i = 0; i < 4; i++) {
+        p->code[p->length++].stackop.op = OP_POP;
+    }
+}
+
+void compile_condition(program* p, astnode* cond, boolean jump_if, idmap* jumps)
+{
+    boolean conjunction = cond->type == AST_BINARY_EXPRESSION && streq(cond->value, "&&");
+    boolean disjunction = cond->type == AST_BINARY_EXPRESSION && streq(cond->value, "||");
+    reserve_instructions(p, MAX_NODE_INSTRUCTIONS);
+
+    if (cond->type == AST_UNARY_EXPRESSION && streq(cond->value, "!"))
+    {
+        compile_condition(p, vector_get(&cond->children, 0), !jump_if, jumps);
+    }
+    else if ((conjunction && !jump_if) || (disjunction && jump_if))
+    {
+        // either operand alone takes the jump
+        compile_condition(p, vector_get(&cond->children, 0), jump_if, jumps);
+        compile_condition(p, vector_get(&cond->children, 1), jump_if, jumps);
+    }
+    else if (conjunction || disjunction)
+    {
+        // left operand alone decides against the jump, skipping the right
+        idmap skip = idmap_new(4);
+
+        compile_condition(p, vector_get(&cond->children, 0), !jump_if, &skip);
+        compile_condition(p, vector_get(&cond->children, 1), jump_if, jumps);
+
+        patch_jumps(p, &skip, p->length);
+        idmap_delete(&skip);
+    }
+    else
+    {
+        compile_expression(p, cond);
+        p->code[p->length].sx.op = jump_if ? OP_JTRUE : OP_JFALSE;
+        idmap_put(jumps, p->length++);
+    }
+}
+
+void patch_jumps(program* p, idmap* jumps, size_t target)
+{
+    for (size_t i = 0; i < jumps->size; i++) {
+        p->code[jumps->keys[i]].sx.sx = target - jumps->keys[i] - 1;
+    }
 }
 
 void compile_branches(program* p, astnode* branches)
 {
+    if (compile_switch(p, branches)) {
+        return;
+    }
+
+    idmap skip = idmap_new(4);
+
     // compile condition
-    compile_expression(p, vector_get(&branches->children, 0));
-    p->code[p->length++].stackop.op = OP_JIF;
-    int pos0 = p->length++;
+    compile_condition(p, vector_get(&branches->children, 0), false, &skip);
 
     // compile body
     compile(p, vector_get(&branches->children, 1));
     int pos1 = p->length++;
 
     // skip body if condition not met
-    p->code[pos0].sx.op = OP_JMP;
-    p->code[pos0].sx.sx = p->length - pos0 - 1;
+    patch_jumps(p, &skip, p->length);
+    idmap_delete(&skip);
 
     astnode* alt = vector_get(&branches->children, 2);
 
@@ -275,6 +728,83 @@ void compile_branches(program* p, astnode* branches)
     }
 }
 
+boolean compile_switch(program* p, astnode* branches)
+{
+    astnode* subject = NULL;
+    astnode* cases[MAX_SWITCH_CASES];
+    Value keys[MAX_SWITCH_CASES];
+    size_t count = 0;
+
+    astnode* branch = branches;
+
+    // collects leading branches comparing the subject with a constant
+    for (; branch != NULL && streq(branch->value, "conditional") && count < MAX_SWITCH_CASES; branch = vector_get(&branch->children, 2))
+    {
+        astnode* cond = vector_get(&branch->children, 0);
+
+        if (cond->type != AST_BINARY_EXPRESSION || strcmp(cond->value, "==")) {
+            break;
+        }
+
+        astnode* ref = vector_get(&cond->children, 0);
+        astnode* key = vector_get(&cond->children, 1);
+
+        if (ref->type != AST_REFERENCE) {
+            astnode* tmp = ref;
+            ref = key;
+            key = tmp;
+        }
+
+        if (ref->type != AST_REFERENCE || (key->type != AST_INTEGER && key->type != AST_STRING)
+                || (subject != NULL && ref->sym != subject->sym)
+                || (count > 0 && value_from_node(key).type != keys[0].type)) {
+            break;
+        }
+
+        subject = ref;
+        cases[count] = vector_get(&branch->children, 1);
+        keys[count++] = value_from_node(key);
+    }
+
+    if (count < MIN_SWITCH_CASES) {
+        return false;
+    }
+
+    compile_expression(p, subject);
+    reserve_instructions(p, count + 2);
+    p->code[p->length].ux.op = OP_SWITCH;
+    p->code[p->length++].ux.ux = register_jump_table(p, jump_table_new(keys, count));
+
+    // one jump per case followed by the default, patched below
+    size_t slots = p->length;
+    idmap exits = idmap_new(count);
+
+    for (size_t i = 0; i <= count; i++) {
+        p->code[p->length++].sx.op = OP_JMP;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        p->code[slots + i].sx.sx = p->length - slots - i - 1;
+        compile(p, cases[i]);
+
+        idmap_put(&exits, p->length);
+        p->code[p->length++].sx.op = OP_JMP;
+    }
+
+    p->code[slots + count].sx.sx = p->length - slots - count - 1;
+
+    if (branch != NULL && streq(branch->value, "conditional")) {
+        compile_branches(p, branch);
+    } else if (branch != NULL) {
+        compile(p, vector_get(&branch->children, 0));
+    }
+
+    patch_jumps(p, &exits, p->length);
+    idmap_delete(&exits);
+    return true;
+}
+
 void compile_table(program* p, astnode* table)
 {
     p->code[p->length++].stackop.op = OP_TNEW;
@@ -284,7 +814,7 @@ void compile_table(program* p, astnode* table)
         astnode* pair = vector_get(&table->children, i);
         compile_expression(p, pair->children.items[0]); 
         compile_expression(p, pair->children.items[1]);
-        p->code[p->length++].stackop.op = OP_TPUT;
+        p->code[p->length++].stackop.op = OP_TPUTK;
     }
 }
 
@@ -297,140 +827,288 @@ void compile_table_put(program* p, astnode* put)
     }
 
     compile_expression(p, vector_get(&put->children, 1));
-    p->code[p->length++].stackop.op = OP_TPUT;
+
+    if (streq(put->value, "put")) {
+        p->code[p->length++].stackop.op = OP_TPUT;
+    } else {
+        p->code[p->length].ax.op = OP_TUPDATE;
+        p->code[p->length++].ax.a = decode_binary_op(put->value);
+    }
 }
 
+// Compiles assignments applying an arithmetic operation to the variable
+// itself, x <- x + v, as one update of the variable by the operand.
+// Strings which are never shared are appended to in place.
+boolean compile_update(program* p, astnode* s, int16_t address, vm_scope scope)
+{
+    astnode* rhs = vector_get(&s->children, 0);
 
-void create_native(program* p, const char* name, Value (*f)(Value[]), int argc)
+    if (rhs->type != AST_BINARY_EXPRESSION || (scope != VM_LOCAL_SCOPE && scope != VM_GLOBAL_SCOPE)) {
+        return false;
+    }
+
+    astnode* var = vector_get(&rhs->children, 0);
+    astnode* operand = vector_get(&rhs->children, 1);
+
+    if (var->type != AST_REFERENCE || var->sym != s->sym) {
+        return false;
+    } else if (!streq(rhs->value, "+") && !streq(rhs->value, "-") && !streq(rhs->value, "*") && !streq(rhs->value, "/")) {
+        return false;
+    }
+
+    // calls may reassign a global after it would have been loaded
+    if (scope == VM_GLOBAL_SCOPE && contains_call(operand)) {
+        return false;
+    }
+
+    vm_scope buffer_scope;
+    int16_t buffer = is_owned_append(s) ? register_variable(p, buffer_symbol(s->sym), &buffer_scope) : -1;
+
+    compile_expression(p, operand);
+
+    if (buffer != -1 && buffer < MAX_LOCAL_VARIABLES) {
+        p->code[p->length].ax.op = scope == VM_LOCAL_SCOPE ? OP_APPENDL : OP_APPENDG;
+        p->code[p->length].ax.a = buffer;
+    } else {
+        p->code[p->length].ax.op = scope == VM_LOCAL_SCOPE ? OP_UPDATEL : OP_UPDATEG;
+        p->code[p->length].ax.a = decode_binary_op(rhs->value);
+    }
+
+    p->code[p->length++].ax.sx = address;
+    return true;
+}
+
+// Evaluates && and || to a boolean, only evaluating the right operand
+// if the left does not decide the result
+void compile_logical(program* p, astnode* expression)
 {
-    program* p0 = (program*) malloc(sizeof(program));
-    p0->code = NULL;
-    p0->length = 0;
-    p0->argc = argc;
-    p0->constants = NULL;
-    p0->symbol_table = map_new(0);
-    p0->constant_table = map_new(0);
-    p0->closure_table = map_new(0);
-    p0->line_address_table = map_new(0);
-    p0->prev = p;
-    p0->native = f;
+    idmap jumps = idmap_new(4);
+
+    compile_condition(p, expression, false, &jumps);
 
     p->code[p->length].ux.op = OP_PUSHK;
-    p->code[p->length].ux.ux = register_constant(p, vCode(p0, NULL));
-    p->length++;
+    p->code[p->length++].ux.ux = register_constant(p, vBool(true));
+    p->code[p->length].sx.op = OP_JMP;
+    p->code[p->length++].sx.sx = 1;
 
-    vm_scope scope;
-    uint16_t address = register_variable(p, name, &scope);
-    
-    if (address >= MAX_LOCAL_VARIABLES) {
-        lxpos pos = { .col_pos = 0, .line_pos = 0, .line_offset = 0, .char_offset = 0};
-        compilererr(p, pos, "Maxmum variables in local scope achieved!");
-    }
+    patch_jumps(p, &jumps, p->length);
+    idmap_delete(&jumps);
 
-    // stores code at address
-    p->code[p->length].sx.sx = address;
-    p->code[p->length].sx.op = scope_store_op_map[scope];
-    p->length++;
+    p->code[p->length].ux.op = OP_PUSHK;
+    p->code[p->length++].ux.ux = register_constant(p, vBool(false));
 }
 
+// included files parsed by the workers of parse_includes, in the order
+// they were found, indexed by canonical path
+idmap module_ids = { NULL, NULL, 0, 0 };
+vector modules = { NULL, 0, 0 };
+size_t modules_queued = 0;
+size_t modules_parsing = 0;
+pthread_mutex_t module_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t module_change = PTHREAD_COND_INITIALIZER;
+
 void run_import(program* p, astnode* filepath)
 {
     if (p->prev != NULL) {
         compilererr(p, filepath->pos, "Cannot import in local scope!");
     }
+    
+    astnode* block = parse_import(filepath);
 
-    // determines absolute system path of include
-    char* path = (char*)malloc(sizeof(char) * 512);
-    path[0] = '\0';
-    strcpy(path, filepath->pos.origin);
-    dirname(path);
-    strcat(path, "/");
-    strcat(path, filepath->value);
+    if (block != NULL) {
+        compile(p, block);
+    }
+}
 
-    const char* src = read_file(path);
+astnode* parse_import(astnode* filepath)
+{
+    char* path = include_path(filepath);
 
-    vector tokens = vector_new(64);
-    lexer lx = lexer_new(src, path);
-    lexify(&lx, &tokens);
+    // the including file is part of the program, so cycles end there too
+    first_inclusion(filepath->pos.origin);
 
-    parser p0 = {
-        .position = 0,
-        .source = src,
-        .tokens = tokens
-    };
+    if (!first_inclusion(path)) {
+        free(path);
+        return NULL;
+    }
 
-    astnode* tree = parse(&p0);
-    
-    compile(p, tree);
+    // files parsed ahead of time are taken from the module table
+    int id = module_ids.capacity ? idmap_get(&module_ids, canonical_path(path)) : -1;
+    module* m;
+
+    if (id == -1) {
+        m = module_new(path);
+
+        // kept along with the modules parsed ahead of time, before parsing
+        // so that a file failing to parse is released too
+        if (module_ids.capacity == 0) module_ids = idmap_new(16);
+        if (modules.capacity == 0) modules = vector_new(16);
+
+        idmap_put(&module_ids, canonical_path(path));
+        vector_push(&modules, m);
+        parse_module(m);
+    } else {
+        free(path);
+        m = vector_get(&modules, id);
+
+        // errors of the workers are raised here, in include order and on
+        // the compiling thread, by parsing the file again
+        if (m->failed) {
+            release_tokens(&m->tokens, NULL);
+            free((char*) m->src);
+            m->failed = false;
+            parse_module(m);
+        }
+    }
+
+    image_add_source(m->path, m->src);
+    return m->block;
+}
+
+void expand_includes(astnode* block)
+{
+    for (size_t i = 0; i < block->children.size; i++)
+    {
+        astnode* st = vector_get(&block->children, i);
+
+        switch (st->type)
+        {
+            case AST_INCLUDE:
+                // splices included statements in place of the include
+                vector_rm(&block->children, i);
+                astnode* tree = parse_import(vector_get(&st->children, 0));
+
+                for (size_t j = 0; tree != NULL && j < tree->children.size; j++) {
+                    vector_insert(&block->children, i + j, vector_get(&tree->children, j));
+                }
+
+                // revisits spliced statements to expand nested includes
+                i--;
+                break;
+
+            case AST_LOOP:
+                expand_includes(vector_get(&st->children, 1));
+                break;
+
+            case AST_RANGE_LOOP:
+                expand_includes(vector_get(&st->children, 3));
+                break;
+
+            case AST_EACH_LOOP:
+                expand_includes(vector_get(&st->children, 1));
+                break;
+
+            case AST_BRANCHES:
+                for (astnode* b = st; b != NULL; b = vector_get(&b->children, 2)) {
+                    expand_includes(vector_get(&b->children, streq(b->value, "alt") ? 0 : 1));
+                    if (streq(b->value, "alt")) break;
+                }
+                break;
+            
+            default:
+                break;
+        }
+    }
 }
 
 // ---------------- MEMORY STORE ----------------
 
 uint16_t register_constant(program* p, Value v)
 {
-    Value* address;
+    uint64_t key = constant_key(v);
+    int address = idmap_get(&p->constant_table, key);
 
-    if ((address = map_get(&p->constant_table, value_to_str(&v))) == NULL) 
+    if (address == -1) 
     {
-        address = malloc(sizeof(Value));
-        *address = vInt(p->constant_table.size);
-
-        if (address->value.to_int >= MAX_LOCAL_CONSTANTS) {
+        if (p->constant_table.size >= MAX_LOCAL_CONSTANTS) {
             failure("Max constants in local scope reached!");
+        } else if (p->constant_table.size == p->constant_capacity) {
+            p->constant_capacity *= 2;
+            p->constants = realloc(p->constants, sizeof(Value) * p->constant_capacity);
         }
 
-        map_put(&p->constant_table, value_to_str(&v), address);
-        p->constants[address->value.to_int] = v;
+        address = idmap_put(&p->constant_table, key);
+        p->constants[address] = v;
     }
     
-    return address->value.to_int;
+    return address;
+}
+
+void reserve_instructions(program* p, size_t n)
+{
+    if (p->length + n <= p->capacity) {
+        return;
+    }
+
+    while (p->length + n > p->capacity) {
+        p->capacity = p->capacity == 0 ? MAX_NODE_INSTRUCTIONS : p->capacity * 2;
+    }
+
+    p->code = realloc(p->code, sizeof(instruction) * p->capacity);
+}
+
+uint16_t register_jump_table(program* p, jump_table* t)
+{
+    for (size_t i = 0; i < p->jump_tables.size; i++) {
+        if (vector_get(&p->jump_tables, i) == t) return i;
+    }
+
+    vector_push(&p->jump_tables, t);
+    return p->jump_tables.size - 1;
 }
 
-int16_t register_variable(program* p, const char* name, vm_scope* scope)
+uint16_t register_invoke_cache(program* p, invoke_cache* c)
+{
+    vector_push(&p->invoke_caches, c);
+    return p->invoke_caches.size - 1;
+}
+
+int16_t register_variable(program* p, symbol name, vm_scope* scope)
 {
     size_t address = dereference_variable(p, name, scope);
 
     if (*scope == VM_UNKNOWN_SCOPE) {
-        Value* a = malloc(sizeof(Value)); 
-        *a = vInt(p->symbol_table.size);
-        map_put(&p->symbol_table, name, a);
         *scope = p->prev == NULL ? VM_GLOBAL_SCOPE : VM_LOCAL_SCOPE;
-        return a->value.to_int;
+        return idmap_put(&p->symbol_table, name);
     } else {
         return address;
     }
 }
 
-// TODO: change this, poorly implemented
-int16_t register_unique_variable_local(program* p, const char* name, vm_scope* scope)
+int16_t register_unique_variable_local(program* p, symbol name, vm_scope* scope)
 {
-    Value* address = map_get(&p->symbol_table, name);
-
-    if (address == NULL) {
-        address = malloc(sizeof(Value));
-        *address = vInt(p->symbol_table.size);
-        map_put(&p->symbol_table, name, address);
-        *scope = p->prev == NULL ? VM_GLOBAL_SCOPE : VM_LOCAL_SCOPE;
-        return address->value.to_int;
-    } else {
+    if (idmap_has(&p->symbol_table, name)) {
         *scope = VM_DUPLICATE_IN_SCOPE;
-        return address->value.to_int;
+        return idmap_get(&p->symbol_table, name);
+    } else {
+        *scope = p->prev == NULL ? VM_GLOBAL_SCOPE : VM_LOCAL_SCOPE;
+        return idmap_put(&p->symbol_table, name);
     }
 }
 
-int16_t dereference_variable(program* p, const char* name, vm_scope* scope)
+int16_t dereference_variable(program* p, symbol name, vm_scope* scope)
 {
-    Value* address = map_get(&p->symbol_table, name);
+    int address = idmap_get(&p->symbol_table, name);
     program* p0 = p;
 
     // iteratively determines variable location
-    while (address == NULL && p0->prev != NULL) {
+    while (address == -1 && p0->prev != NULL) {
         p0 = p0->prev;
-        address = map_get(&p0->symbol_table, name);
+        address = idmap_get(&p0->symbol_table, name);
+    }
+
+    // globals defined after a function are not visible to it
+    if (p0->prev == NULL && address >= 0 && (size_t) address >= p->globals) {
+        address = -1;
+    }
+
+    // built-ins become globals once named by the program
+    if (address == -1 && builtin_find(name) != NULL) {
+        address = idmap_put(&p0->symbol_table, name);
     }
 
     // determines scope of variable
-    if (address == NULL) {
+    if (address == -1) {
         *scope = VM_UNKNOWN_SCOPE;
         return 0;
     } else if (p0->prev == NULL) {
@@ -438,24 +1116,407 @@ int16_t dereference_variable(program* p, const char* name, vm_scope* scope)
     } else if (p0 == p) {
         *scope = VM_LOCAL_SCOPE;
     } else {
+        // retrieves or registers closure address
         *scope = VM_CLOSED_SCOPE;
+        address = idmap_put(&p->closure_table, name);
+    }
+    
+    return address;
+}
 
-        // retrieves or registers closure address
-        if (map_has(&p->closure_table, name)) {
-            address = map_get(&p->closure_table, name);
+void parse_includes(astnode* tree)
+{
+    vector includes = vector_new(8);
+    find_includes(tree, &includes);
+
+    if (includes.size == 0) {
+        free(includes.items);
+        return;
+    }
+
+    // tables left by the program compiled before, emptied by reset_includes
+    if (module_ids.capacity != 0) idmap_delete(&module_ids);
+    free(modules.items);
+
+    module_ids = idmap_new(16);
+    modules = vector_new(16);
+
+    for (size_t i = 0; i < includes.size; i++)
+    {
+        char* path = include_path(vector_get(&includes, i));
+
+        if (!idmap_has(&module_ids, canonical_path(path))) {
+            idmap_put(&module_ids, canonical_path(path));
+            vector_push(&modules, module_new(path));
         } else {
-            Value* a = malloc(sizeof(Value)); 
-            *a = vInt(p->closure_table.size);
-            map_put(&p->closure_table, name, a);
-            address = a;
+            free(path);
         }
     }
-    
-    return address->value.to_int;
+
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers < 1) workers = 1;
+    if (workers > MAX_PARSE_WORKERS) workers = MAX_PARSE_WORKERS;
+
+    pthread_t threads[MAX_PARSE_WORKERS];
+
+    for (long i = 0; i < workers; i++) {
+        pthread_create(&threads[i], NULL, parse_worker, NULL);
+    }
+
+    for (long i = 0; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(includes.items);
+}
+
+// Parses queued modules until none are left and no worker may queue more,
+// queueing the files each module includes
+void* parse_worker(void* arg)
+{
+    pthread_mutex_lock(&module_lock);
+
+    while (true)
+    {
+        while (modules_queued == modules.size && modules_parsing > 0) {
+            pthread_cond_wait(&module_change, &module_lock);
+        }
+
+        if (modules_queued == modules.size) {
+            break;
+        }
+
+        module* m = vector_get(&modules, modules_queued++);
+        modules_parsing++;
+        pthread_mutex_unlock(&module_lock);
+
+        // an error is kept by the module, to be raised when it is included
+        error_trap trap = { .raised = false };
+        current_trap = &trap;
+        node_arena = &m->nodes;
+
+        if (setjmp(trap.env) == 0) {
+            parse_module(m);
+        }
+
+        current_trap = NULL;
+        node_arena = NULL;
+        m->failed = trap.raised;
+
+        vector includes = vector_new(8);
+
+        if (!m->failed) {
+            find_includes(m->block, &includes);
+        }
+
+        pthread_mutex_lock(&module_lock);
+
+        for (size_t i = 0; i < includes.size; i++)
+        {
+            char* path = include_path(vector_get(&includes, i));
+            symbol s = canonical_path(path);
+
+            if (!idmap_has(&module_ids, s)) {
+                idmap_put(&module_ids, s);
+                vector_push(&modules, module_new(path));
+            } else {
+                free(path);
+            }
+        }
+
+        free(includes.items);
+        modules_parsing--;
+        pthread_cond_broadcast(&module_change);
+    }
+
+    pthread_mutex_unlock(&module_lock);
+    return NULL;
 }
 
 // ------------------- UTILS --------------------
 
+// canonical paths of the files included in the program
+idmap included_files = { NULL, NULL, 0, 0 };
+
+// Records a file as included, returns false if it already was
+boolean first_inclusion(const char* path)
+{
+    if (included_files.capacity == 0) {
+        included_files = idmap_new(16);
+    }
+
+    symbol s = canonical_path(path);
+
+    if (idmap_has(&included_files, s)) {
+        return false;
+    }
+
+    idmap_put(&included_files, s);
+    return true;
+}
+
+void reset_includes()
+{
+    if (included_files.capacity != 0) {
+        idmap_delete(&included_files);
+        included_files = (idmap) { NULL, NULL, 0, 0 };
+    }
+
+    // modules parsed ahead of time belong to the program they were read for
+    if (module_ids.capacity != 0) {
+        idmap_delete(&module_ids);
+        module_ids = (idmap) { NULL, NULL, 0, 0 };
+        modules.size = 0;
+        modules_queued = 0;
+    }
+}
+
+void release_includes(vector* kept)
+{
+    for (size_t i = 0; i < modules.size; i++)
+    {
+        module* m = vector_get(&modules, i);
+
+        // statements of the file were spliced into the including block
+        release_tokens(&m->tokens, kept);
+        astnode_release(&m->nodes);
+        vector_push(kept, (char*) m->src);
+        vector_push(kept, (char*) m->path);
+        free(m);
+    }
+
+    reset_includes();
+}
+
+void release_tokens(vector* tokens, vector* kept)
+{
+    for (size_t i = 0; i < tokens->size; i++)
+    {
+        lxtoken* tk = vector_get(tokens, i);
+
+        // identifiers are interned, other values may be used as constants
+        if (tk->type != LX_SYMBOL && kept != NULL) {
+            vector_push(kept, (char*) tk->value);
+        } else if (tk->type != LX_SYMBOL) {
+            free((char*) tk->value);
+        }
+        free(tk);
+    }
+
+    free(tokens->items);
+    *tokens = (vector) { NULL, 0, 0 };
+}
+
+void program_delete(program* p)
+{
+    for (size_t i = 0; i < p->constant_table.size; i++)
+    {
+        Value k = p->constants[i];
+
+        if (k.type == VM_PROGRAM && k.value.to_code->p->native == NULL) {
+            program_delete(k.value.to_code->p);
+            free(k.value.to_code);
+        }
+    }
+
+    for (size_t i = 0; i < p->line_address_table.size; i++) {
+        free((char*) p->line_address_table.keys[i]);
+        line_entry_free(p->line_address_table.values[i]);
+    }
+
+    for (size_t i = 0; i < p->jump_tables.size; i++)
+    {
+        jump_table* t = vector_get(&p->jump_tables, i);
+        free(t->keys);
+        free(t->cases);
+        free(t);
+    }
+
+    for (size_t i = 0; i < p->invoke_caches.size; i++) {
+        free(vector_get(&p->invoke_caches, i));
+    }
+
+    free(p->code);
+    free(p->constants);
+    free(p->line_address_table.keys);
+    free(p->line_address_table.values);
+    free(p->jump_tables.items);
+    free(p->invoke_caches.items);
+    idmap_delete(&p->symbol_table);
+    idmap_delete(&p->constant_table);
+    idmap_delete(&p->closure_table);
+    free(p);
+}
+
+// Returns the interned absolute path of a file with links resolved, or
+// the path itself if the file does not exist
+symbol canonical_path(const char* path)
+{
+    char canonical[4096];
+
+#ifdef __MINGW32__
+    if (_fullpath(canonical, path, sizeof(canonical)) == NULL) strcpy(canonical, path);
+#else
+    if (realpath(path, canonical) == NULL) strcpy(canonical, path);
+#endif
+
+    return intern(canonical);
+}
+
+// Resolves the path of an included file relative to the including file
+char* include_path(astnode* filepath)
+{
+    // dirname may return static storage rather than truncate its argument,
+    // as for a bare file name whose directory is "."
+    char* origin = strdup(filepath->pos.origin);
+    const char* dir = dirname(origin);
+
+    char* path = (char*)malloc(sizeof(char) * (strlen(dir) + strlen(filepath->value) + 2));
+    sprintf(path, "%s/%s", dir, filepath->value);
+    free(origin);
+    return path;
+}
+
+// Collects the path nodes of the includes expanded in a global block
+void find_includes(astnode* block, vector* includes)
+{
+    for (size_t i = 0; i < block->children.size; i++)
+    {
+        astnode* st = vector_get(&block->children, i);
+
+        switch (st->type)
+        {
+            case AST_INCLUDE:
+                vector_push(includes, vector_get(&st->children, 0));
+                break;
+
+            case AST_LOOP:
+            case AST_EACH_LOOP:
+                find_includes(vector_get(&st->children, 1), includes);
+                break;
+
+            case AST_RANGE_LOOP:
+                find_includes(vector_get(&st->children, 3), includes);
+                break;
+
+            case AST_BRANCHES:
+                for (astnode* b = st; b != NULL; b = vector_get(&b->children, 2)) {
+                    find_includes(vector_get(&b->children, streq(b->value, "alt") ? 0 : 1), includes);
+                    if (streq(b->value, "alt")) break;
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+}
+
+// Reads, lexes and parses the file of a module
+module* module_new(char* path)
+{
+    module* m = malloc(sizeof(module));
+    *m = (module) {
+        .path = path,
+        .src = NULL,
+        .block = NULL,
+        .tokens = { NULL, 0, 0 },
+        .nodes = vector_new(16),
+        .failed = false,
+    };
+    return m;
+}
+
+void parse_module(module* m)
+{
+    m->src = read_file(m->path);
+    m->tokens = vector_new(64);
+
+    lexer lx = lexer_new(m->src, m->path);
+    lexify(&lx, &m->tokens);
+
+    parser p0 = {
+        .position = 0,
+        .source = m->src,
+        .tokens = m->tokens
+    };
+
+    m->block = parse(&p0);
+}
+
+// Starts the buffers of strings appended to in place by a function empty,
+// as their slots may hold values left on the stack by earlier calls
+void clear_buffers(program* p, astnode* node)
+{
+    if (node->type == AST_FUNCTION) {
+        return;
+    }
+
+    if (node->type == AST_ASSIGN && is_owned_append(node) && !idmap_has(&p->symbol_table, buffer_symbol(node->sym)))
+    {
+        vm_scope scope;
+        int16_t address = register_variable(p, buffer_symbol(node->sym), &scope);
+
+        p->code[p->length].ux.op = OP_PUSHK;
+        p->code[p->length++].ux.ux = register_constant(p, vNull());
+        p->code[p->length].sx.op = OP_STORL;
+        p->code[p->length++].sx.sx = address;
+    }
+
+    for (size_t i = 0; i < node->children.size; i++) {
+        clear_buffers(p, vector_get(&node->children, i));
+    }
+}
+
+// Returns true if evaluating the expression may call a function
+boolean contains_call(astnode* node)
+{
+    if (node->type == AST_CALL) {
+        return true;
+    } else if (node->type == AST_FUNCTION) {
+        return false;
+    }
+
+    for (size_t i = 0; i < node->children.size; i++) {
+        if (contains_call(vector_get(&node->children, i))) return true;
+    }
+    return false;
+}
+
+// Derives the constant table key of a value. Code objects are never
+// deduplicated; other constants are keyed on their type and the symbol
+// of their exact textual representation.
+uint64_t constant_key(Value v)
+{
+    char buf[64];
+    symbol s;
+
+    switch (v.type)
+    {
+        case VM_PROGRAM:
+            return ((uint64_t) VM_PROGRAM << 56) | (uintptr_t) v.value.to_code;
+        case VM_STRING:
+            s = intern(v.value.to_str);
+            break;
+        case VM_INT:
+            sprintf(buf, "%li", v.value.to_int);
+            s = intern(buf);
+            break;
+        case VM_FLOAT:
+            sprintf(buf, "%a", v.value.to_float);
+            s = intern(buf);
+            break;
+        case VM_BOOL:
+            s = v.value.to_bool;
+            break;
+        default:
+            s = 0;
+            break;
+    }
+
+    return ((uint64_t) v.type << 56) | s;
+}
+
 vm_op decode_binary_op(const char* operator)
 {
     if (streq(operator, "+")) // arithmetic
@@ -468,11 +1529,7 @@ vm_op decode_binary_op(const char* operator)
         return OP_DIV;
     else if (streq(operator, "%"))
         return OP_MOD;
-    else if (streq(operator, "&&")) // boolean
-        return OP_AND;
-    else if (streq(operator, "||"))
-        return OP_OR;
-    else if (streq(operator, "=="))
+    else if (streq(operator, "==")) // comparison
         return OP_EQ;
     else if (streq(operator, "!="))
         return OP_NE;
@@ -505,7 +1562,6 @@ vm_op decode_unary_op(const char* operator)
     return OP_NOP;
 }
 
-#ifdef HE_DEBUG_MODE
 const char* operation_strings[] = {
     "NOP      ",
     "ADD      ",
@@ -515,14 +1571,31 @@ const char* operation_strings[] = {
     "MOD      ",
     "NEG      ",
     "NOT      ",
-    "AND      ",
-    "OR       ",
     "EQ       ",
     "NE       ",
     "LT       ",
     "LE       ",
     "GT       ",
     "GE       ",
+    "IADD     ",
+    "ISUB     ",
+    "IMUL     ",
+    "ISHL     ",
+    "IMODP    ",
+    "ILT      ",
+    "ILE      ",
+    "IGT      ",
+    "IGE      ",
+    "IEQ      ",
+    "INE      ",
+    "FADD     ",
+    "FSUB     ",
+    "FMUL     ",
+    "FDIV     ",
+    "FLT      ",
+    "FLE      ",
+    "FGT      ",
+    "FGE      ",
     "PUSHK    ",
     "STORG    ",
     "LOADG    ",
@@ -530,27 +1603,66 @@ const char* operation_strings[] = {
     "LOADL    ",
     "STORC    ",
     "LOADC    ",
+    "STORLK   ",
+    "STORGK   ",
+    "UPDATEL  ",
+    "UPDATEG  ",
+    "APPENDL  ",
+    "APPENDG  ",
     "CALL     ",
+    "INVOKE   ",
+    "LEN      ",
+    "SQRT     ",
+    "POW      ",
+    "TOINT    ",
+    "TOFLOAT  ",
+    "TOBOOL   ",
+    "TOSTR    ",
     "RET      ",
     "POP      ",
     "JIF      ",
     "JMP      ",
+    "JFALSE   ",
+    "JTRUE    ",
+    "JLT      ",
+    "JLE      ",
+    "JGT      ",
+    "JGE      ",
+    "JEQ      ",
+    "JNE      ",
+    "JNLT     ",
+    "JNLE     ",
+    "JNGT     ",
+    "JNGE     ",
+    "SWITCH   ",
+    "FORPREP  ",
+    "FORLOOP  ",
+    "TITER    ",
+    "TNEXT    ",
     "CLOSE    ",
+    "CLOSER   ",
     "TNEW     ",
+    "TNEWR    ",
     "TPUT     ",
+    "TPUTK    ",
     "TGET     ",
+    "TUPDATE  ",
     "TREM     ",
+    "SNAPSHOT ",
 };
 
+#ifdef HE_DEBUG_MODE
+
 const char* disassemble_program(program* p) 
 {
-    char* buf = malloc(sizeof(char) * 32 * 100);
+    size_t capacity = 96 * (p->length + 1);
+    char* buf = malloc(sizeof(char) * capacity);
     buf[0] = '\0';
 
     // disassembles instructions
     for (size_t i = 0; i < p->length; i++)
     {
-        char b[5];
+        char b[8];
         sprintf(b, "%03li", i);
         strcat(buf, b);
         strcat(buf, "\t");
@@ -560,15 +1672,18 @@ const char* disassemble_program(program* p)
 
     for (size_t i = 0; i < p->constant_table.size; i++)
     {
-        Value* index = p->constant_table.values[i];
-        Value program = p->constants[index->value.to_int];
+        Value program = p->constants[i];
 
         if (program.type == VM_PROGRAM && program.value.to_code->p->native == NULL)
         {
+            const char* inner = disassemble_program(program.value.to_code->p);
+            capacity += strlen(inner) + 64;
+            buf = realloc(buf, sizeof(char) * capacity);
+
             strcat(buf, "\n");
             strcat(buf, value_to_str(&program));
             strcat(buf, ":\n");
-            strcat(buf, disassemble_program(p->constants[index->value.to_int].value.to_code->p));
+            strcat(buf, inner);
         }
     }
     
@@ -576,7 +1691,15 @@ const char* disassemble_program(program* p)
 }
 
 const char* disassemble(program* p, instruction i) {
-    char* buf = malloc(sizeof(char) * 32);
+    char* buf = malloc(sizeof(char) * 80);
+
+    // superinstructions keep the operand of their first operation, the
+    // second one disassembles on its own line
+    if (i.stackop.op >= VM_BASE_OPS) {
+        i.stackop.op = superinstruction_ops[i.stackop.op - VM_BASE_OPS][0];
+        sprintf(buf, "%s +", disassemble(p, i));
+        return buf;
+    }
 
     switch (i.stackop.op)
     {
@@ -587,34 +1710,83 @@ const char* disassemble(program* p, instruction i) {
         case OP_MOD:
         case OP_NEG:
         case OP_NOT:
-        case OP_AND:
-        case OP_OR:
         case OP_EQ:
         case OP_NE:
         case OP_LT:
         case OP_LE:
         case OP_GT:
         case OP_GE:
+        case OP_IADD:
+        case OP_ISUB:
+        case OP_IMUL:
+        case OP_ILT:
+        case OP_ILE:
+        case OP_IGT:
+        case OP_IGE:
+        case OP_IEQ:
+        case OP_INE:
+        case OP_FADD:
+        case OP_FSUB:
+        case OP_FMUL:
+        case OP_FDIV:
+        case OP_FLT:
+        case OP_FLE:
+        case OP_FGT:
+        case OP_FGE:
         case OP_RET:
         case OP_POP:
         case OP_NOP:
         case OP_JIF:
         case OP_TNEW:
+        case OP_TNEWR:
         case OP_TPUT:
+        case OP_TPUTK:
         case OP_TGET:
         case OP_TREM:
+        case OP_SNAPSHOT:
+        case OP_LEN:
+        case OP_SQRT:
+        case OP_POW:
+        case OP_TOINT:
+        case OP_TOFLOAT:
+        case OP_TOBOOL:
+        case OP_TOSTR:
             sprintf(buf, "%s", operation_strings[i.stackop.op]);
             break;
         
         case OP_CALL:
         case OP_CLOSE:
+        case OP_CLOSER:
+        case OP_ISHL:
+        case OP_IMODP:
             sprintf(buf, "%s %u", operation_strings[i.stackop.op], i.ux.ux);
             break;
         
         case OP_JMP:
+        case OP_JFALSE:
+        case OP_JTRUE:
+        case OP_JLT:
+        case OP_JLE:
+        case OP_JGT:
+        case OP_JGE:
+        case OP_JEQ:
+        case OP_JNE:
+        case OP_JNLT:
+        case OP_JNLE:
+        case OP_JNGT:
+        case OP_JNGE:
+        case OP_FORPREP:
+        case OP_FORLOOP:
+        case OP_TITER:
+        case OP_TNEXT:
             sprintf(buf, "%s %i", operation_strings[i.stackop.op], i.sx.sx);
             break;
         
+        case OP_SWITCH:
+            jump_table* t = vector_get(&p->jump_tables, i.ux.ux);
+            sprintf(buf, "%s %u (%u cases)", operation_strings[i.stackop.op], i.ux.ux, t->count);
+            break;
+
         case OP_PUSHK:
             Value k = p->constants[i.ux.ux];
             sprintf(buf, "%s %u (%s)", operation_strings[i.stackop.op], i.ux.ux, value_to_str(&k));
@@ -622,30 +1794,48 @@ const char* disassemble(program* p, instruction i) {
         
         case OP_LOADC:
         case OP_STORC:
-            const char* c = p->closure_table.keys[i.ux.ux];
+            const char* c = symbol_name(p->closure_table.keys[i.ux.ux]);
             sprintf(buf, "%s %u (%s)", operation_strings[i.stackop.op], i.ux.ux, c);
             break;
 
         case OP_STORG:
         case OP_LOADG:
+        case OP_STORGK:
             // uses global program to decode symbols
             while (p->prev != NULL) p = p->prev;
         
         case OP_STORL:
         case OP_LOADL:
-            const char* vname;
-
+        case OP_STORLK:
             // decodes reference name in local symbol table
-            for (size_t i0 = 0; i0 < p->symbol_table.size; i0++) {
-                if (((Value*)p->symbol_table.values[i0])->value.to_int == i.sx.sx) {
-                    vname = p->symbol_table.keys[i0];
-                    break;
-                }
-            }
+            const char* vname = symbol_name(p->symbol_table.keys[i.sx.sx]);
             
             sprintf(buf, "%s %i (%s)", operation_strings[i.sx.op], i.sx.sx, vname);
             break;
 
+        case OP_TUPDATE:
+            sprintf(buf, "%s %s", operation_strings[i.stackop.op], operation_strings[i.ax.a]);
+            break;
+
+        case OP_INVOKE:
+            invoke_cache* cache = vector_get(&p->invoke_caches, i.ax.sx);
+            sprintf(buf, "%s %u (%s)", operation_strings[i.stackop.op], i.ax.a, cache->key.value.to_str);
+            break;
+
+        case OP_UPDATEG:
+        case OP_APPENDG:
+            while (p->prev != NULL) p = p->prev;
+
+        case OP_UPDATEL:
+        case OP_APPENDL:
+            // appends name their buffer instead of the operation applied
+            const char* uname = symbol_name(p->symbol_table.keys[i.ax.sx]);
+            const char* operand = i.ax.op == OP_UPDATEL || i.ax.op == OP_UPDATEG
+                ? operation_strings[i.ax.a] : symbol_name(p->symbol_table.keys[i.ax.a]);
+
+            sprintf(buf, "%s %i (%s) %s", operation_strings[i.ax.op], i.ax.sx, uname, operand);
+            break;
+
         default:
             failure("Failed to disassemble instruction!");
     }
@@ -655,26 +1845,68 @@ const char* disassemble(program* p, instruction i) {
 
 void compilererr(program* p, lxpos pos, const char* msg)
 {
-    fprintf(stderr, "%s[err] %s (%d, %d) in %s:\n", ERR_COL, msg, pos.line_pos + 1, pos.col_pos + 1, pos.origin);
-    fprintf(stderr, "\t|\n");
-    fprintf(stderr, "\t| %04i %s\n", pos.line_pos + 1, get_line(pos.src, pos.line_offset));
-    fprintf(stderr, "\t| %s'\n%s", paddchar('~', 5 + pos.col_pos), DEF_COL);
-    exit(0);
+    char buf[512];
+    snprintf(buf, sizeof(buf), "%s (%d, %d) in %s", msg, pos.line_pos + 1, pos.col_pos + 1, pos.origin);
+
+    if (current_trap == NULL) {
+        fprintf(stderr, "%s[err] %s:\n", ERR_COL, buf);
+        fprintf(stderr, "\t|\n");
+        fprintf(stderr, "\t| %04i %s\n", pos.line_pos + 1, get_line(pos.src, pos.line_offset));
+        fprintf(stderr, "\t| %s'\n%s", paddchar('~', 5 + pos.col_pos), DEF_COL);
+    }
+    error_exit(buf);
 }
 
 void recordaddress(program* p, lxpos* pos)
 {
-    lxpos* last = p->line_address_table.values[p->line_address_table.size - 1];
+    line_entry* last = p->line_address_table.values[p->line_address_table.size - 1];
 
-    if (p->line_address_table.size == 0 || strcmp(last->origin, pos->origin) || last->line_pos < pos->line_pos) {
-        char* buf = malloc(sizeof(char) * 8);
-        sprintf(buf, "%uli", p->length);
+    if (p->line_address_table.size == 0 || strcmp(last->pos.origin, pos->origin) || last->pos.line_pos < pos->line_pos) {
+        // positions outlive the syntax tree they were taken from
+        line_entry* e = malloc(sizeof(line_entry));
+        *e = (line_entry) { .pos = *pos, .site = NULL };
+        put_line_entry(p, p->length, e);
+    }
+}
+
+void put_line_entry(program* p, size_t address, line_entry* e)
+{
+    char* buf = malloc(sizeof(char) * 24);
+    sprintf(buf, "%luli", address);
+
+    if (map_has(&p->line_address_table, buf)) {
+        line_entry_free(map_get(&p->line_address_table, buf));
+        map_put(&p->line_address_table, buf, e);
+        free(buf);
+    } else {
+        map_put(&p->line_address_table, buf, e);
+    }
+}
 
-        map_put(&p->line_address_table, buf, pos);
+line_entry* line_entry_copy(line_entry* e, line_entry* site)
+{
+    line_entry* copy = malloc(sizeof(line_entry));
+    copy->pos = e->pos;
+
+    // the further call site goes past the outermost call of the entry
+    if (e->site != NULL) {
+        copy->site = line_entry_copy(e->site, site);
+    } else {
+        copy->site = site == NULL ? NULL : line_entry_copy(site, NULL);
+    }
+
+    return copy;
+}
+
+void line_entry_free(line_entry* e)
+{
+    if (e != NULL) {
+        line_entry_free(e->site);
+        free(e);
     }
 }
 
-lxpos* getaddresspos(program* p, int pos)
+line_entry* getaddresspos(program* p, int pos)
 {
     for (size_t i = p->line_address_table.size - 1; i >= 0; i--)
     {
@@ -5,6 +5,7 @@
 #include "datatypes.h"
 #include "parser.h"
 #include "value.h"
+#include "superinstructions.h"
 
 // ------------------- VM IR --------------------
 
@@ -17,14 +18,31 @@ typedef enum vm_op {
     OP_MOD,
     OP_NEG,
     OP_NOT,
-    OP_AND,
-    OP_OR,
     OP_EQ,
     OP_NE,
     OP_LT,
     OP_LE,
     OP_GT,
     OP_GE,
+    OP_IADD, // type specialised operations
+    OP_ISUB,
+    OP_IMUL,
+    OP_ISHL,
+    OP_IMODP,
+    OP_ILT,
+    OP_ILE,
+    OP_IGT,
+    OP_IGE,
+    OP_IEQ,
+    OP_INE,
+    OP_FADD,
+    OP_FSUB,
+    OP_FMUL,
+    OP_FDIV,
+    OP_FLT,
+    OP_FLE,
+    OP_FGT,
+    OP_FGE,
     OP_PUSHK,
     OP_STORG,
     OP_LOADG,
@@ -32,18 +50,63 @@ typedef enum vm_op {
     OP_LOADL,
     OP_STORC,
     OP_LOADC,
+    OP_STORLK,
+    OP_STORGK,
+    OP_UPDATEL, // updates of variables in place
+    OP_UPDATEG,
+    OP_APPENDL,
+    OP_APPENDG,
     OP_CALL,
+    OP_INVOKE,
+    OP_LEN, // intrinsic built-ins
+    OP_SQRT,
+    OP_POW,
+    OP_TOINT,
+    OP_TOFLOAT,
+    OP_TOBOOL,
+    OP_TOSTR,
     OP_RET,
     OP_POP,
     OP_JIF,
     OP_JMP,
+    OP_JFALSE,
+    OP_JTRUE,
+    OP_JLT, // compare and branch
+    OP_JLE,
+    OP_JGT,
+    OP_JGE,
+    OP_JEQ,
+    OP_JNE,
+    OP_JNLT,
+    OP_JNLE,
+    OP_JNGT,
+    OP_JNGE,
+    OP_SWITCH, // jump table dispatch
+    OP_FORPREP, // counted loops
+    OP_FORLOOP,
+    OP_TITER, // table loops
+    OP_TNEXT,
     OP_CLOSE,
+    OP_CLOSER,
     OP_TNEW, // table operations
+    OP_TNEWR,
     OP_TPUT,
+    OP_TPUTK,
     OP_TGET,
+    OP_TUPDATE,
     OP_TREM,
+    OP_SNAPSHOT, // pause point of a heap snapshot
+#define SUPERINSTRUCTION_OP(a, b) OP_##a##_##b,
+    SUPERINSTRUCTIONS(SUPERINSTRUCTION_OP) // fused pairs of operations
+#undef SUPERINSTRUCTION_OP
 } __attribute__((packed)) vm_op;
 
+// number of operations emitted by the compiler, before superinstructions
+#define VM_BASE_OPS (OP_SNAPSHOT + 1)
+
+// operation names padded for disassembly, indexed by operation code
+extern const char* operation_strings[];
+
 typedef enum vm_scope {
     VM_LOCAL_SCOPE,
     VM_GLOBAL_SCOPE,
@@ -67,23 +130,72 @@ typedef union instruction {
         int16_t sx;
     } sx;
 
+    // variable address with a byte operand, an operation or a second slot
+    struct {
+        vm_op op;
+        uint8_t a;
+        int16_t sx;
+    } ax;
+
     uint32_t bits;
 } instruction;
 
+// outcome of a native function, which leaves an error message in its
+// result when it fails
+typedef enum native_status {
+    NATIVE_OK,
+    NATIVE_ERROR,
+} native_status;
+
+// native function run on its arguments in place on the caller's stack,
+// writing its result to out, which starts as null
+typedef native_status (*native_fn)(virtual_machine* vm, Value* args, size_t argc, Value* out);
+
+// position of the code from an address on in the line address table, with
+// the entry of the call it was inlined at for code of an inlined function
+typedef struct line_entry {
+    lxpos pos;
+    struct line_entry* site;
+} line_entry;
+
 typedef struct program {
     instruction* code;
     size_t length;
+    size_t capacity; // instructions allocated for code
     size_t argc;
     Value* constants;
+    size_t constant_capacity;
     struct program* prev;
-    Value (*native)(Value[]);
+    native_fn native;
+    boolean variadic; // native accepting any number of arguments
+    astnode* deferred; // definition of a function compiled on its first call
+    size_t globals; // globals visible to the function, those defined before it
 
-    map symbol_table;
-    map constant_table;
-    map closure_table;
+    idmap symbol_table;
+    idmap constant_table;
+    idmap closure_table;
     map line_address_table;
+    vector jump_tables;
+    vector invoke_caches;
 } program;
 
+/**
+ * @brief Compiles a script and the files it includes into its global
+ *      program, running the passes of the front end and the bytecode
+ *      passes in order. Used by both the interpreter and the library.
+ *      Functions declared in global scope are compiled on their first
+ *      call, or by compile_all.
+ * 
+ * @param path Path of the script, includes are found relative to it
+ * @param src Source text of the script
+ * @param tokens Receives the tokens of the script, whose values the
+ *      program shares
+ * @param fuse Whether superinstructions are fused, false when profiling
+ *      operation pairs
+ * @return Global program
+ */
+program* compile_script(const char* path, const char* src, vector* tokens, boolean fuse);
+
 /**
  * @brief Compiles block of statements into bytecode and stores
  *      it into program.
@@ -141,6 +253,45 @@ void compile_call(program* p, astnode* call);
  */
 void compile_function(program* p, astnode* function);
 
+/**
+ * @brief Compiles the body of a function whose compilation was deferred
+ *      to its first call. Functions defined in global scope are deferred,
+ *      as they capture no variables their closures never depend on the
+ *      body. Names are resolved against the globals defined before the
+ *      function, as if it had been compiled at its definition. Does
+ *      nothing if the function is compiled or being compiled.
+ * 
+ * @param p Reference to function program
+ */
+void compile_deferred(program* p);
+
+/**
+ * @brief Compiles a deferred function like compile_deferred, except that
+ *      a compile error leaves the function deferred, so the error is
+ *      raised on its first call instead.
+ * 
+ * @param p Reference to function program
+ * @return boolean False if its body failed to compile
+ */
+boolean try_compile_deferred(program* p);
+
+/**
+ * @brief Compiles every deferred function nested within a program, so
+ *      that no function is left to compile when first called.
+ * 
+ * @param p Reference to program
+ */
+void compile_all(program* p);
+
+/**
+ * @brief Frees a compiled program along with the functions nested in it.
+ *      Constant strings belong to the tokens they were read from and
+ *      positions refer to the source text, both are kept.
+ * 
+ * @param p Reference to program
+ */
+void program_delete(program* p);
+
 /**
  * @brief Compiles loop control structure
  * 
@@ -149,6 +300,52 @@ void compile_function(program* p, astnode* function);
  */
 void compile_loop(program* p, astnode* loop);
 
+/**
+ * @brief Compiles counted loop over a numeric range. The counter, limit
+ *      and step stay on the stack for the whole loop, FORPREP checks the
+ *      range once and FORLOOP steps the counter and branches back, each
+ *      pushing the counter for the body to store in the loop variable.
+ * 
+ * @param p Reference to program
+ * @param loop Range loop node
+ */
+void compile_range_loop(program* p, astnode* loop);
+
+/**
+ * @brief Compiles loop over the entries of a table. The table, the index
+ *      and the key of the current entry stay on the stack for the whole
+ *      loop, TITER starts at the first entry and TNEXT advances and
+ *      branches back, each pushing the value of the entry for the body
+ *      to store before the key.
+ * 
+ * @param p Reference to program
+ * @param loop Table loop node
+ */
+void compile_each_loop(program* p, astnode* loop);
+
+/**
+ * @brief Compiles a condition into conditional jumps taken when its truth
+ *      value matches jump_if, falling through otherwise. Operands of
+ *      && and || are short-circuited, the right operand only being
+ *      evaluated if the left does not decide the outcome. Positions of
+ *      the jumps are added to jumps for the caller to patch.
+ * 
+ * @param p Reference to program
+ * @param cond Condition expression node
+ * @param jump_if Truth value on which to jump
+ * @param jumps Positions of jumps to patch
+ */
+void compile_condition(program* p, astnode* cond, boolean jump_if, idmap* jumps);
+
+/**
+ * @brief Points a list of jumps at a target instruction.
+ * 
+ * @param p Reference to program
+ * @param jumps Positions of jumps to patch
+ * @param target Instruction position
+ */
+void patch_jumps(program* p, idmap* jumps, size_t target);
+
 /**
  * @brief Compiles if-else_if_else control flow block into intermediate
  *      assembly.
@@ -158,6 +355,18 @@ void compile_loop(program* p, astnode* loop);
  */
 void compile_branches(program* p, astnode* branches);
 
+/**
+ * @brief Compiles a chain of branches testing one variable for equality
+ *      with constants of one type, either all integers or all strings, as
+ *      a switch over a jump table. The first branch not fitting the chain
+ *      and those after it are compiled as the default case.
+ * 
+ * @param p Reference to program
+ * @param branches Branching nodes
+ * @return False if the chain has too few cases, nothing is compiled
+ */
+boolean compile_switch(program* p, astnode* branches);
+
 /**
  * @brief Compiles a table declaration and initial entries into intermediate
  *      bytecode assembly.
@@ -177,24 +386,70 @@ void compile_table(program* p, astnode* table);
 void compile_table_put(program* p, astnode* put);
 
 /**
- * @brief Registers native method with C-wrapper as an accessible symbol to program
- *      local scope.
+ * @brief Executes import statement - lexes, parses and compiles bytecode inline
+ *      within current program.
  * 
  * @param p Reference to program
- * @param name Name of method
- * @param f Pointer to wrapper function
- * @param argc Number of arguments for native method
+ * @param filepath String node with path to file
  */
-void create_native(program* p, const char* name, Value (*f)(Value[]), int argc);
+void run_import(program* p, astnode* filepath);
 
 /**
- * @brief Executes import statement - lexes, parses and compiles bytecode inline
- *      within current program.
+ * @brief Reads, lexes and parses an included file into a statement
+ *      block. File path is resolved relative to the including file.
+ *      Each file is included once, by its canonical path, so repeated
+ *      and circular includes of a file already in the program are empty.
  * 
- * @param p Reference to program
  * @param filepath String node with path to file
+ * @return Block node of included file, or NULL if already included
  */
-void run_import(program* p, astnode* filepath);
+astnode* parse_import(astnode* filepath);
+
+/**
+ * @brief Reads and parses every file included by a program, directly or
+ *      through other includes, concurrently on a pool of threads. Parsed
+ *      files are kept for parse_import, so includes are still expanded
+ *      in the order of the program.
+ * 
+ * @param tree Global statement block
+ */
+void parse_includes(astnode* tree);
+
+/**
+ * @brief Forgets the files included by the programs compiled so far, so
+ *      that the next program compiled includes them again.
+ */
+void reset_includes();
+
+/**
+ * @brief Frees the tokens and modules of the files included by the last
+ *      program compiled, then forgets them as by reset_includes. Their
+ *      syntax trees have been spliced into the program's tree.
+ * 
+ * @param kept Receives the memory compiled code may still refer to,
+ *      the source texts and paths of the files and their token values
+ */
+void release_includes(vector* kept);
+
+/**
+ * @brief Frees lexed tokens once parsed. Values of identifiers are
+ *      interned, other values may be referred to by the syntax tree and
+ *      the constants compiled from it.
+ * 
+ * @param tokens Tokens to free
+ * @param kept Receives the values of the tokens which are not interned,
+ *      or NULL to free them too
+ */
+void release_tokens(vector* tokens, vector* kept);
+
+/**
+ * @brief Replaces include statements in global scope with the statements
+ *      of the included files, so that the whole program is visible to
+ *      the optimiser before compilation.
+ * 
+ * @param block Global statement block
+ */
+void expand_includes(astnode* block);
 
 /**
  * @brief Prints error message into standard error output and
@@ -207,9 +462,9 @@ void run_import(program* p, astnode* filepath);
 void compilererr(program* p, lxpos pos, const char* msg);
 
 /**
- * @brief Registers constant value in local scope and stores value
- *      string in program's constant table. Method returns the address
- *      of constant (index) in constant stack.
+ * @brief Registers constant value in local scope and stores its key
+ *      in program's constant table. Method returns the address of
+ *      constant (index) in constant stack.
  * 
  * @param p Reference to program
  * @param v Value to register
@@ -217,6 +472,36 @@ void compilererr(program* p, lxpos pos, const char* msg);
  */
 uint16_t register_constant(program* p, Value v);
 
+/**
+ * @brief Grows the code of a program to hold at least a number of
+ *      instructions past its end. Compilation reserves space for the
+ *      instructions of each node before emitting them.
+ * 
+ * @param p Reference to program
+ * @param n Number of instructions
+ */
+void reserve_instructions(program* p, size_t n);
+
+/**
+ * @brief Registers the jump table of a switch instruction in the program
+ *      and returns its address.
+ * 
+ * @param p Reference to program
+ * @param t Jump table
+ * @return Address
+ */
+uint16_t register_jump_table(program* p, jump_table* t);
+
+/**
+ * @brief Registers the method cache of an invoke instruction in the
+ *      program and returns its address.
+ * 
+ * @param p Reference to program
+ * @param c Method cache
+ * @return Address
+ */
+uint16_t register_invoke_cache(program* p, invoke_cache* c);
+
 /**
  * @brief Registers variable symbol and returns the address within
  *      stack or heap. Stores scope of variable in scope pointer. If
@@ -227,7 +512,7 @@ uint16_t register_constant(program* p, Value v);
  * @param scope Scope output
  * @return Address
  */
-int16_t register_variable(program* p, const char* name, vm_scope* scope);
+int16_t register_variable(program* p, symbol name, vm_scope* scope);
 
 /**
  * @brief Registers new variable symbol in local scope and returns the
@@ -239,7 +524,7 @@ int16_t register_variable(program* p, const char* name, vm_scope* scope);
  * @param scope Scope output
  * @return Address
  */
-int16_t register_unique_variable_local(program* p, const char* name, vm_scope* scope);
+int16_t register_unique_variable_local(program* p, symbol name, vm_scope* scope);
 
 /**
  * @brief Retrieves the address of a variable in the stack 
@@ -252,7 +537,7 @@ int16_t register_unique_variable_local(program* p, const char* name, vm_scope* s
  * @param scope Scope output
  * @return Address
  */
-int16_t dereference_variable(program* p, const char* name, vm_scope* scope);
+int16_t dereference_variable(program* p, symbol name, vm_scope* scope);
 
 /**
  * @brief Decodes entire program into a string and also decodes 
@@ -288,8 +573,36 @@ void recordaddress(program* p, lxpos* pos);
  * 
  * @param p Reference to program
  * @param pos Instruction position
- * @return Source position
+ * @return Line entry of the position
+ */
+line_entry* getaddresspos(program* p, int pos);
+
+/**
+ * @brief Records the position of the code from an address on, replacing
+ *      the entry of code left empty at the same address.
+ * 
+ * @param p Reference to program
+ * @param address Instruction position
+ * @param e Line entry, owned by the program
+ */
+void put_line_entry(program* p, size_t address, line_entry* e);
+
+/**
+ * @brief Copies a line entry along with the entries of the calls it was
+ *      inlined at, then places it at a further call.
+ * 
+ * @param e Line entry
+ * @param site Entry of the call the copy is inlined at, copied too, or
+ *      NULL
+ * @return Line entry
+ */
+line_entry* line_entry_copy(line_entry* e, line_entry* site);
+
+/**
+ * @brief Frees a line entry along with the entries of its call sites.
+ * 
+ * @param e Line entry
  */
-lxpos* getaddresspos(program* p, int pos);
+void line_entry_free(line_entry* e);
 
 #endif
\ No newline at end of file
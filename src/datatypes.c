@@ -64,7 +64,7 @@ void* vector_set(vector* v, size_t index, void* item)
 
 void vector_insert(vector* v, size_t index, void* item)
 {
-    if (index < 0 || v->size <= index)
+    if (index < 0 || v->size < index)
         return;
 
     // allocates more space if needed
@@ -205,4 +205,168 @@ void map_delete(map* m)
     free(m->keys);
     free(m->values);
     free(m);
-}
\ No newline at end of file
+}
+
+// ---------------- SYMBOL INTERNER ----------------
+
+static const char** symbol_names = NULL;
+static size_t* symbol_hashes = NULL;
+static size_t symbol_count = 0;
+static size_t symbol_capacity = 0;
+
+static int32_t* symbol_slots = NULL;
+static size_t symbol_slot_count = 0;
+
+// symbols are interned by the lexers of included files in parallel
+static pthread_mutex_t symbol_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void intern_resize(size_t new_capacity)
+{
+    symbol_names = realloc(symbol_names, sizeof(const char*) * new_capacity);
+    symbol_hashes = realloc(symbol_hashes, sizeof(size_t) * new_capacity);
+    symbol_capacity = new_capacity;
+
+    // slot table is kept at twice the capacity of the symbol list
+    free(symbol_slots);
+    symbol_slot_count = new_capacity * 2;
+    symbol_slots = malloc(sizeof(int32_t) * symbol_slot_count);
+    memset(symbol_slots, -1, sizeof(int32_t) * symbol_slot_count);
+
+    for (size_t i = 0; i < symbol_count; i++) {
+        size_t slot = symbol_hashes[i] & (symbol_slot_count - 1);
+        
+        while (symbol_slots[slot] != -1) {
+            slot = (slot + 1) & (symbol_slot_count - 1);
+        }
+        symbol_slots[slot] = i;
+    }
+}
+
+symbol intern(const char* str)
+{
+    pthread_mutex_lock(&symbol_lock);
+
+    if (symbol_count == symbol_capacity) {
+        intern_resize(symbol_capacity ? symbol_capacity * 2 : 256);
+    }
+
+    size_t hash = strhash(str);
+    size_t slot = hash & (symbol_slot_count - 1);
+
+    // linear probing until symbol or empty slot is found
+    while (symbol_slots[slot] != -1) 
+    {
+        int32_t s = symbol_slots[slot];
+        
+        if (symbol_hashes[s] == hash && streq(symbol_names[s], str)) {
+            pthread_mutex_unlock(&symbol_lock);
+            return s;
+        }
+        slot = (slot + 1) & (symbol_slot_count - 1);
+    }
+
+    char* name = malloc(sizeof(char) * (strlen(str) + 1));
+    strcpy(name, str);
+
+    symbol_names[symbol_count] = name;
+    symbol_hashes[symbol_count] = hash;
+    symbol_slots[slot] = symbol_count;
+
+    symbol s = symbol_count++;
+    pthread_mutex_unlock(&symbol_lock);
+    return s;
+}
+
+const char* symbol_name(symbol s)
+{
+    pthread_mutex_lock(&symbol_lock);
+    const char* name = s < symbol_count ? symbol_names[s] : NULL;
+    pthread_mutex_unlock(&symbol_lock);
+    return name;
+}
+
+// -------------------- ID MAP --------------------
+
+// fibonacci hashing spreads sequential ids across slots
+#define IDHASH(k, n) (((k) * 0x9E3779B97F4A7C15ull) >> 32) & ((n) - 1)
+
+idmap idmap_new(size_t init_capacity)
+{
+    size_t capacity = 8;
+    while (capacity < init_capacity * 2) capacity <<= 1;
+
+    idmap m = {
+        .keys = malloc(sizeof(uint64_t) * (capacity / 2)),
+        .slots = malloc(sizeof(int32_t) * capacity),
+        .size = 0,
+        .capacity = capacity
+    };
+    memset(m.slots, -1, sizeof(int32_t) * capacity);
+    return m;
+}
+
+int idmap_get(idmap* m, uint64_t key)
+{
+    size_t slot = IDHASH(key, m->capacity);
+
+    while (m->slots[slot] != -1) 
+    {
+        if (m->keys[m->slots[slot]] == key) {
+            return m->slots[slot];
+        }
+        slot = (slot + 1) & (m->capacity - 1);
+    }
+    return -1;
+}
+
+static void idmap_resize(idmap* m, size_t new_capacity)
+{
+    m->keys = realloc(m->keys, sizeof(uint64_t) * (new_capacity / 2));
+    m->slots = realloc(m->slots, sizeof(int32_t) * new_capacity);
+    m->capacity = new_capacity;
+    memset(m->slots, -1, sizeof(int32_t) * new_capacity);
+
+    for (size_t i = 0; i < m->size; i++) {
+        size_t slot = IDHASH(m->keys[i], m->capacity);
+
+        while (m->slots[slot] != -1) {
+            slot = (slot + 1) & (m->capacity - 1);
+        }
+        m->slots[slot] = i;
+    }
+}
+
+int idmap_put(idmap* m, uint64_t key)
+{
+    int index = idmap_get(m, key);
+    
+    if (index != -1) {
+        return index;
+    }
+
+    // keeps load factor at or below one half
+    if ((m->size + 1) * 2 > m->capacity) {
+        idmap_resize(m, m->capacity * 2);
+    }
+
+    size_t slot = IDHASH(key, m->capacity);
+
+    while (m->slots[slot] != -1) {
+        slot = (slot + 1) & (m->capacity - 1);
+    }
+    
+    m->keys[m->size] = key;
+    m->slots[slot] = m->size;
+    return m->size++;
+}
+
+boolean idmap_has(idmap* m, uint64_t key)
+{
+    return idmap_get(m, key) != -1;
+}
+
+void idmap_delete(idmap* m)
+{
+    free(m->keys);
+    free(m->slots);
+}
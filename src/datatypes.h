@@ -77,7 +77,7 @@ void* vector_set(vector* v, size_t index, void* item) ;
 
 /**
  * @brief Inserts an item into the vector at a specified
- *      index.
+ *      index, or appends it if the index is the vector size.
  * 
  * @param v Reference to vector
  * @param index Position the item will occupy
@@ -180,4 +180,84 @@ void map_resize(map* m, size_t new_capacity);
  */
 void map_delete(map* m);
 
+// ---------------- SYMBOL INTERNER ----------------
+
+typedef uint32_t symbol;
+
+/**
+ * @brief Interns a string and returns its unique symbol ID. Equal
+ *      strings always map to the same ID, so identifiers can be
+ *      hashed and compared as integers after lexing. Safe to call from
+ *      several threads.
+ * 
+ * @param str String to intern
+ * @return Symbol ID
+ */
+symbol intern(const char* str);
+
+/**
+ * @brief Returns the canonical string of an interned symbol.
+ * 
+ * @param s Symbol ID
+ * @return Symbol string
+ */
+const char* symbol_name(symbol s);
+
+// -------------------- ID MAP --------------------
+
+typedef struct idmap {
+    uint64_t* keys;
+    int32_t* slots;
+    size_t size;
+    size_t capacity;
+} idmap;
+
+/**
+ * @brief Constructor creates an empty open-addressed hash map from
+ *      integer keys to dense indices. Entries are numbered in order
+ *      of insertion, so the index of a key doubles as its address.
+ * 
+ * @param init_capacity Initial number of entries
+ * @return ID map object
+ */
+idmap idmap_new(size_t init_capacity);
+
+/**
+ * @brief Fetches the index of a key, returns -1 if key is not
+ *      present in the map.
+ * 
+ * @param m Reference to ID map
+ * @param key Key
+ * @return Index of entry
+ */
+int idmap_get(idmap* m, uint64_t key);
+
+/**
+ * @brief Inserts a key into the map if it is not present and returns
+ *      the index of its entry. Map is resized if necessary.
+ * 
+ * @param m Reference to ID map
+ * @param key Key
+ * @return Index of entry
+ */
+int idmap_put(idmap* m, uint64_t key);
+
+/**
+ * @brief Returns true if a specified key exists in the map, returns
+ *      false otherwise.
+ * 
+ * @param m Reference to ID map
+ * @param key Key to search
+ * @return True if map contains key, false otherwise 
+ */
+boolean idmap_has(idmap* m, uint64_t key);
+
+/**
+ * @brief Deallocates the space allocated to store the entries of
+ *      the map.
+ * 
+ * @param m Reference to ID map
+ */
+void idmap_delete(idmap* m);
+
 #endif
\ No newline at end of file
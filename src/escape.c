@@ -0,0 +1,835 @@
+#include "escape.h"
+
+// a function local assigned a table literal, replaced by one hidden
+// local per field unless any of its uses observe the table itself
+struct scalar_table {
+    astnode* assign;
+    astnode* parent;
+    size_t assigns;
+    boolean rejected;
+    idmap fields;
+};
+
+struct scalar_context {
+    program* p;
+    idmap symbols;
+    vector tables;
+    boolean aborted;
+};
+
+// variables passed to built-ins which only read their argument, and the
+// variables and parameters rebinding names of built-ins
+struct string_context {
+    idmap arguments;
+    idmap rebound;
+};
+
+// forward declarations
+struct scalar_table* scalar_entry(struct scalar_context* c, symbol sym);
+void scan_scalars(struct scalar_context* c, astnode* node, astnode* parent, boolean nested);
+void rewrite_scalars(struct scalar_context* c, astnode* node);
+void expand_literal(struct scalar_context* c, symbol sym, struct scalar_table* t);
+struct scalar_table* replaced_table(struct scalar_context* c, astnode* node);
+symbol field_symbol(symbol table, const char* key);
+boolean visible_outside(program* p, symbol sym);
+boolean propagate_sites(cfg* g, int* site, siteset* escaped);
+boolean transfer_sites(cfg* g, size_t pc, int* site, siteset* stack, size_t* depth, siteset* vars, siteset* escaped);
+void scan_strings(struct string_context* c, astnode* node, astnode* parent, astnode* body);
+void use_string(symbol sym, astnode* body);
+boolean is_operand(astnode* parent);
+boolean is_reading_call(astnode* node, astnode* parent);
+
+#define MAX_SCALAR_FIELDS 16
+
+// every variable of the program with the body of the function using it,
+// the whole program for globals, and the variables whose strings may be
+// shared
+idmap string_variables;
+vector string_users;
+idmap shared_strings;
+boolean strings_ready = false;
+
+// built-in methods which never keep their argument
+const char* reading_natives[] = { "print", "len" };
+
+void replace_scalars(program* p, astnode* body)
+{
+    struct scalar_context c = {
+        .p = p,
+        .symbols = idmap_new(16),
+        .tables = vector_new(16),
+        .aborted = false,
+    };
+
+    scan_scalars(&c, body, NULL, false);
+
+    // only tables whose fields all fit as locals are replaced
+    for (size_t i = 0; i < c.symbols.size; i++)
+    {
+        struct scalar_table* t = vector_get(&c.tables, i);
+
+        if (t->assigns != 1 || t->assign == NULL || t->fields.size > MAX_SCALAR_FIELDS
+                || visible_outside(p, c.symbols.keys[i])) {
+            t->rejected = true;
+        }
+    }
+
+    if (!c.aborted)
+    {
+        rewrite_scalars(&c, body);
+
+        for (size_t i = 0; i < c.symbols.size; i++)
+        {
+            struct scalar_table* t = vector_get(&c.tables, i);
+            if (!t->rejected) expand_literal(&c, c.symbols.keys[i], t);
+        }
+    }
+
+    for (size_t i = 0; i < c.symbols.size; i++)
+    {
+        struct scalar_table* t = vector_get(&c.tables, i);
+        idmap_delete(&t->fields);
+        free(t);
+    }
+
+    idmap_delete(&c.symbols);
+    free(c.tables.items);
+}
+
+void allocate_regions(program* p)
+{
+    int* site = malloc(sizeof(int) * (p->length + 1));
+    size_t nsites = 0;
+
+    // numbers the heap allocations made by the function itself
+    for (size_t pc = 0; pc < p->length; pc++)
+    {
+        vm_op op = p->code[pc].stackop.op;
+        site[pc] = (op == OP_TNEW || op == OP_CLOSE) && nsites < MAX_ALLOCATION_SITES ? (int) nsites++ : -1;
+    }
+
+    if (nsites > 0)
+    {
+        cfg g = cfg_build(p);
+        siteset escaped = 0;
+
+        if (propagate_sites(&g, site, &escaped))
+        {
+            for (size_t pc = 0; pc < p->length; pc++)
+            {
+                if (site[pc] == -1 || (escaped & SITE(site[pc]))) {
+                    continue;
+                }
+
+                p->code[pc].stackop.op = p->code[pc].stackop.op == OP_TNEW ? OP_TNEWR : OP_CLOSER;
+            }
+        }
+
+        cfg_delete(&g);
+    }
+
+    free(site);
+}
+
+void collect_owned_strings(astnode* tree)
+{
+    // tables of the program compiled before
+    if (strings_ready) {
+        idmap_delete(&string_variables);
+        free(string_users.items);
+        idmap_delete(&shared_strings);
+    }
+
+    string_variables = idmap_new(64);
+    string_users = vector_new(64);
+    shared_strings = idmap_new(16);
+    strings_ready = true;
+
+    struct string_context c = {
+        .arguments = idmap_new(16),
+        .rebound = idmap_new(16),
+    };
+
+    scan_strings(&c, tree, NULL, tree);
+
+    // rebound built-ins may keep the arguments passed to them
+    for (size_t i = 0; i < sizeof(reading_natives) / sizeof(const char*); i++)
+    {
+        if (!idmap_has(&c.rebound, intern(reading_natives[i]))) {
+            continue;
+        }
+
+        for (size_t k = 0; k < c.arguments.size; k++) {
+            idmap_put(&shared_strings, c.arguments.keys[k]);
+        }
+    }
+
+    idmap_delete(&c.arguments);
+    idmap_delete(&c.rebound);
+}
+
+boolean is_owned_append(astnode* assign)
+{
+    astnode* rhs = vector_get(&assign->children, 0);
+
+    // hidden variables made by later passes are never known here
+    if (!strings_ready || !idmap_has(&string_variables, assign->sym) || idmap_has(&shared_strings, assign->sym)) {
+        return false;
+    } else if (rhs->type != AST_BINARY_EXPRESSION || !streq(rhs->value, "+")) {
+        return false;
+    }
+
+    astnode* lhs = vector_get(&rhs->children, 0);
+    return lhs->type == AST_REFERENCE && lhs->sym == assign->sym;
+}
+
+symbol buffer_symbol(symbol var)
+{
+    const char* name = symbol_name(var);
+    char* buf = malloc(sizeof(char) * (strlen(name) + 9));
+
+    sprintf(buf, "$buffer.%s", name);
+    symbol sym = intern(buf);
+
+    free(buf);
+    return sym;
+}
+
+// ------------------ SCALAR REPLACEMENT ------------------
+
+struct scalar_table* scalar_entry(struct scalar_context* c, symbol sym)
+{
+    int index = idmap_get(&c->symbols, sym);
+
+    if (index != -1) {
+        return vector_get(&c->tables, index);
+    }
+
+    struct scalar_table* t = malloc(sizeof(struct scalar_table));
+    t->assign = NULL;
+    t->parent = NULL;
+    t->assigns = 0;
+    t->rejected = false;
+    t->fields = idmap_new(8);
+
+    idmap_put(&c->symbols, sym);
+    vector_push(&c->tables, t);
+    return t;
+}
+
+// Records how every symbol of a function body is used. Symbols referenced
+// other than by a string literal index, or at all by nested functions,
+// are rejected.
+void scan_scalars(struct scalar_context* c, astnode* node, astnode* parent, boolean nested)
+{
+    if (node == NULL) {
+        return;
+    }
+
+    switch (node->type)
+    {
+        case AST_INCLUDE:
+            c->aborted = true;
+            return;
+
+        case AST_FUNCTION:
+            nested = true;
+            break;
+
+        case AST_REFERENCE:
+        case AST_PARAM:
+            scalar_entry(c, node->sym)->rejected = true;
+            break;
+
+        // counters are reassigned on every iteration
+        case AST_RANGE_LOOP:
+            scalar_entry(c, ((astnode*) vector_get(&node->children, 0))->sym)->rejected = true;
+            break;
+
+        case AST_ASSIGN:
+        {
+            struct scalar_table* t = scalar_entry(c, node->sym);
+            astnode* rhs = vector_get(&node->children, 0);
+
+            if (nested || rhs->type != AST_TABLE || ++t->assigns > 1) {
+                t->rejected = true;
+                break;
+            }
+
+            t->assign = node;
+            t->parent = parent;
+
+            for (size_t i = 0; i < rhs->children.size; i++)
+            {
+                astnode* key = vector_get(&((astnode*) vector_get(&rhs->children, i))->children, 0);
+
+                if (key->type != AST_STRING) {
+                    t->rejected = true;
+                } else {
+                    idmap_put(&t->fields, intern(key->value));
+                }
+            }
+            break;
+        }
+
+        case AST_BINARY_EXPRESSION:
+        {
+            astnode* lhs = vector_get(&node->children, 0);
+            astnode* key = vector_get(&node->children, 1);
+
+            if (!nested && streq(node->value, "[]") && lhs->type == AST_REFERENCE && key->type == AST_STRING) {
+                idmap_put(&scalar_entry(c, lhs->sym)->fields, intern(key->value));
+                return;
+            }
+            break;
+        }
+
+        default:
+            break;
+    }
+
+    for (size_t i = 0; i < node->children.size; i++) {
+        scan_scalars(c, vector_get(&node->children, i), node, nested);
+    }
+}
+
+// Turns indexing and puts on replaced tables into uses of their fields
+void rewrite_scalars(struct scalar_context* c, astnode* node)
+{
+    if (node == NULL || node->type == AST_FUNCTION) {
+        return;
+    }
+
+    if (node->type == AST_PUT && replaced_table(c, vector_get(&node->children, 0)) != NULL)
+    {
+        astnode* field = vector_get(&node->children, 0);
+        astnode* table = vector_get(&field->children, 0);
+        astnode* key = vector_get(&field->children, 1);
+
+        node->type = AST_ASSIGN;
+        node->sym = field_symbol(table->sym, key->value);
+        vector_rm(&node->children, 0);
+
+        // updates of the element apply their operation to the field
+        if (!streq(node->value, "put"))
+        {
+            astnode* update = astnode_new(node->value, AST_BINARY_EXPRESSION, node->pos);
+            astnode* var = astnode_new(symbol_name(node->sym), AST_REFERENCE, node->pos);
+
+            var->sym = node->sym;
+            vector_push(&update->children, var);
+            vector_push(&update->children, vector_get(&node->children, 0));
+            node->children.items[0] = update;
+        }
+
+        node->value = symbol_name(node->sym);
+    }
+    else if (replaced_table(c, node) != NULL)
+    {
+        astnode* table = vector_get(&node->children, 0);
+        astnode* key = vector_get(&node->children, 1);
+
+        node->type = AST_REFERENCE;
+        node->sym = field_symbol(table->sym, key->value);
+        node->value = symbol_name(node->sym);
+        node->children.size = 0;
+        return;
+    }
+
+    for (size_t i = 0; i < node->children.size; i++) {
+        rewrite_scalars(c, vector_get(&node->children, i));
+    }
+}
+
+// Replaces the table literal assignment by assignments to each field in
+// the order of the literal, with fields only ever put starting as null
+void expand_literal(struct scalar_context* c, symbol sym, struct scalar_table* t)
+{
+    astnode* literal = vector_get(&t->assign->children, 0);
+    boolean* assigned = calloc(t->fields.size + 1, sizeof(boolean));
+    size_t index = 0;
+
+    while (vector_get(&t->parent->children, index) != t->assign) index++;
+    vector_rm(&t->parent->children, index);
+
+    for (size_t i = 0; i < literal->children.size; i++)
+    {
+        astnode* pair = vector_get(&literal->children, i);
+        astnode* key = vector_get(&pair->children, 0);
+        astnode* assign = astnode_new(NULL, AST_ASSIGN, pair->pos);
+
+        assign->sym = field_symbol(sym, key->value);
+        assign->value = symbol_name(assign->sym);
+        vector_push(&assign->children, vector_get(&pair->children, 1));
+        vector_insert(&t->parent->children, index++, assign);
+
+        assigned[idmap_get(&t->fields, intern(key->value))] = true;
+    }
+
+    for (size_t i = 0; i < t->fields.size; i++)
+    {
+        if (assigned[i]) {
+            continue;
+        }
+
+        astnode* assign = astnode_new(NULL, AST_ASSIGN, t->assign->pos);
+        assign->sym = field_symbol(sym, symbol_name(t->fields.keys[i]));
+        assign->value = symbol_name(assign->sym);
+        vector_push(&assign->children, astnode_new("null", AST_NULL, t->assign->pos));
+        vector_insert(&t->parent->children, index++, assign);
+    }
+
+    free(assigned);
+}
+
+// Returns the replaced table indexed by a node, or NULL
+struct scalar_table* replaced_table(struct scalar_context* c, astnode* node)
+{
+    if (node->type != AST_BINARY_EXPRESSION || !streq(node->value, "[]")) {
+        return NULL;
+    }
+
+    astnode* table = vector_get(&node->children, 0);
+    astnode* key = vector_get(&node->children, 1);
+
+    if (table->type != AST_REFERENCE || key->type != AST_STRING) {
+        return NULL;
+    }
+
+    int index = idmap_get(&c->symbols, table->sym);
+    struct scalar_table* t = index == -1 ? NULL : vector_get(&c->tables, index);
+
+    return t == NULL || t->rejected ? NULL : t;
+}
+
+// Hidden local holding one field of a replaced table
+symbol field_symbol(symbol table, const char* key)
+{
+    const char* name = symbol_name(table);
+    char* buf = malloc(sizeof(char) * (strlen(name) + strlen(key) + 3));
+
+    sprintf(buf, "$%s.%s", name, key);
+    symbol sym = intern(buf);
+
+    free(buf);
+    return sym;
+}
+
+// True for parameters and variables of enclosing programs, which the
+// function may share with other code
+boolean visible_outside(program* p, symbol sym)
+{
+    for (program* q = p; q != NULL; q = q->prev) {
+        if (idmap_has(&q->symbol_table, sym)) return true;
+    }
+    return false;
+}
+
+// ------------------ ESCAPE ANALYSIS ------------------
+
+// Propagates the allocation sites held by stack slots and locals forward
+// through the control flow graph, collecting the sites which escape
+boolean propagate_sites(cfg* g, int* site, siteset* escaped)
+{
+    if (g->size == 0) {
+        return true;
+    }
+
+    site_state* states = calloc(g->size, sizeof(site_state));
+    siteset* stack = malloc(sizeof(siteset) * (g->p->length + 1));
+    siteset* vars = malloc(sizeof(siteset) * (g->nvars + 1));
+    size_t* worklist = malloc(sizeof(size_t) * g->size);
+    boolean* queued = calloc(g->size, sizeof(boolean));
+    size_t top = 0;
+    boolean consistent = true;
+
+    // parameters and uninitialised locals hold no allocation of this call
+    states[0].visited = true;
+    states[0].depth = 0;
+    states[0].stack = malloc(sizeof(siteset));
+    states[0].vars = calloc(g->nvars + 1, sizeof(siteset));
+
+    worklist[top++] = 0;
+    queued[0] = true;
+
+    while (consistent && top > 0)
+    {
+        size_t bi = worklist[--top];
+        block* b = &g->blocks[bi];
+        site_state* s = &states[bi];
+        queued[bi] = false;
+
+        size_t depth = s->depth;
+        memcpy(stack, s->stack, sizeof(siteset) * depth);
+        memcpy(vars, s->vars, sizeof(siteset) * g->nvars);
+
+        for (size_t pc = b->start; consistent && pc < b->end; pc++) {
+            consistent = transfer_sites(g, pc, site, stack, &depth, vars, escaped);
+        }
+
+        // merges exit sites into the entry sites of each successor
+        for (size_t j = 0; consistent && j < b->nsucc; j++)
+        {
+            size_t si = b->succ[j];
+            site_state* t = &states[si];
+            boolean changed = false;
+
+            if (!t->visited)
+            {
+                t->visited = changed = true;
+                t->depth = depth;
+                t->stack = malloc(sizeof(siteset) * (depth + 1));
+                t->vars = malloc(sizeof(siteset) * (g->nvars + 1));
+                memcpy(t->stack, stack, sizeof(siteset) * depth);
+                memcpy(t->vars, vars, sizeof(siteset) * g->nvars);
+            }
+            else if (t->depth != depth)
+            {
+                consistent = false;
+            }
+            else
+            {
+                for (size_t k = 0; k < depth; k++) {
+                    changed |= (t->stack[k] | stack[k]) != t->stack[k];
+                    t->stack[k] |= stack[k];
+                }
+
+                for (size_t k = 0; k < g->nvars; k++) {
+                    changed |= (t->vars[k] | vars[k]) != t->vars[k];
+                    t->vars[k] |= vars[k];
+                }
+            }
+
+            if (changed && !queued[si]) {
+                queued[si] = true;
+                worklist[top++] = si;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < g->size; i++) {
+        free(states[i].stack);
+        free(states[i].vars);
+    }
+
+    free(states);
+    free(stack);
+    free(vars);
+    free(worklist);
+    free(queued);
+
+    return consistent;
+}
+
+// Applies the effect of one instruction to the allocation sites held by
+// the abstract stack and locals
+boolean transfer_sites(cfg* g, size_t pc, int* site, siteset* stack, size_t* depth, siteset* vars, siteset* escaped)
+{
+    program* p = g->p;
+    instruction i = p->code[pc];
+    size_t d = *depth;
+    boolean local = i.sx.sx >= 0 && i.sx.sx < g->nvars;
+
+    switch (i.stackop.op)
+    {
+        case OP_NOP:
+        case OP_JMP:
+        case OP_SNAPSHOT:
+            break;
+
+        // results of operations never alias their operands
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+        case OP_EQ:
+        case OP_NE:
+        case OP_LT:
+        case OP_LE:
+        case OP_GT:
+        case OP_GE:
+        case OP_IADD:
+        case OP_ISUB:
+        case OP_IMUL:
+        case OP_ILT:
+        case OP_ILE:
+        case OP_IGT:
+        case OP_IGE:
+        case OP_IEQ:
+        case OP_INE:
+        case OP_FADD:
+        case OP_FSUB:
+        case OP_FMUL:
+        case OP_FDIV:
+        case OP_FLT:
+        case OP_FLE:
+        case OP_FGT:
+        case OP_FGE:
+            if (d < 2) return false;
+            stack[d - 2] = 0;
+            d--;
+            break;
+
+        case OP_ISHL:
+        case OP_IMODP:
+        case OP_NEG:
+        case OP_NOT:
+            if (d < 1) return false;
+            stack[d - 1] = 0;
+            break;
+
+        // globals and captured values have escaped when stored
+        case OP_PUSHK:
+        case OP_LOADG:
+        case OP_LOADC:
+        case OP_TNEWR:
+            stack[d++] = 0;
+            break;
+
+        case OP_LOADL:
+            stack[d++] = local ? vars[i.sx.sx] : 0;
+            break;
+
+        case OP_STORL:
+        case OP_STORLK:
+            if (d < 1 || !local) return false;
+            vars[i.sx.sx] = stack[d - 1];
+            if (i.stackop.op == OP_STORL) d--;
+            break;
+
+        case OP_STORG:
+        case OP_STORGK:
+        case OP_STORC:
+        case OP_RET:
+            if (d < 1) return false;
+            *escaped |= stack[d - 1];
+            if (i.stackop.op != OP_STORGK) d--;
+            break;
+
+        // updated variables hold the result of an operation
+        case OP_UPDATEL:
+        case OP_APPENDL:
+            if (d < 1 || !local) return false;
+            vars[i.ax.sx] = 0;
+            d--;
+            break;
+
+        case OP_UPDATEG:
+        case OP_APPENDG:
+            if (d < 1) return false;
+            d--;
+            break;
+
+        case OP_POP:
+        case OP_JIF:
+        case OP_JFALSE:
+        case OP_JTRUE:
+        case OP_SWITCH:
+            if (d < 1) return false;
+            d--;
+            break;
+
+        // callees may keep their arguments, but not the function called
+        // or the receiver it was looked up from
+        case OP_CALL:
+        case OP_INVOKE:
+        {
+            size_t argc = i.stackop.op == OP_CALL ? i.ux.ux : i.ax.a;
+            if (d < argc + 1) return false;
+
+            for (size_t k = d - argc - 1; k < d - 1; k++) {
+                *escaped |= stack[k];
+            }
+
+            d -= argc;
+            stack[d - 1] = 0;
+            break;
+        }
+
+        case OP_CLOSE:
+        case OP_CLOSER:
+            if (d < i.ux.ux + 1) return false;
+
+            for (size_t k = d - i.ux.ux; k < d; k++) {
+                *escaped |= stack[k];
+            }
+
+            d -= i.ux.ux;
+            stack[d - 1] = site[pc] == -1 || i.stackop.op == OP_CLOSER ? 0 : SITE(site[pc]);
+            break;
+
+        case OP_TNEW:
+            stack[d++] = site[pc] == -1 ? 0 : SITE(site[pc]);
+            break;
+
+        // elements of tables are not tracked
+        case OP_TPUT:
+        case OP_TPUTK:
+            if (d < 3) return false;
+            *escaped |= stack[d - 2] | stack[d - 1];
+            d -= i.stackop.op == OP_TPUT ? 3 : 2;
+            break;
+
+        case OP_TGET:
+            if (d < 2) return false;
+            stack[d - 2] = 0;
+            d--;
+            break;
+
+        // built-ins return new values and keep none of their operands
+        case OP_LEN:
+        case OP_SQRT:
+        case OP_TOINT:
+        case OP_TOFLOAT:
+        case OP_TOBOOL:
+        case OP_TOSTR:
+            if (d < 1) return false;
+            stack[d - 1] = 0;
+            break;
+
+        case OP_POW:
+            if (d < 2) return false;
+            stack[d - 2] = 0;
+            d--;
+            break;
+
+        // keys of updated elements may be inserted
+        case OP_TUPDATE:
+            if (d < 3) return false;
+            *escaped |= stack[d - 2];
+            d -= 3;
+            break;
+
+        // ranges are converted to numbers, pushing the counter
+        case OP_FORPREP:
+        case OP_FORLOOP:
+            if (d < 3) return false;
+            stack[d - 3] = stack[d - 2] = stack[d - 1] = 0;
+            stack[d++] = 0;
+            break;
+
+        // entries put into tables have escaped, so none are read back
+        case OP_TITER:
+            if (d < 1) return false;
+            stack[d++] = 0;
+            stack[d++] = 0;
+            stack[d++] = 0;
+            break;
+
+        case OP_TNEXT:
+            if (d < 3) return false;
+            stack[d - 1] = 0;
+            stack[d++] = 0;
+            break;
+
+        case OP_JLT:
+        case OP_JLE:
+        case OP_JGT:
+        case OP_JGE:
+        case OP_JEQ:
+        case OP_JNE:
+        case OP_JNLT:
+        case OP_JNLE:
+        case OP_JNGT:
+        case OP_JNGE:
+            if (d < 2) return false;
+            d -= 2;
+            break;
+
+        default:
+            return false;
+    }
+
+    *depth = d;
+    return d <= p->length;
+}
+
+// ------------------ OWNED STRINGS ------------------
+
+// Records the function using each variable, sharing variables read other
+// than as operands or arguments of reading built-ins, bound as parameters
+// or used by several functions. Includes left unexpanded may use anything,
+// so they disable appends.
+void scan_strings(struct string_context* c, astnode* node, astnode* parent, astnode* body)
+{
+    switch (node->type)
+    {
+        case AST_INCLUDE:
+            strings_ready = false;
+            return;
+
+        case AST_FUNCTION:
+            body = node;
+            break;
+
+        case AST_PARAM:
+            idmap_put(&shared_strings, node->sym);
+            idmap_put(&c->rebound, node->sym);
+            break;
+
+        case AST_REFERENCE:
+            if (is_reading_call(node, parent)) {
+                idmap_put(&c->arguments, node->sym);
+            } else if (!is_operand(parent)) {
+                idmap_put(&shared_strings, node->sym);
+            }
+
+            use_string(node->sym, body);
+            break;
+
+        case AST_ASSIGN:
+            idmap_put(&c->rebound, node->sym);
+            use_string(node->sym, body);
+            break;
+
+        default:
+            break;
+    }
+
+    for (size_t i = 0; i < node->children.size; i++) {
+        scan_strings(c, vector_get(&node->children, i), node, body);
+    }
+}
+
+void use_string(symbol sym, astnode* body)
+{
+    int index = idmap_get(&string_variables, sym);
+
+    if (index == -1) {
+        idmap_put(&string_variables, sym);
+        vector_push(&string_users, body);
+    } else if (vector_get(&string_users, index) != body) {
+        idmap_put(&shared_strings, sym);
+    }
+}
+
+// True if the parent of a reference is an operator whose result is a new
+// value, unlike indexing or unary plus which may yield the operand itself
+boolean is_operand(astnode* parent)
+{
+    if (parent == NULL) {
+        return false;
+    } else if (parent->type == AST_BINARY_EXPRESSION) {
+        return !streq(parent->value, "[]") && !streq(parent->value, ".");
+    } else if (parent->type == AST_UNARY_EXPRESSION) {
+        return !streq(parent->value, "+");
+    }
+
+    return false;
+}
+
+// True for arguments of calls to built-ins which never keep them
+boolean is_reading_call(astnode* node, astnode* parent)
+{
+    if (parent == NULL || parent->type != AST_CALL || vector_get(&parent->children, 0) == node) {
+        return false;
+    }
+
+    astnode* callee = vector_get(&parent->children, 0);
+
+    for (size_t i = 0; callee->type == AST_REFERENCE && i < sizeof(reading_natives) / sizeof(const char*); i++) {
+        if (streq(callee->value, reading_natives[i])) return true;
+    }
+    return false;
+}
@@ -0,0 +1,78 @@
+#ifndef HE_ESCAPE_HEADER
+#define HE_ESCAPE_HEADER
+
+#include "common.h"
+#include "datatypes.h"
+#include "parser.h"
+#include "compiler.h"
+#include "specialise.h"
+
+// Set of allocation sites a stack slot or variable may refer to, one bit
+// per table or closure allocated by the program
+typedef uint64_t siteset;
+
+#define SITE(i) ((siteset) 1 << (i))
+#define MAX_ALLOCATION_SITES 64
+
+typedef struct site_state {
+    boolean visited;
+    size_t depth;
+    siteset* stack;
+    siteset* vars;
+} site_state;
+
+/**
+ * @brief Replaces function locals holding a table literal by one hidden
+ *      local per field. Applies to tables with string literal keys which
+ *      are assigned once, only ever indexed by string literals and never
+ *      referenced by nested functions, so the table itself is never
+ *      observable and need not be allocated.
+ *
+ * @param p Reference to function program, with parameters registered
+ * @param body Function statement block
+ */
+void replace_scalars(program* p, astnode* body);
+
+/**
+ * @brief Runs escape analysis over the bytecode of a function and moves
+ *      tables and closures which cannot outlive its call into the frame
+ *      region of the virtual machine, released when the function returns.
+ *      Values escape when stored outside the frame, put into a table,
+ *      captured by a closure, passed to a call or returned. Must run after
+ *      the peephole pass.
+ *
+ * @param p Reference to function program
+ */
+void allocate_regions(program* p);
+
+/**
+ * @brief Collects the variables whose strings are never shared, so that
+ *      appends to them may grow the string in place. Every read of such
+ *      a variable is an operand of an arithmetic, comparison or logical
+ *      operator, whose result never aliases it, and the variable is used
+ *      by a single function which does not take it as a parameter. Must
+ *      be run on the whole program before compilation.
+ * 
+ * @param tree Global statement block
+ */
+void collect_owned_strings(astnode* tree);
+
+/**
+ * @brief Returns true if the assignment appends to a variable whose
+ *      string is never shared, x <- x + v, which may be done in place.
+ * 
+ * @param assign Assignment statement node
+ * @return True if the string may be appended to in place
+ */
+boolean is_owned_append(astnode* assign);
+
+/**
+ * @brief Returns the hidden variable recording the buffer a variable
+ *      was last appended to in place.
+ * 
+ * @param var Variable appended to
+ * @return Symbol of the hidden variable
+ */
+symbol buffer_symbol(symbol var);
+
+#endif
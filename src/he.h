@@ -6,7 +6,13 @@
 #include "lex.h"
 #include "parser.h"
 #include "compiler.h"
+#include "optimiser.h"
+#include "peephole.h"
+#include "specialise.h"
+#include "inliner.h"
+#include "escape.h"
 #include "vm.h"
 #include "lib.h"
+#include "image.h"
 
 #endif
\ No newline at end of file
@@ -0,0 +1,283 @@
+#include "helium.h"
+
+struct he_vm {
+    virtual_machine vm;
+    char error[512];
+};
+
+struct he_program {
+    program* p;
+    code_object code;
+    vector owned;       // source texts and token values the code refers to
+};
+
+// thread state saved around a library call, restored when it returns
+typedef struct he_session {
+    error_trap trap;
+    error_trap* prev_trap;
+    virtual_machine* prev_vm;
+    size_t ci;
+    size_t region_top;
+} he_session;
+
+// the front end keeps its analyses in module state, reset by each program
+// compiled, so one program is compiled at a time
+pthread_mutex_t compile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// forward declarations
+void session_begin(he_session* s, he_vm* vm);
+he_status session_end(he_session* s, he_vm* vm);
+program* compile_source(const char* path, const char* src, vector* tokens, vector* owned);
+
+// ------------------ VIRTUAL MACHINES ------------------
+
+he_vm* he_vm_new()
+{
+    he_vm* vm = calloc(1, sizeof(he_vm));
+
+    if (vm == NULL) {
+        return NULL;
+    }
+
+    vm->vm = (virtual_machine) {
+        .ci = -1,
+        .call_stack = malloc(sizeof(call_info) * MAX_CALL_STACK),
+        .heap = calloc(MAX_HEAP_SIZE, sizeof(Value)),
+        .stack = calloc(MAX_STACK_SIZE, sizeof(Value)),
+        .region = malloc(MAX_REGION_SIZE),
+        .region_top = 0,
+        .pair_counts = NULL,
+        .entry = 0,
+    };
+
+    if (vm->vm.call_stack == NULL || vm->vm.heap == NULL || vm->vm.stack == NULL || vm->vm.region == NULL) {
+        he_vm_delete(vm);
+        return NULL;
+    }
+
+    return vm;
+}
+
+void he_vm_delete(he_vm* vm)
+{
+    for (size_t i = 0; i < vm->vm.natives.size; i++)
+    {
+        builtin* b = vector_get(&vm->vm.natives, i);
+        free((char*) b->name);
+        free(b);
+    }
+
+    free(vm->vm.natives.items);
+    free(vm->vm.call_stack);
+    free(vm->vm.heap);
+    free(vm->vm.stack);
+    free(vm->vm.region);
+    free(vm);
+}
+
+const char* he_error(he_vm* vm)
+{
+    return vm->error;
+}
+
+he_status he_register_native(he_vm* vm, const char* name, native_fn f, size_t argc, boolean variadic)
+{
+    if (!register_native(&vm->vm, name, f, argc, variadic)) {
+        snprintf(vm->error, sizeof(vm->error), "Built-in function %s is already defined!", name);
+        return HE_ERROR;
+    }
+
+    return HE_OK;
+}
+
+// ------------------ PROGRAMS ------------------
+
+he_status he_compile_string(he_vm* vm, const char* name, const char* src, he_program** out)
+{
+    he_session s;
+    vector tokens = vector_new(64);
+    vector owned = vector_new(64);
+    vector nodes = vector_new(256);
+    *out = NULL;
+
+    // positions keep the name and text of the script
+    char* path = strdup(name);
+    char* text = strdup(src);
+    vector_push(&owned, path);
+    vector_push(&owned, text);
+
+    pthread_mutex_lock(&compile_lock);
+    session_begin(&s, vm);
+    node_arena = &nodes;
+
+    if (setjmp(s.trap.env) == 0)
+    {
+        program* p = compile_source(path, text, &tokens, &owned);
+        he_program* hp = malloc(sizeof(he_program));
+        *hp = (he_program) {
+            .p = p,
+            .code = { .p = p, .closure = NULL },
+            .owned = owned,
+        };
+        *out = hp;
+    }
+    else
+    {
+        // the front end is freed, functions compiled before the error are not
+        release_tokens(&tokens, &owned);
+        release_includes(&owned);
+        image_reset_sources();
+
+        for (size_t i = 0; i < owned.size; i++) {
+            free(vector_get(&owned, i));
+        }
+        free(owned.items);
+    }
+
+    node_arena = NULL;
+    astnode_release(&nodes);
+
+    pthread_mutex_unlock(&compile_lock);
+    return session_end(&s, vm);
+}
+
+he_status he_compile_file(he_vm* vm, const char* path, he_program** out)
+{
+    he_session s;
+    const char* src = NULL;
+    *out = NULL;
+
+    session_begin(&s, vm);
+
+    if (setjmp(s.trap.env) == 0) {
+        src = read_file(path);
+    }
+
+    if (session_end(&s, vm) != HE_OK) {
+        return HE_ERROR;
+    }
+
+    he_status status = he_compile_string(vm, path, src, out);
+    free((char*) src);
+    return status;
+}
+
+void he_program_delete(he_program* p)
+{
+    program_delete(p->p);
+
+    for (size_t i = 0; i < p->owned.size; i++) {
+        free(vector_get(&p->owned, i));
+    }
+
+    free(p->owned.items);
+    free(p);
+}
+
+he_status he_run(he_vm* vm, he_program* p)
+{
+    he_session s;
+
+    if (vm->vm.ci != (size_t) -1) {
+        snprintf(vm->error, sizeof(vm->error), "Cannot run a program while the virtual machine is running!");
+        return HE_ERROR;
+    }
+
+    session_begin(&s, vm);
+
+    if (setjmp(s.trap.env) == 0)
+    {
+        bind_builtins(&vm->vm, p->p, 0);
+        vm->vm.entry = 0;
+        run_program(&vm->vm, NULL, &p->code);
+    }
+
+    return session_end(&s, vm);
+}
+
+he_status he_call(he_vm* vm, he_program* p, const char* name, Value* args, size_t argc, Value* result)
+{
+    virtual_machine* m = &vm->vm;
+    int address = idmap_get(&p->p->symbol_table, intern(name));
+
+    if (address == -1) {
+        snprintf(vm->error, sizeof(vm->error), "Global variable %s is not defined!", name);
+        return HE_ERROR;
+    }
+
+    he_session s;
+    session_begin(&s, vm);
+
+    if (setjmp(s.trap.env) == 0)
+    {
+        // frame of the embedding program, above the frame of any native
+        // calling back into the virtual machine
+        call_info host = {
+            .program = &p->code,
+            .tp = m->ci == (size_t) -1 ? 0 : m->call_stack[m->ci].tp,
+        };
+
+        if (host.tp + argc + 1 >= MAX_STACK_SIZE) {
+            runtimeerr(m, "Stack overflow!");
+        }
+
+        for (size_t i = 0; i < argc; i++) {
+            m->stack[host.tp++] = args[i];
+        }
+
+        m->stack[host.tp++] = m->heap[address];
+        call_value(m, &host, argc);
+
+        if (result != NULL) {
+            *result = m->stack[host.tp - 1];
+        }
+    }
+
+    return session_end(&s, vm);
+}
+
+// ------------------ SESSIONS ------------------
+
+void session_begin(he_session* s, he_vm* vm)
+{
+    s->trap.raised = false;
+    s->prev_trap = current_trap;
+    s->prev_vm = current_vm;
+    s->ci = vm->vm.ci;
+    s->region_top = vm->vm.region_top;
+
+    current_trap = &s->trap;
+    current_vm = &vm->vm;
+}
+
+he_status session_end(he_session* s, he_vm* vm)
+{
+    current_trap = s->prev_trap;
+    current_vm = s->prev_vm;
+
+    if (!s->trap.raised) {
+        return HE_OK;
+    }
+
+    // unwinds the frames left by the error
+    vm->vm.ci = s->ci;
+    vm->vm.region_top = s->region_top;
+    snprintf(vm->error, sizeof(vm->error), "%s", s->trap.message);
+    return HE_ERROR;
+}
+
+program* compile_source(const char* path, const char* src, vector* tokens, vector* owned)
+{
+    program* pp = compile_script(path, src, tokens, true);
+
+    // syntax nodes keep copies of token positions and share their values
+    release_tokens(tokens, owned);
+
+    // programs compiled up front can be shared between virtual machines
+    compile_all(pp);
+
+    // programs compiled by the library are never written as images
+    release_includes(owned);
+    image_reset_sources();
+    return pp;
+}
@@ -0,0 +1,133 @@
+#ifndef HE_LIBRARY_HEADER
+#define HE_LIBRARY_HEADER
+
+#include "he.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// outcome of a library call, the message of an error is kept by the
+// virtual machine it was raised on
+typedef enum he_status {
+    HE_OK,
+    HE_ERROR,
+} he_status;
+
+// virtual machine of an embedding program
+typedef struct he_vm he_vm;
+
+// compiled program, which may be run any number of times
+typedef struct he_program he_program;
+
+/**
+ * @brief Creates a virtual machine. Each thread may drive its own virtual
+ *      machines, a virtual machine is used by one thread at a time.
+ *
+ * @return Reference to virtual machine, or NULL if out of memory
+ */
+he_vm* he_vm_new();
+
+/**
+ * @brief Frees a virtual machine and the natives registered with it.
+ *      Values created by the programs it ran are not freed.
+ *
+ * @param vm Reference to virtual machine
+ */
+void he_vm_delete(he_vm* vm);
+
+/**
+ * @brief Returns the message of the last error raised on a virtual
+ *      machine, with the position it was raised at.
+ *
+ * @param vm Reference to virtual machine
+ * @return Error message, empty if no error was raised
+ */
+const char* he_error(he_vm* vm);
+
+/**
+ * @brief Registers a native function, called by programs as a built-in
+ *      of the name. Natives are resolved when a program is compiled and
+ *      bound when it is run, so they must be registered before compiling
+ *      with every virtual machine which runs the program. A native
+ *      failing leaves its message in out, which is raised as an error.
+ *
+ * @param vm Reference to virtual machine
+ * @param name Name of the function
+ * @param f Native function
+ * @param argc Number of arguments
+ * @param variadic Whether the function accepts any number of arguments
+ * @return HE_ERROR if the name is taken by another built-in
+ */
+he_status he_register_native(he_vm* vm, const char* name, native_fn f, size_t argc, boolean variadic);
+
+/**
+ * @brief Compiles a script and the files it includes into a program.
+ *      Every function is compiled eagerly, so a program is never changed
+ *      by running it and may be run by any virtual machine. The compiler
+ *      keeps its whole program analyses, the files included and its
+ *      options (inline_budget, tree_shaking) in module state, which is
+ *      reset by each compilation, so compilation is serialised between
+ *      threads and options apply to every program compiled after being
+ *      set. The syntax tree is freed once compiled, the source text and
+ *      strings the program refers to are kept until it is deleted.
+ *
+ * @param vm Reference to virtual machine, receiving any error
+ * @param name Name of the script in error messages, includes are found
+ *      relative to its directory
+ * @param src Source text, copied
+ * @param out Receives the compiled program, NULL on error
+ * @return HE_ERROR if the script could not be compiled
+ */
+he_status he_compile_string(he_vm* vm, const char* name, const char* src, he_program** out);
+
+/**
+ * @brief Reads a script file and compiles it as by he_compile_string.
+ *
+ * @param vm Reference to virtual machine, receiving any error
+ * @param path Path of the script file
+ * @param out Receives the compiled program, NULL on error
+ * @return HE_ERROR if the file could not be read or compiled
+ */
+he_status he_compile_file(he_vm* vm, const char* path, he_program** out);
+
+/**
+ * @brief Frees a compiled program along with the source text of its
+ *      files. Values created by running it are not freed and must no
+ *      longer refer to its functions or strings when it is.
+ *
+ * @param p Compiled program
+ */
+void he_program_delete(he_program* p);
+
+/**
+ * @brief Runs the global statements of a program, defining its globals
+ *      on the virtual machine.
+ *
+ * @param vm Reference to virtual machine
+ * @param p Compiled program
+ * @return HE_ERROR if a runtime error was raised
+ */
+he_status he_run(he_vm* vm, he_program* p);
+
+/**
+ * @brief Calls a function held by a global variable of a program, after
+ *      the program has been run on the virtual machine. Natives may call
+ *      back into the virtual machine running them.
+ *
+ * @param vm Reference to virtual machine
+ * @param p Compiled program
+ * @param name Name of the global variable
+ * @param args Arguments
+ * @param argc Number of arguments
+ * @param result Receives the returned value, may be NULL
+ * @return HE_ERROR if the global does not exist or a runtime error was
+ *      raised
+ */
+he_status he_call(he_vm* vm, he_program* p, const char* name, Value* args, size_t argc, Value* result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,1120 @@
+#include "image.h"
+#include "inliner.h"
+#include "peephole.h"
+#include "optimiser.h"
+
+#ifndef __MINGW32__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Layout of an image, integers in the byte order of the writing machine:
+//   header   "HEC\0", version, interpreter signature, inlining budget,
+//            tree shaking
+//   sources  count, then path, content hash and text of each source
+//   program  argc, code, symbol names, closure names, constants, line
+//            addresses, jump tables and method cache keys, with the
+//            functions among the constants written in place. Each line
+//            address is followed by its position and those of the calls
+//            its code was inlined at
+// Strings are stored with their terminator and code is aligned to its
+// size, so both are used directly from the mapped file.
+//
+// Heap snapshots, "HES\0", continue an image with the address the global
+// program resumes from and the values of its global variables. Tables
+// and closures are written where first reached and referred to by their
+// order of appearance after, functions by the order their programs were
+// written in, built-ins by name.
+
+typedef struct image_source {
+    const char* path;
+    const char* src;
+    uint64_t hash;      // content hash recorded by the image
+    size_t length;      // of the text, bounding the line offsets read
+} image_source;
+
+typedef struct image_writer {
+    FILE* f;
+    const char* path;
+    char temp[280];     // file written, renamed to the path once complete
+    size_t pos;
+    idmap programs;     // functions written, in order
+    idmap objects;      // tables and closures reached by a snapshot
+} image_writer;
+
+typedef struct image_reader {
+    const char* data;
+    size_t size;
+    size_t pos;
+    const char* path;
+    uint32_t nsources;
+    image_source* sources;
+    size_t budget;
+    boolean shaken;
+    vector programs;    // code objects of the functions read, in order
+    vector objects;     // tables and closures of a snapshot, in order
+    vector loaded;      // programs allocated, freed if the image is rejected
+    jmp_buf* recover;   // returned to when the image is corrupt, if set
+} image_reader;
+
+// tags of the values of a snapshot referring to functions or objects
+typedef enum snapshot_tag {
+    SNAPSHOT_FUNCTION = VM_TABLE + 1,
+    SNAPSHOT_NATIVE,
+    SNAPSHOT_CLOSURE,
+    SNAPSHOT_TABLE,
+    SNAPSHOT_OBJECT,
+} snapshot_tag;
+
+// forward declarations
+image_writer writer_new(const char* path);
+boolean writer_close(image_writer* w);
+void write_image(image_writer* w, program* p, const char* magic);
+void write_state(image_writer* w, Value v);
+boolean read_header(image_reader* r, const char* path, const char* magic, jmp_buf* recover);
+Value read_state(image_reader* r);
+uint64_t image_signature();
+uint32_t source_index(lxpos* pos);
+void write_bytes(image_writer* w, const void* data, size_t n);
+void write_u32(image_writer* w, uint32_t x);
+void write_u64(image_writer* w, uint64_t x);
+void write_string(image_writer* w, const char* s);
+void write_align(image_writer* w);
+void write_value(image_writer* w, Value v);
+void write_program(image_writer* w, program* p);
+void write_line_entry(image_writer* w, line_entry* e);
+const void* read_bytes(image_reader* r, size_t n);
+uint32_t read_u32(image_reader* r);
+size_t read_count(image_reader* r);
+uint64_t read_u64(image_reader* r);
+const char* read_string(image_reader* r);
+void read_align(image_reader* r);
+void read_corrupt(image_reader* r);
+Value read_value(image_reader* r, program* prev);
+program* read_program(image_reader* r, program* prev);
+void read_line_entry(image_reader* r, line_entry** first);
+void read_jump_table(image_reader* r, program* p);
+void check_code(image_reader* r, program* p);
+void reader_close(image_reader* r, boolean keep);
+boolean sources_current(image_reader* r);
+const char* map_file(const char* path, size_t* size);
+void unmap_file(const char* data, size_t size);
+
+#define IMAGE_MAGIC "HEC"
+#define SNAPSHOT_MAGIC "HES"
+#define NO_SOURCE UINT32_MAX
+
+// identifier of the interpreter build, a hash of its sources when built
+// with the Makefile, otherwise the time this file was compiled
+#ifndef HE_BUILD_ID
+#define HE_BUILD_ID __DATE__ " " __TIME__
+#endif
+
+// sources read by the front end, in order
+vector image_sources = { NULL, 0, 0 };
+
+const char* snapshot_path = NULL;
+
+const char* snapshot_marker = NULL;
+
+void image_add_source(const char* path, const char* src)
+{
+    if (image_sources.capacity == 0) {
+        image_sources = vector_new(8);
+    }
+
+    image_source* s = malloc(sizeof(image_source));
+    s->path = path;
+    s->src = src;
+    s->hash = strhash(src);
+    s->length = strlen(src);
+    vector_push(&image_sources, s);
+}
+
+void image_reset_sources()
+{
+    for (size_t i = 0; i < image_sources.size; i++) {
+        free(vector_get(&image_sources, i));
+    }
+
+    image_sources.size = 0;
+}
+
+// ------------------ WRITING ------------------
+
+boolean image_write(program* p, const char* path)
+{
+    // deferred functions may still register globals as they compile, an
+    // error in one ends the program before the file is opened
+    compile_all(p);
+
+    image_writer w = writer_new(path);
+
+    if (w.f == NULL) {
+        return false;
+    }
+
+    write_image(&w, p, IMAGE_MAGIC);
+    return writer_close(&w);
+}
+
+void write_image(image_writer* w, program* p, const char* magic)
+{
+    write_bytes(w, magic, sizeof(IMAGE_MAGIC));
+    write_u32(w, IMAGE_VERSION);
+    write_u64(w, image_signature());
+    write_u64(w, inline_budget);
+    write_u32(w, tree_shaking);
+
+    write_u32(w, image_sources.size);
+
+    for (size_t i = 0; i < image_sources.size; i++)
+    {
+        image_source* s = vector_get(&image_sources, i);
+        write_string(w, s->path);
+        write_u64(w, s->hash);
+        write_string(w, s->src);
+    }
+
+    write_program(w, p);
+}
+
+void write_program(image_writer* w, program* p)
+{
+    if (p->native != NULL) {
+        failure("Cannot write a native function into a bytecode image!");
+    }
+
+    write_u32(w, p->argc);
+    write_u32(w, p->length);
+    write_align(w);
+    write_bytes(w, p->code, sizeof(instruction) * p->length);
+
+    // variables are rebuilt in order, so their addresses are kept
+    write_u32(w, p->symbol_table.size);
+    for (size_t i = 0; i < p->symbol_table.size; i++) {
+        write_string(w, symbol_name(p->symbol_table.keys[i]));
+    }
+
+    write_u32(w, p->closure_table.size);
+    for (size_t i = 0; i < p->closure_table.size; i++) {
+        write_string(w, symbol_name(p->closure_table.keys[i]));
+    }
+
+    write_u32(w, p->constant_table.size);
+    for (size_t i = 0; i < p->constant_table.size; i++) {
+        write_value(w, p->constants[i]);
+    }
+
+    write_u32(w, p->line_address_table.size);
+    for (size_t i = 0; i < p->line_address_table.size; i++)
+    {
+        write_u32(w, atoi(p->line_address_table.keys[i]));
+        write_line_entry(w, p->line_address_table.values[i]);
+    }
+
+    write_u32(w, p->jump_tables.size);
+    for (size_t i = 0; i < p->jump_tables.size; i++)
+    {
+        jump_table* t = vector_get(&p->jump_tables, i);
+
+        write_u32(w, t->type);
+        write_u32(w, t->dense);
+        write_u64(w, t->base);
+        write_u64(w, t->capacity);
+        write_u32(w, t->count);
+
+        for (size_t s = 0; s < t->capacity; s++) {
+            write_u32(w, t->cases[s]);
+            if (!t->dense) write_value(w, t->keys[s]);
+        }
+    }
+
+    // caches start empty, as they refer to tables of the running program
+    write_u32(w, p->invoke_caches.size);
+    for (size_t i = 0; i < p->invoke_caches.size; i++) {
+        write_value(w, ((invoke_cache*) vector_get(&p->invoke_caches, i))->key);
+    }
+}
+
+void write_line_entry(image_writer* w, line_entry* e)
+{
+    write_u32(w, source_index(&e->pos));
+    write_u32(w, e->pos.col_pos);
+    write_u32(w, e->pos.line_pos);
+    write_u32(w, e->pos.char_offset);
+    write_u32(w, e->pos.line_offset);
+
+    // call sites of inlined code follow, ended by a zero
+    write_u32(w, e->site != NULL);
+
+    if (e->site != NULL) {
+        write_line_entry(w, e->site);
+    }
+}
+
+void write_value(image_writer* w, Value v)
+{
+    write_u32(w, v.type);
+
+    switch (v.type)
+    {
+        case VM_NULL:
+            break;
+        case VM_INT:
+            write_u64(w, v.value.to_int);
+            break;
+        case VM_BOOL:
+            write_u32(w, v.value.to_bool);
+            break;
+        case VM_FLOAT:
+            write_bytes(w, &v.value.to_float, sizeof(double));
+            break;
+        case VM_STRING:
+            write_string(w, v.value.to_str);
+            break;
+        case VM_PROGRAM:
+            // numbered after their nested functions, as they are read back
+            write_program(w, v.value.to_code->p);
+            idmap_put(&w->programs, (uintptr_t) v.value.to_code->p);
+            break;
+        default:
+            failure("Cannot write a table constant into a bytecode image!");
+    }
+}
+
+// ------------------ READING ------------------
+
+program* image_load(const char* path, boolean check_sources)
+{
+    image_reader r;
+    jmp_buf recover;
+
+    // a truncated or corrupt image is treated as missing
+    if (setjmp(recover) != 0 || !read_header(&r, path, IMAGE_MAGIC, &recover)) {
+        reader_close(&r, false);
+        return NULL;
+    }
+
+    // a cached image is only used if compiled alike from the same sources
+    if (check_sources && (r.budget != inline_budget || r.shaken != tree_shaking || !sources_current(&r))) {
+        reader_close(&r, false);
+        return NULL;
+    }
+
+    program* p = read_program(&r, NULL);
+    reader_close(&r, true);
+    return p;
+}
+
+// Maps an image and reads its header and sources, returns false if the
+// file is not an image of this build of the kind given by its magic.
+// Corrupt images return to recover if given, otherwise they are fatal.
+boolean read_header(image_reader* r, const char* path, const char* magic, jmp_buf* recover)
+{
+    *r = (image_reader) {
+        .path = path,
+        .pos = 0,
+        .programs = vector_new(16),
+        .objects = vector_new(16),
+        .loaded = vector_new(16),
+        .recover = recover,
+    };
+
+    r->data = map_file(path, &r->size);
+
+    if (r->data == NULL || r->size < sizeof(IMAGE_MAGIC) || memcmp(r->data, magic, sizeof(IMAGE_MAGIC))) {
+        return false;
+    }
+
+    r->pos = sizeof(IMAGE_MAGIC);
+
+    if (read_u32(r) != IMAGE_VERSION || read_u64(r) != image_signature()) {
+        return false;
+    }
+
+    r->budget = read_u64(r);
+    r->shaken = read_u32(r);
+
+    r->nsources = read_count(r);
+    r->sources = malloc(sizeof(image_source) * (r->nsources + 1));
+
+    for (size_t i = 0; i < r->nsources; i++)
+    {
+        r->sources[i].path = read_string(r);
+        r->sources[i].hash = read_u64(r);
+        r->sources[i].src = read_string(r);
+        r->sources[i].length = strlen(r->sources[i].src);
+    }
+    return true;
+}
+
+program* read_program(image_reader* r, program* prev)
+{
+    // tables start empty, so a program left half read can still be freed
+    program* p = calloc(1, sizeof(program));
+    vector_push(&r->loaded, p);
+
+    p->argc = read_u32(r);
+    p->length = read_u32(r);
+    read_align(r);
+    p->code = (instruction*) read_bytes(r, sizeof(instruction) * p->length);
+    p->capacity = p->length;
+    p->prev = prev;
+    p->native = NULL;
+    p->variadic = false;
+    p->deferred = NULL;
+    p->globals = SIZE_MAX;
+
+    // functions are nested no deeper than calls may be
+    size_t depth = 0;
+    for (program* outer = prev; outer != NULL; outer = outer->prev) depth++;
+
+    if (depth > MAX_CALL_STACK) {
+        read_corrupt(r);
+    }
+
+    size_t n = read_count(r);
+    p->symbol_table = idmap_new(n + 1);
+    for (size_t i = 0; i < n; i++) {
+        idmap_put(&p->symbol_table, intern(read_string(r)));
+    }
+
+    n = read_count(r);
+    p->closure_table = idmap_new(n + 1);
+    for (size_t i = 0; i < n; i++) {
+        idmap_put(&p->closure_table, intern(read_string(r)));
+    }
+
+    n = read_count(r);
+    if (n > MAX_LOCAL_CONSTANTS) {
+        read_corrupt(r);
+    }
+
+    p->constant_capacity = n + 1;
+    p->constants = malloc(sizeof(Value) * p->constant_capacity);
+    p->constant_table = idmap_new(n + 1);
+    for (size_t i = 0; i < n; i++) {
+        register_constant(p, read_value(r, p));
+    }
+
+    // addresses are written in ascending order, so entries are appended
+    n = read_count(r);
+    p->line_address_table = map_new(n + 1);
+    for (size_t i = 0, last = 0; i < n; i++)
+    {
+        map* m = &p->line_address_table;
+        uint32_t address = read_u32(r);
+
+        if (address > p->length || (i > 0 && address <= last) || m->size == m->capacity) {
+            read_corrupt(r);
+        }
+
+        char* buf = malloc(sizeof(char) * 12);
+        sprintf(buf, "%u", address);
+        m->keys[m->size] = buf;
+        m->values[m->size++] = NULL;
+        read_line_entry(r, (line_entry**) &m->values[m->size - 1]);
+        last = address;
+    }
+
+    n = read_count(r);
+    p->jump_tables = vector_new(n + 1);
+    for (size_t i = 0; i < n; i++) {
+        read_jump_table(r, p);
+    }
+
+    n = read_count(r);
+    p->invoke_caches = vector_new(n + 1);
+    for (size_t i = 0; i < n; i++)
+    {
+        Value key = read_value(r, p);
+
+        if (key.type != VM_STRING) {
+            read_corrupt(r);
+        }
+        vector_push(&p->invoke_caches, invoke_cache_new(key));
+    }
+
+    check_code(r, p);
+    return p;
+}
+
+void read_jump_table(image_reader* r, program* p)
+{
+    jump_table* t = calloc(1, sizeof(jump_table));
+    vector_push(&p->jump_tables, t);
+
+    t->type = read_u32(r);
+    t->dense = read_u32(r);
+    t->base = read_u64(r);
+    t->capacity = read_u64(r);
+    t->count = read_u32(r);
+
+    // hashed keys are probed until an empty slot, so one must be left
+    if (t->capacity == 0 || t->capacity > r->size || (t->type != VM_INT && t->type != VM_STRING)
+            || (t->dense && t->type != VM_INT) || (!t->dense && ((t->capacity & (t->capacity - 1)) != 0 || t->count >= t->capacity))) {
+        read_corrupt(r);
+    }
+
+    t->cases = malloc(sizeof(uint16_t) * (t->capacity + 1));
+    t->keys = t->dense ? NULL : calloc(t->capacity + 1, sizeof(Value));
+
+    for (size_t s = 0; s < t->capacity; s++)
+    {
+        uint32_t c = read_u32(r);
+
+        if (c > t->count) {
+            read_corrupt(r);
+        }
+
+        t->cases[s] = c;
+        if (!t->dense) t->keys[s] = read_value(r, p);
+
+        if (!t->dense && c != t->count && t->keys[s].type != t->type) {
+            read_corrupt(r);
+        }
+    }
+}
+
+// Checks every operand against the code and tables of its program, so a
+// corrupt image never indexes outside of them. Stack depths are trusted
+void check_code(image_reader* r, program* p)
+{
+    if (p->argc > p->symbol_table.size) {
+        read_corrupt(r);
+    }
+
+    // operations are known before fused pairs are decoded
+    for (size_t pc = 0; pc < p->length; pc++) {
+        if (p->code[pc].stackop.op >= VM_BASE_OPS + superinstruction_count) read_corrupt(r);
+    }
+
+    for (size_t pc = 0; pc < p->length; pc++)
+    {
+        instruction i = p->code[pc];
+        vm_op op = i.stackop.op;
+        long target = (long) pc + i.sx.sx + 1;
+        program* closed = NULL;
+        boolean valid;
+
+        // the second operation of a fused pair is checked on its own
+        if (op >= VM_BASE_OPS)
+        {
+            if (pc + 1 >= p->length || unfused_op(p->code[pc + 1]) != superinstruction_ops[op - VM_BASE_OPS][1]) {
+                read_corrupt(r);
+            }
+            op = superinstruction_ops[op - VM_BASE_OPS][0];
+        }
+
+        switch (op)
+        {
+            case OP_PUSHK:
+                valid = i.ux.ux < p->constant_table.size;
+                break;
+            case OP_STORG:
+            case OP_LOADG:
+            case OP_STORGK:
+                valid = 0 <= i.sx.sx && i.sx.sx < MAX_HEAP_SIZE;
+                break;
+            case OP_STORL:
+            case OP_LOADL:
+            case OP_STORLK:
+                valid = 0 <= i.sx.sx && i.sx.sx < p->symbol_table.size;
+                break;
+            case OP_STORC:
+            case OP_LOADC:
+                valid = i.ux.ux < p->closure_table.size;
+                break;
+            case OP_UPDATEL:
+                valid = 0 <= i.ax.sx && i.ax.sx < p->symbol_table.size && OP_ADD <= i.ax.a && i.ax.a <= OP_GE;
+                break;
+            case OP_UPDATEG:
+                valid = 0 <= i.ax.sx && i.ax.sx < MAX_HEAP_SIZE && OP_ADD <= i.ax.a && i.ax.a <= OP_GE;
+                break;
+            case OP_APPENDL:
+                valid = 0 <= i.ax.sx && i.ax.sx < p->symbol_table.size && i.ax.a < p->symbol_table.size;
+                break;
+            case OP_APPENDG:
+                valid = 0 <= i.ax.sx && i.ax.sx < MAX_HEAP_SIZE;
+                break;
+            case OP_TUPDATE:
+                valid = OP_ADD <= i.ax.a && i.ax.a <= OP_GE;
+                break;
+            case OP_INVOKE:
+                valid = 0 <= i.ax.sx && i.ax.sx < p->invoke_caches.size;
+                break;
+            case OP_ISHL:
+            case OP_IMODP:
+                valid = i.ux.ux < 64;
+                break;
+            case OP_JIF:
+                valid = pc + 2 <= p->length;
+                break;
+            case OP_SWITCH:
+                // one jump per case and one to the default follow it
+                valid = i.ux.ux < p->jump_tables.size && pc + switch_slots(p, i) < p->length;
+                break;
+            case OP_CLOSE:
+            case OP_CLOSER:
+                // the function closed over is pushed before its values
+                if (pc > i.ux.ux && unfused_op(p->code[pc - i.ux.ux - 1]) == OP_PUSHK
+                        && p->code[pc - i.ux.ux - 1].ux.ux < p->constant_table.size) {
+                    Value k = p->constants[p->code[pc - i.ux.ux - 1].ux.ux];
+                    closed = k.type == VM_PROGRAM ? k.value.to_code->p : NULL;
+                }
+                valid = closed != NULL && closed->native == NULL && closed->closure_table.size == i.ux.ux;
+                break;
+            default:
+                valid = is_jump(op) ? 0 <= target && target <= (long) p->length : op < VM_BASE_OPS;
+                break;
+        }
+
+        if (!valid) {
+            read_corrupt(r);
+        }
+    }
+}
+
+void read_line_entry(image_reader* r, line_entry** first)
+{
+    line_entry** next = first;
+
+    size_t depth = 0;
+
+    // each entry is linked before it is read so the chain can always be
+    // freed, chains are no deeper than calls may be nested
+    do {
+        line_entry* e = malloc(sizeof(line_entry));
+        lxpos* pos = &e->pos;
+        e->site = NULL;
+        *next = e;
+        next = &e->site;
+
+        uint32_t source = read_u32(r);
+        pos->col_pos = read_u32(r);
+        pos->line_pos = read_u32(r);
+        pos->char_offset = read_u32(r);
+        uint32_t line_offset = read_u32(r);
+        pos->line_offset = line_offset;
+
+        if (++depth > MAX_CALL_STACK || (source < r->nsources && line_offset > r->sources[source].length)) {
+            read_corrupt(r);
+        }
+
+        if (source < r->nsources) {
+            pos->origin = r->sources[source].path;
+            pos->src = r->sources[source].src;
+        } else {
+            pos->origin = r->path;
+            pos->src = "";
+            pos->line_offset = 0;
+        }
+    } while (read_u32(r));
+}
+
+Value read_value(image_reader* r, program* prev)
+{
+    Value v;
+    double f;
+
+    switch (read_u32(r))
+    {
+        case VM_NULL:
+            return vNull();
+        case VM_INT:
+            return vInt(read_u64(r));
+        case VM_BOOL:
+            return vBool(read_u32(r));
+        case VM_FLOAT:
+            memcpy(&f, read_bytes(r, sizeof(double)), sizeof(double));
+            return vFloat(f);
+        case VM_STRING:
+            v.type = VM_STRING;
+            v.value.to_str = read_string(r);
+            return v;
+        case VM_PROGRAM:
+            v = vCode(read_program(r, prev), NULL);
+            vector_push(&r->programs, v.value.to_code);
+            return v;
+        default:
+            read_corrupt(r);
+            return vNull();
+    }
+}
+
+// ------------------ SNAPSHOTS ------------------
+
+boolean image_mark_snapshot(astnode* tree, const char* marker)
+{
+    symbol sym = intern(marker);
+
+    for (size_t i = 0; i < tree->children.size; i++)
+    {
+        astnode* st = vector_get(&tree->children, i);
+
+        if (st->type == AST_ASSIGN && st->sym == sym) {
+            vector_insert(&tree->children, i + 1, astnode_new("snapshot", AST_SNAPSHOT, st->pos));
+            return true;
+        }
+    }
+    return false;
+}
+
+boolean image_write_snapshot(virtual_machine* vm, call_info* call, const char* path)
+{
+    // global statements leave nothing on the stack to be recorded
+    if (call->prev != NULL || call->tp != 0) {
+        return false;
+    }
+
+    program* p = call->program->p;
+    compile_all(p);
+
+    image_writer w = writer_new(path);
+
+    if (w.f == NULL) {
+        return false;
+    }
+
+    write_image(&w, p, SNAPSHOT_MAGIC);
+    write_u64(&w, call->pc + 1);
+
+    // includes globals registered by the functions compiled for the image
+    write_u32(&w, p->symbol_table.size);
+
+    for (size_t i = 0; i < p->symbol_table.size; i++) {
+        write_state(&w, vm->heap[i]);
+    }
+
+    return writer_close(&w);
+}
+
+void write_state(image_writer* w, Value v)
+{
+    code_object* code = v.value.to_code;
+    Table* t = v.value.to_table;
+    int id;
+
+    if (v.type == VM_PROGRAM && code->p->native != NULL)
+    {
+        write_u32(w, SNAPSHOT_NATIVE);
+        write_string(w, builtin_of(code->p)->name);
+    }
+    else if (v.type == VM_PROGRAM && code->closure == NULL)
+    {
+        write_u32(w, SNAPSHOT_FUNCTION);
+        write_u32(w, idmap_get(&w->programs, (uintptr_t) code->p));
+    }
+    else if (v.type != VM_PROGRAM && v.type != VM_TABLE)
+    {
+        write_value(w, v);
+    }
+    else if ((id = idmap_get(&w->objects, (uintptr_t) t)) != -1)
+    {
+        write_u32(w, SNAPSHOT_OBJECT);
+        write_u32(w, v.type);
+        write_u32(w, id);
+    }
+    else if (v.type == VM_PROGRAM)
+    {
+        // objects are numbered before their contents, which may refer back
+        idmap_put(&w->objects, (uintptr_t) code);
+        write_u32(w, SNAPSHOT_CLOSURE);
+        write_u32(w, idmap_get(&w->programs, (uintptr_t) code->p));
+
+        for (size_t i = 0; i < code->p->closure_table.size; i++) {
+            write_state(w, code->closure[i]);
+        }
+    }
+    else
+    {
+        idmap_put(&w->objects, (uintptr_t) t);
+        write_u32(w, SNAPSHOT_TABLE);
+        write_u64(w, t->capacity);
+        write_u64(w, t->size);
+
+        for (size_t i = 0; i < t->size; i++) {
+            write_state(w, t->pairs[i].key);
+            write_state(w, t->pairs[i].value);
+        }
+    }
+}
+
+program* image_load_snapshot(const char* path, Value* heap, size_t* entry)
+{
+    image_reader r;
+
+    if (!read_header(&r, path, SNAPSHOT_MAGIC, NULL)) {
+        reader_close(&r, false);
+        return NULL;
+    }
+
+    program* p = read_program(&r, NULL);
+    *entry = read_u64(&r);
+    size_t n = read_u32(&r);
+
+    if (*entry > p->length || n > MAX_HEAP_SIZE) {
+        file_error("Corrupt heap snapshot", path);
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        heap[i] = read_state(&r);
+    }
+
+    reader_close(&r, true);
+    return p;
+}
+
+Value read_state(image_reader* r)
+{
+    Value v;
+    builtin* b;
+    code_object* code;
+    uint32_t tag = read_u32(r);
+    uint32_t id;
+
+    switch (tag)
+    {
+        case SNAPSHOT_FUNCTION:
+        case SNAPSHOT_CLOSURE:
+            if ((id = read_u32(r)) >= r->programs.size) {
+                file_error("Corrupt heap snapshot", r->path);
+            }
+
+            v.type = VM_PROGRAM;
+            v.value.to_code = vector_get(&r->programs, id);
+
+            if (tag == SNAPSHOT_FUNCTION) {
+                return v;
+            }
+
+            code = malloc(sizeof(code_object));
+            code->p = v.value.to_code->p;
+            code->closure = malloc(sizeof(Value) * (code->p->closure_table.size + 1));
+            vector_push(&r->objects, code);
+
+            for (size_t i = 0; i < code->p->closure_table.size; i++) {
+                code->closure[i] = read_state(r);
+            }
+
+            v.value.to_code = code;
+            return v;
+
+        case SNAPSHOT_NATIVE:
+            if ((b = builtin_find(intern(read_string(r)))) == NULL) {
+                file_error("Corrupt heap snapshot", r->path);
+            }
+
+            b->code.p = &b->p;
+            v.type = VM_PROGRAM;
+            v.value.to_code = &b->code;
+            return v;
+
+        case SNAPSHOT_TABLE:
+            v = vTable(read_u64(r));
+            v.value.to_table->size = read_u64(r);
+            vector_push(&r->objects, v.value.to_table);
+
+            if (v.value.to_table->size > v.value.to_table->capacity) {
+                file_error("Corrupt heap snapshot", r->path);
+            }
+
+            for (size_t i = 0; i < v.value.to_table->size; i++) {
+                v.value.to_table->pairs[i].key = read_state(r);
+                v.value.to_table->pairs[i].value = read_state(r);
+            }
+            return v;
+
+        case SNAPSHOT_OBJECT:
+            v.type = read_u32(r);
+
+            if ((id = read_u32(r)) >= r->objects.size || (v.type != VM_PROGRAM && v.type != VM_TABLE)) {
+                file_error("Corrupt heap snapshot", r->path);
+            } else if (v.type == VM_PROGRAM) {
+                v.value.to_code = vector_get(&r->objects, id);
+            } else {
+                v.value.to_table = vector_get(&r->objects, id);
+            }
+            return v;
+
+        default:
+            r->pos -= sizeof(uint32_t);
+            return read_value(r, NULL);
+    }
+}
+
+// ------------------ UTILITY METHODS ------------------
+
+// Combines the build identifier with the operation names and the fused
+// pairs of this build, so images of any other build are rejected
+uint64_t image_signature()
+{
+    uint64_t hash = strhash(HE_BUILD_ID);
+    hash = hash * 31 + (sizeof(Value) << 8 | sizeof(instruction));
+
+    for (size_t i = 0; i < VM_BASE_OPS; i++) {
+        hash = hash * 31 + strhash(operation_strings[i]);
+    }
+
+    for (size_t i = 0; i < superinstruction_count; i++) {
+        hash = hash * 31 + (superinstruction_ops[i][0] << 8 | superinstruction_ops[i][1]);
+    }
+
+    return hash;
+}
+
+// Returns the recorded source of a position, NO_SOURCE if there is none
+uint32_t source_index(lxpos* pos)
+{
+    for (size_t i = 0; i < image_sources.size; i++)
+    {
+        image_source* s = vector_get(&image_sources, i);
+        if (s->src == pos->src) return i;
+    }
+    return NO_SOURCE;
+}
+
+// Checks the content hash of each source of an image against its file
+boolean sources_current(image_reader* r)
+{
+    for (size_t i = 0; i < r->nsources; i++)
+    {
+        image_source* s = &r->sources[i];
+
+        if (access(s->path, R_OK) != 0) {
+            return false;
+        }
+
+        char* src = (char*) read_file(s->path);
+        boolean current = strhash(src) == s->hash;
+        free(src);
+
+        if (!current) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Frees the tables used while reading an image. A rejected image also
+// frees the programs read from it and its mapping, as nothing refers
+// to them, while a kept one is used in place
+void reader_close(image_reader* r, boolean keep)
+{
+    for (size_t i = 0; !keep && i < r->loaded.size; i++)
+    {
+        program* p = vector_get(&r->loaded, i);
+
+        for (size_t j = 0; j < p->line_address_table.size; j++) {
+            free((char*) p->line_address_table.keys[j]);
+            line_entry_free(p->line_address_table.values[j]);
+        }
+
+        for (size_t j = 0; j < p->jump_tables.size; j++)
+        {
+            jump_table* t = vector_get(&p->jump_tables, j);
+            free(t->keys);
+            free(t->cases);
+            free(t);
+        }
+
+        for (size_t j = 0; j < p->invoke_caches.size; j++) {
+            free(vector_get(&p->invoke_caches, j));
+        }
+
+        free(p->constants);
+        free(p->line_address_table.keys);
+        free(p->line_address_table.values);
+        free(p->jump_tables.items);
+        free(p->invoke_caches.items);
+        idmap_delete(&p->symbol_table);
+        idmap_delete(&p->constant_table);
+        idmap_delete(&p->closure_table);
+        free(p);
+    }
+
+    for (size_t i = 0; !keep && i < r->programs.size; i++) {
+        free(vector_get(&r->programs, i));
+    }
+
+    if (!keep && r->data != NULL) {
+        unmap_file(r->data, r->size);
+    }
+
+    free(r->sources);
+    free(r->loaded.items);
+    free(r->programs.items);
+    free(r->objects.items);
+}
+
+// Opens a temporary file next to the path, so that an image is never
+// seen half written by another process reading the path
+image_writer writer_new(const char* path)
+{
+    image_writer w = {
+        .path = path,
+        .pos = 0,
+        .programs = idmap_new(16),
+        .objects = idmap_new(16),
+    };
+
+    snprintf(w.temp, sizeof(w.temp), "%s.tmp.%ld", path, (long) getpid());
+    w.f = fopen(w.temp, "wb");
+    return w;
+}
+
+// Closes the file and moves it to its path if written completely,
+// otherwise the file is removed
+boolean writer_close(image_writer* w)
+{
+    boolean ok = ferror(w->f) == 0;
+
+    idmap_delete(&w->programs);
+    idmap_delete(&w->objects);
+    ok = fclose(w->f) == 0 && ok;
+
+    if (!ok || rename(w->temp, w->path) != 0) {
+        remove(w->temp);
+        return false;
+    }
+    return true;
+}
+
+void write_bytes(image_writer* w, const void* data, size_t n)
+{
+    fwrite(data, 1, n, w->f);
+    w->pos += n;
+}
+
+void write_u32(image_writer* w, uint32_t x)
+{
+    write_bytes(w, &x, sizeof(uint32_t));
+}
+
+void write_u64(image_writer* w, uint64_t x)
+{
+    write_bytes(w, &x, sizeof(uint64_t));
+}
+
+void write_string(image_writer* w, const char* s)
+{
+    size_t n = strlen(s);
+    write_u32(w, n);
+    write_bytes(w, s, n + 1);
+}
+
+void write_align(image_writer* w)
+{
+    static const char padding[sizeof(instruction)] = { 0 };
+    write_bytes(w, padding, (sizeof(instruction) - w->pos % sizeof(instruction)) % sizeof(instruction));
+}
+
+const void* read_bytes(image_reader* r, size_t n)
+{
+    if (n > r->size - r->pos) {
+        read_corrupt(r);
+    }
+
+    const void* data = r->data + r->pos;
+    r->pos += n;
+    return data;
+}
+
+uint32_t read_u32(image_reader* r)
+{
+    uint32_t x;
+    memcpy(&x, read_bytes(r, sizeof(uint32_t)), sizeof(uint32_t));
+    return x;
+}
+
+// Reads the number of elements of a table, each taking at least a byte
+size_t read_count(image_reader* r)
+{
+    size_t n = read_u32(r);
+
+    if (n > r->size - r->pos) {
+        read_corrupt(r);
+    }
+    return n;
+}
+
+uint64_t read_u64(image_reader* r)
+{
+    uint64_t x;
+    memcpy(&x, read_bytes(r, sizeof(uint64_t)), sizeof(uint64_t));
+    return x;
+}
+
+const char* read_string(image_reader* r)
+{
+    size_t n = read_u32(r);
+    const char* s = read_bytes(r, n + 1);
+
+    if (s[n] != '\0') {
+        read_corrupt(r);
+    }
+    return s;
+}
+
+void read_align(image_reader* r)
+{
+    read_bytes(r, (sizeof(instruction) - r->pos % sizeof(instruction)) % sizeof(instruction));
+}
+
+void read_corrupt(image_reader* r)
+{
+    if (r->recover != NULL) {
+        longjmp(*r->recover, 1);
+    }
+
+    file_error("Corrupt bytecode image", r->path);
+}
+
+// Maps a whole file into memory, copied on write so the program may
+// still patch its code, returns NULL if the file cannot be opened
+const char* map_file(const char* path, size_t* size)
+{
+#ifdef __MINGW32__
+    FILE* fptr = fopen(path, "rb");
+
+    if (fptr == NULL) {
+        return NULL;
+    }
+
+    fseek(fptr, 0, SEEK_END);
+    *size = ftell(fptr);
+    fseek(fptr, 0, SEEK_SET);
+
+    char* data = malloc(*size + 1);
+    *size = fread(data, 1, *size, fptr);
+    fclose(fptr);
+    return data;
+#else
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+
+    if (fd == -1) {
+        return NULL;
+    } else if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void* data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    *size = st.st_size;
+    return data == MAP_FAILED ? NULL : data;
+#endif
+}
+
+void unmap_file(const char* data, size_t size)
+{
+#ifdef __MINGW32__
+    free((char*) data);
+#else
+    munmap((void*) data, size);
+#endif
+}
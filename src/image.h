@@ -0,0 +1,100 @@
+#ifndef HE_IMAGE_HEADER
+#define HE_IMAGE_HEADER
+
+#include "common.h"
+#include "datatypes.h"
+#include "compiler.h"
+#include "vm.h"
+
+// Version of the image layout, images of other versions are not loaded
+#define IMAGE_VERSION 3
+
+// Path a heap snapshot is written to when the program reaches its marker
+extern const char* snapshot_path;
+
+// Variable whose first global assignment is followed by a heap snapshot
+extern const char* snapshot_marker;
+
+/**
+ * @brief Records a source file read by the front end. Images keep the
+ *      text of every recorded source, so runtime errors can still show
+ *      the offending line, and its hash, so a cached image can be checked
+ *      against the files it was compiled from.
+ *
+ * @param path Path of the source file
+ * @param src Source text
+ */
+void image_add_source(const char* path, const char* src);
+
+/**
+ * @brief Forgets the source files registered by image_add_source, for a
+ *      program which is not written as an image. The texts are not freed.
+ */
+void image_reset_sources();
+
+/**
+ * @brief Writes a compiled program and all functions among its constants
+ *      into a bytecode image. Images are tied to the interpreter build
+ *      which wrote them, as operation codes change between builds.
+ *
+ * @param p Global program, after all bytecode passes
+ * @param path Path of the image file
+ * @return False if the file could not be written
+ */
+boolean image_write(program* p, const char* path);
+
+/**
+ * @brief Maps a bytecode image into memory and rebuilds the program it
+ *      was written from. Code and strings are used in place from the
+ *      mapping, only the tables of each function are allocated.
+ *
+ * @param path Path of the image file
+ * @param check_sources Whether the image must match the current contents
+ *      of its sources, inlining budget and tree shaking mode, as when used
+ *      as a cache
+ * @return Global program, or NULL if the file could not be opened, was
+ *      written by another interpreter build, is out of date or fails
+ *      the checks of its operands and tables
+ */
+program* image_load(const char* path, boolean check_sources);
+
+/**
+ * @brief Marks the point of the program at which a heap snapshot is
+ *      taken, right after the first global statement assigning the
+ *      marker variable. Includes should be expanded beforehand, so
+ *      that statements of included files may be marked.
+ *
+ * @param tree Global statement block
+ * @param marker Name of the marker variable
+ * @return False if no global statement assigns the marker
+ */
+boolean image_mark_snapshot(astnode* tree, const char* marker);
+
+/**
+ * @brief Writes an image of the program along with the global variables
+ *      of the virtual machine and every table, string and closure they
+ *      reach, so that the program can later be resumed from the point
+ *      it has reached without running its initialisation again.
+ *
+ * @param vm Reference to virtual machine
+ * @param call Global call frame, paused between two global statements
+ * @param path Path of the snapshot file
+ * @return False if the file could not be written
+ */
+boolean image_write_snapshot(virtual_machine* vm, call_info* call, const char* path);
+
+/**
+ * @brief Maps a heap snapshot into memory, rebuilding its program and
+ *      restoring the global variables it recorded. Code and strings are
+ *      used in place from the mapping as in images, tables and closures
+ *      are allocated.
+ *
+ * @param path Path of the snapshot file
+ * @param heap Global variables of the virtual machine to restore
+ * @param entry Receives the address the global program resumes from
+ * @return Global program, or NULL if the file could not be opened or was
+ *      written by another interpreter build
+ */
+program* image_load_snapshot(const char* path, Value* heap, size_t* entry);
+
+#endif
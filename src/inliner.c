@@ -0,0 +1,353 @@
+#include "inliner.h"
+#include "peephole.h"
+
+// forward declarations
+void count_assignments(astnode* node, idmap* seen, idmap* repeated);
+boolean returns_from_loop(program* f);
+boolean allocates_in_region(program* f);
+symbol hidden_variable(program* f, size_t i);
+
+size_t inline_budget = MAX_INLINE_INSTRUCTIONS;
+
+// variables assigned by any statement, and by exactly one statement, in
+// the whole program
+idmap assigned_symbols;
+idmap assigned_once;
+boolean inline_ready = false;
+
+// built-ins compiled to their own operation while never rebound
+struct intrinsic {
+    const char* name;
+    vm_op op;
+    size_t argc;
+} intrinsics[] = {
+    { "len",    OP_LEN,     1 },
+    { "sqrt",   OP_SQRT,    1 },
+    { "pow",    OP_POW,     2 },
+    { "int",    OP_TOINT,   1 },
+    { "float",  OP_TOFLOAT, 1 },
+    { "bool",   OP_TOBOOL,  1 },
+    { "str",    OP_TOSTR,   1 },
+};
+
+// candidate functions and the program binding them as a local, or NULL
+// for globals, indexed by symbol position in the candidate table
+idmap candidate_table;
+vector candidate_functions;
+vector candidate_binders;
+
+void inline_prepare(astnode* tree)
+{
+    idmap repeated = idmap_new(16);
+
+    // tables of the program compiled before
+    if (inline_ready) {
+        idmap_delete(&assigned_symbols);
+        idmap_delete(&assigned_once);
+        idmap_delete(&candidate_table);
+        free(candidate_functions.items);
+        free(candidate_binders.items);
+    }
+
+    assigned_symbols = idmap_new(64);
+    assigned_once = idmap_new(64);
+    candidate_table = idmap_new(16);
+    candidate_functions = vector_new(16);
+    candidate_binders = vector_new(16);
+    inline_ready = true;
+
+    count_assignments(tree, &assigned_symbols, &repeated);
+
+    for (size_t i = 0; i < assigned_symbols.size; i++) {
+        if (!idmap_has(&repeated, assigned_symbols.keys[i])) idmap_put(&assigned_once, assigned_symbols.keys[i]);
+    }
+
+    idmap_delete(&repeated);
+}
+
+void inline_register(program* p, astnode* assign, vm_scope scope)
+{
+    if (!inline_ready || inline_budget == 0 || !idmap_has(&assigned_once, assign->sym)) {
+        return;
+    }
+
+    // functions capturing variables end with CLOSE instead
+    instruction last = p->code[p->length - 1];
+
+    if (last.stackop.op != OP_PUSHK || p->constants[last.ux.ux].type != VM_PROGRAM) {
+        return;
+    }
+
+    idmap_put(&candidate_table, assign->sym);
+    vector_push(&candidate_functions, p->constants[last.ux.ux].value.to_code->p);
+    vector_push(&candidate_binders, scope == VM_GLOBAL_SCOPE ? NULL : p);
+}
+
+program* inline_candidate(program* p, astnode* call)
+{
+    astnode* callee = vector_get(&call->children, 0);
+
+    if (!inline_ready || inline_budget == 0 || callee->type != AST_REFERENCE) {
+        return NULL;
+    }
+
+    int index = idmap_get(&candidate_table, callee->sym);
+
+    if (index == -1) {
+        return NULL;
+    }
+
+    program* f = vector_get(&candidate_functions, index);
+    program* binder = vector_get(&candidate_binders, index);
+
+    // name may be shadowed by a parameter or captured from an outer scope
+    vm_scope scope;
+    dereference_variable(p, callee->sym, &scope);
+
+    if (binder == NULL ? scope != VM_GLOBAL_SCOPE : scope != VM_LOCAL_SCOPE || binder != p) {
+        return NULL;
+    }
+
+    if (f->argc != call->children.size - 1) {
+        return NULL;
+    }
+
+    // functions in global scope are compiled once first called or inlined,
+    // a function being compiled cannot be inlined into itself, and one
+    // failing to compile reports its error once called
+    if (!try_compile_deferred(f)) {
+        return NULL;
+    }
+
+    if (f->deferred != NULL || f->length > inline_budget || f->closure_table.size > 0) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < f->constant_table.size; i++) {
+        if (f->constants[i].type == VM_PROGRAM) return NULL;
+    }
+
+    // loop state would be left on the stack of the caller by the return
+    if (returns_from_loop(f)) {
+        return NULL;
+    }
+
+    // region memory is released when a frame returns, and inlined code has
+    // none, so a caller calling in a loop would keep every allocation
+    if (allocates_in_region(f)) {
+        return NULL;
+    }
+
+    // hidden variables not yet taken by another call and constants must
+    // fit the caller
+    size_t hidden = 0;
+
+    for (size_t i = 0; i < f->symbol_table.size; i++) {
+        if (!idmap_has(&p->symbol_table, hidden_variable(f, i))) hidden++;
+    }
+
+    if (p->symbol_table.size + hidden >= MAX_LOCAL_VARIABLES
+            || p->constant_table.size + f->constant_table.size >= MAX_LOCAL_CONSTANTS) {
+        return NULL;
+    }
+
+    return f;
+}
+
+vm_op intrinsic_candidate(program* p, astnode* call)
+{
+    astnode* callee = vector_get(&call->children, 0);
+
+    if (!inline_ready || callee->type != AST_REFERENCE || idmap_has(&assigned_symbols, callee->sym)) {
+        return OP_NOP;
+    }
+
+    // name may be shadowed by a parameter
+    vm_scope scope;
+    dereference_variable(p, callee->sym, &scope);
+
+    if (scope != VM_GLOBAL_SCOPE) {
+        return OP_NOP;
+    }
+
+    for (size_t i = 0; i < sizeof(intrinsics) / sizeof(struct intrinsic); i++) {
+        if (streq(callee->value, intrinsics[i].name) && call->children.size - 1 == intrinsics[i].argc) return intrinsics[i].op;
+    }
+    return OP_NOP;
+}
+
+void compile_inline(program* p, astnode* call, program* f)
+{
+    int16_t* slots = malloc(sizeof(int16_t) * (f->symbol_table.size + 1));
+    boolean global = p->prev == NULL;
+
+    for (size_t i = 1; i < call->children.size; i++) {
+        compile_expression(p, vector_get(&call->children, i));
+    }
+
+    // parameters and locals of the callee become hidden variables, shared
+    // by every call to it from the caller as they are dead once it returns
+    for (size_t i = 0; i < f->symbol_table.size; i++)
+    {
+        vm_scope scope;
+        slots[i] = register_unique_variable_local(p, hidden_variable(f, i), &scope);
+    }
+
+    reserve_instructions(p, f->argc + f->length + 1);
+
+    // binds arguments, the last of which is on top of the stack
+    for (size_t i = f->argc; i-- > 0;)
+    {
+        p->code[p->length].sx.op = global ? OP_STORG : OP_STORL;
+        p->code[p->length].sx.sx = slots[i];
+        p->length++;
+    }
+
+    // lines of the callee are kept, with the line of the call as their
+    // site, and the line of the call resumes after the spliced code
+    size_t start = p->length;
+    line_entry* site = p->line_address_table.size == 0 ? NULL
+        : line_entry_copy(p->line_address_table.values[p->line_address_table.size - 1], NULL);
+
+    for (size_t i = 0; i < f->line_address_table.size; i++) {
+        put_line_entry(p, start + atoi(f->line_address_table.keys[i]), line_entry_copy(f->line_address_table.values[i], site));
+    }
+
+    for (size_t pc = 0; pc < f->length; pc++)
+    {
+        instruction i = f->code[pc];
+
+        // callee compiled after the program was fused is copied unfused
+        if (i.stackop.op >= VM_BASE_OPS) {
+            i.stackop.op = superinstruction_ops[i.stackop.op - VM_BASE_OPS][0];
+        }
+
+        switch (i.stackop.op)
+        {
+            case OP_LOADL:
+                i.sx.op = global ? OP_LOADG : OP_LOADL;
+                i.sx.sx = slots[i.sx.sx];
+                break;
+
+            case OP_STORL:
+                i.sx.op = global ? OP_STORG : OP_STORL;
+                i.sx.sx = slots[i.sx.sx];
+                break;
+
+            case OP_STORLK:
+                i.sx.op = global ? OP_STORGK : OP_STORLK;
+                i.sx.sx = slots[i.sx.sx];
+                break;
+
+            case OP_UPDATEL:
+                i.ax.op = global ? OP_UPDATEG : OP_UPDATEL;
+                i.ax.sx = slots[i.ax.sx];
+                break;
+
+            case OP_APPENDL:
+                i.ax.op = global ? OP_APPENDG : OP_APPENDL;
+                i.ax.a = slots[i.ax.a];
+                i.ax.sx = slots[i.ax.sx];
+                break;
+
+            case OP_PUSHK:
+                i.ux.ux = register_constant(p, f->constants[i.ux.ux]);
+                break;
+
+            // the caller owns a copy of each table, freed with its code
+            case OP_SWITCH:
+                i.ux.ux = register_jump_table(p, jump_table_copy(vector_get(&f->jump_tables, i.ux.ux)));
+                break;
+
+            // every copy of a call site keeps its own method cache
+            case OP_INVOKE:
+                i.ax.sx = register_invoke_cache(p, invoke_cache_new(((invoke_cache*) vector_get(&f->invoke_caches, i.ax.sx))->key));
+                break;
+
+            case OP_RET:
+                // result is left on the stack past the spliced code
+                i.sx.op = OP_JMP;
+                i.sx.sx = f->length - pc - 1;
+                break;
+
+            default:
+                break;
+        }
+
+        p->code[p->length++] = i;
+    }
+
+    if (site != NULL) {
+        put_line_entry(p, p->length, site);
+    }
+
+    free(slots);
+}
+
+// ------------------ UTILITY METHODS ------------------
+
+// Collects assigned symbols, and those assigned more than once. Includes
+// left unexpanded may assign anything, so they disable inlining.
+void count_assignments(astnode* node, idmap* seen, idmap* repeated)
+{
+    if (node == NULL) {
+        return;
+    }
+
+    if (node->type == AST_INCLUDE) {
+        inline_ready = false;
+    } else if (node->type == AST_ASSIGN && idmap_has(seen, node->sym)) {
+        idmap_put(repeated, node->sym);
+    } else if (node->type == AST_ASSIGN) {
+        idmap_put(seen, node->sym);
+    }
+
+    for (size_t i = 0; i < node->children.size; i++) {
+        count_assignments(vector_get(&node->children, i), seen, repeated);
+    }
+}
+
+// Checks whether a return lies within a counted or table loop, whose
+// state stays on the stack until the loop exits
+boolean returns_from_loop(program* f)
+{
+    for (size_t pc = 0; pc < f->length; pc++)
+    {
+        vm_op op = unfused_op(f->code[pc]);
+
+        if (op != OP_FORPREP && op != OP_TITER) {
+            continue;
+        }
+
+        // the loop body runs up to its exit jump target
+        for (size_t j = pc + 1; j <= pc + f->code[pc].sx.sx && j < f->length; j++) {
+            if (unfused_op(f->code[j]) == OP_RET) return true;
+        }
+    }
+    return false;
+}
+
+// Checks whether a function allocates tables or closures which never
+// escape it in the region of its frame
+boolean allocates_in_region(program* f)
+{
+    for (size_t pc = 0; pc < f->length; pc++)
+    {
+        vm_op op = unfused_op(f->code[pc]);
+        if (op == OP_TNEWR || op == OP_CLOSER) return true;
+    }
+    return false;
+}
+
+// Returns the name of the hidden variable holding a local of an inlined
+// function, one per function in each calling scope
+symbol hidden_variable(program* f, size_t i)
+{
+    char name[256];
+    size_t index = 0;
+
+    while (vector_get(&candidate_functions, index) != f) index++;
+
+    snprintf(name, sizeof(name), "$inline%lu.%s", index, symbol_name(f->symbol_table.keys[i]));
+    return intern(name);
+}
@@ -0,0 +1,69 @@
+#ifndef HE_INLINER_HEADER
+#define HE_INLINER_HEADER
+
+#include "common.h"
+#include "datatypes.h"
+#include "parser.h"
+#include "compiler.h"
+
+// Largest function body, in instructions, inlined at call sites
+extern size_t inline_budget;
+
+/**
+ * @brief Records the variables assigned anywhere in the program, and
+ *      those assigned exactly once, which are the only ones whose calls
+ *      may be inlined. Must be run on the whole program before
+ *      compilation.
+ * 
+ * @param tree Global statement block
+ */
+void inline_prepare(astnode* tree);
+
+/**
+ * @brief Records a compiled assignment of a function literal as an
+ *      inlining candidate if its variable is never reassigned and the
+ *      function captures no variables.
+ * 
+ * @param p Reference to program
+ * @param assign Assignment statement node
+ * @param scope Scope of the assigned variable
+ */
+void inline_register(program* p, astnode* assign, vm_scope scope);
+
+/**
+ * @brief Returns the function to inline in place of a call, or NULL if
+ *      the call must be compiled as a regular call. The callee must be a
+ *      registered candidate visible from the calling scope, with a body
+ *      within the inlining budget and no nested functions.
+ * 
+ * @param p Reference to calling program
+ * @param call Function call node
+ * @return Function program or NULL
+ */
+program* inline_candidate(program* p, astnode* call);
+
+/**
+ * @brief Returns the operation computing a built-in in place of a call,
+ *      or OP_NOP if the call must be compiled as a regular call. The
+ *      callee must be a global built-in which is never assigned by the
+ *      program, so the binding is known to hold the built-in.
+ * 
+ * @param p Reference to calling program
+ * @param call Function call node
+ * @return Intrinsic operation or OP_NOP
+ */
+vm_op intrinsic_candidate(program* p, astnode* call);
+
+/**
+ * @brief Compiles a call by splicing the bytecode of the callee into the
+ *      calling program. Arguments and locals of the callee are bound to
+ *      hidden variables of the caller and returns jump past the spliced
+ *      code with the result left on the stack.
+ * 
+ * @param p Reference to calling program
+ * @param call Function call node
+ * @param f Function program to inline
+ */
+void compile_inline(program* p, astnode* call, program* f);
+
+#endif
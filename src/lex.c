@@ -12,6 +12,7 @@ lxtoken* lxtoken_new(const char* value, lxtype type, lxpos pos)
     tk->pos = pos;
     tk->type = type;
     tk->value = value;
+    tk->sym = 0;
     return tk;
 }
 
@@ -44,6 +45,11 @@ void lexify(lexer* lx, vector* tokens)
         {
             vector_push(tokens, token);
         }
+        else
+        {
+            free((char*) token->value);
+            free(token);
+        }
     }
     vector_push(tokens, token);
 }
@@ -74,7 +80,7 @@ lxtoken* lex(lexer* lx)
             point += lx->lookahead == '.'; 
             buf[len++] = lexadvance(lx); 
         } 
-        while (isdigit((int) lx->lookahead) || (!point && lx->lookahead == '.'));
+        while (isdigit((int) lx->lookahead) || (!point && lx->lookahead == '.' && lx->source[lx->pos.char_offset + 2] != '.'));
 
         type = point ? LX_FLOAT : LX_INTEGER;
     }
@@ -92,6 +98,18 @@ lxtoken* lex(lexer* lx)
         type = LX_ASSIGN;
         len += 2;
     }
+    else if (check_pattern(lx, "..", buf))
+    {
+        type = LX_RANGE;
+        len += 2;
+    }
+    else if (check_pattern(lx, "+=", buf) || check_pattern(lx, "-=", buf) || check_pattern(lx, "*=", buf)
+            || check_pattern(lx, "/=", buf))
+    {
+        // only the operation applied by the update is kept
+        type = LX_UPDATE;
+        len += 1;
+    }
     else if (check_pattern(lx, "<=", buf) || check_pattern(lx, ">=", buf) || check_pattern(lx, "==", buf)
             || check_pattern(lx, "&&", buf) || check_pattern(lx, "||", buf) || check_pattern(lx, "!=", buf))
     {
@@ -177,6 +195,17 @@ lxtoken* lex(lexer* lx)
 
     // terminates string and reduces size
     buf[len] = '\0';
+
+    // identifiers are interned so later stages can key on their ids
+    if (type == LX_SYMBOL) {
+        symbol sym = intern(buf);
+        free(buf);
+
+        lxtoken* tk = lxtoken_new(symbol_name(sym), type, pos);
+        tk->sym = sym;
+        return tk;
+    }
+
     buf = reduce_string_buffer(buf);
 
     return lxtoken_new(buf, type, pos);
@@ -276,11 +305,16 @@ char* reduce_string_buffer(char* buffer)
 
 void lexerror(lexer* lx, const char* msg)
 {   
-    fprintf(stderr, "%s[err] %s (%d, %d) in %s:\n", ERR_COL, msg, lx->pos.line_pos + 1, lx->pos.col_pos + 1, lx->pos.origin);
-    fprintf(stderr, "\t|\n");
-    fprintf(stderr, "\t| %04i %s\n", lx->pos.line_pos + 1, get_line(lx->source, lx->pos.line_offset));
-    fprintf(stderr, "\t| %s'\n%s", paddchar('~', 5 + lx->pos.col_pos), DEF_COL);
-    exit(0);
+    char buf[512];
+    snprintf(buf, sizeof(buf), "%s (%d, %d) in %s", msg, lx->pos.line_pos + 1, lx->pos.col_pos + 1, lx->pos.origin);
+
+    if (current_trap == NULL) {
+        fprintf(stderr, "%s[err] %s:\n", ERR_COL, buf);
+        fprintf(stderr, "\t|\n");
+        fprintf(stderr, "\t| %04i %s\n", lx->pos.line_pos + 1, get_line(lx->source, lx->pos.line_offset));
+        fprintf(stderr, "\t| %s'\n%s", paddchar('~', 5 + lx->pos.col_pos), DEF_COL);
+    }
+    error_exit(buf);
 }
 
 // Clones lxpos object to freeze location data for tokens.
@@ -329,6 +363,8 @@ const char* lxtype_strings[] = {
     "LEFT_SQUARE      ",
     "RIGHT_SQUARE     ",
     "DOT              ",
+    "RANGE            ",
+    "UPDATE           ",
 };
 
 void lxtoken_display(lxtoken* tk)
@@ -35,6 +35,8 @@ typedef enum lxtype {
     LX_LEFT_SQUARE,
     LX_RIGHT_SQUARE,
     LX_DOT,             // 28
+    LX_RANGE,
+    LX_UPDATE,
 } lxtype;
 
 typedef struct lxpos {
@@ -49,6 +51,7 @@ typedef struct lxpos {
 typedef struct lxtoken {
     lxtype type;
     const char* value;
+    symbol sym;
     lxpos pos;
 } lxtoken;
 
@@ -1,36 +1,6 @@
 #include "lib.h"
 
-Value native_print(Value v[]) 
-{
-    printf("%s\n", value_to_str(&v[0]));
-    return vNull();
-}
-
-Value native_input(Value v[]) 
-{
-    int ch, extra;
-
-    if (v->value.to_str != NULL) {
-        printf("%s", value_to_str(&v[0]));
-        fflush (stdout);
-    }
-
-    char* buf = malloc(sizeof(char) * 1000);
-    
-    if (fgets(buf, 1000, stdin) == NULL) {
-        return vNull();
-    }
-    
-    if (buf[strlen(buf)-1] != '\n') {
-        extra = 0;
-        while (((ch = getchar()) != '\n') && (ch != EOF))
-            extra = 1;
-        if (extra) vNull();
-    }
-
-    buf[strlen(buf)-1] = '\0';
-    return vString(buf);
-}
+// ------------------ VALUE FUNCTIONS ------------------
 
 Value native_int_cast(Value v[]) 
 {
@@ -118,41 +88,178 @@ Value native_pow(Value v[])
     }
 }
 
-Value native_time(Value v[])
+// -------------------- BUILT-INS --------------------
+
+// wraps a value function of fixed arity which cannot fail
+#define NATIVE_WRAPPER(name, f) \
+    native_status name(virtual_machine* vm, Value* args, size_t argc, Value* out) \
+    { \
+        *out = f(args); \
+        return NATIVE_OK; \
+    }
+
+NATIVE_WRAPPER(builtin_int, native_int_cast)
+NATIVE_WRAPPER(builtin_float, native_float_cast)
+NATIVE_WRAPPER(builtin_bool, native_bool_cast)
+NATIVE_WRAPPER(builtin_str, native_str_cast)
+NATIVE_WRAPPER(builtin_len, native_length)
+NATIVE_WRAPPER(builtin_sqrt, native_sqrt)
+NATIVE_WRAPPER(builtin_pow, native_pow)
+
+native_status builtin_print(virtual_machine* vm, Value* args, size_t argc, Value* out)
 {
-    return vInt(1000 * clock() / CLOCKS_PER_SEC);
+    for (size_t i = 0; i < argc; i++) {
+        printf(i + 1 < argc ? "%s " : "%s", value_to_str(&args[i]));
+    }
+
+    printf("\n");
+    return NATIVE_OK;
 }
 
-Value native_delay(Value v[])
+native_status builtin_input(virtual_machine* vm, Value* args, size_t argc, Value* out)
 {
-    if (v->type != VM_INT)
-        runtimeerr(current_vm, "Expected argument of type Int!");
+    int ch;
+
+    if (args->value.to_str != NULL) {
+        printf("%s", value_to_str(&args[0]));
+        fflush (stdout);
+    }
+
+    char* buf = malloc(sizeof(char) * 1000);
+    
+    if (fgets(buf, 1000, stdin) == NULL) {
+        return NATIVE_OK;
+    }
+    
+    // discards the rest of a line longer than the buffer
+    if (buf[strlen(buf)-1] != '\n') {
+        while (((ch = getchar()) != '\n') && (ch != EOF));
+    }
 
-    clock_t t1 = 1000 * clock() / CLOCKS_PER_SEC + v[0].value.to_int;
+    buf[strlen(buf)-1] = '\0';
+    *out = vString(buf);
+    return NATIVE_OK;
+}
+
+native_status builtin_time(virtual_machine* vm, Value* args, size_t argc, Value* out)
+{
+    *out = vInt(1000 * clock() / CLOCKS_PER_SEC);
+    return NATIVE_OK;
+}
+
+native_status builtin_delay(virtual_machine* vm, Value* args, size_t argc, Value* out)
+{
+    if (args[0].type != VM_INT) {
+        *out = vString("Expected argument of type Int!");
+        return NATIVE_ERROR;
+    }
+
+    clock_t t1 = 1000 * clock() / CLOCKS_PER_SEC + args[0].value.to_int;
     while ((1000 * clock() / CLOCKS_PER_SEC) < t1);
-    return vNull();
+    return NATIVE_OK;
+}
+
+native_status builtin_popkey(virtual_machine* vm, Value* args, size_t argc, Value* out)
+{
+    if (args[0].type != VM_TABLE) {
+        *out = vString("First argument should be a Table!");
+        return NATIVE_ERROR;
+    }
+
+    *out = vTableRm(args[0].value.to_table, args[1]);
+    return NATIVE_OK;
+}
+
+// built-in functions, bound to a global only once the program names them
+builtin builtins[] = {
+    { "popkey", { .native = builtin_popkey, .argc = 2 } },
+    { "print",  { .native = builtin_print,  .variadic = true } },
+    { "input",  { .native = builtin_input,  .argc = 1 } },
+    { "int",    { .native = builtin_int,    .argc = 1 } },
+    { "str",    { .native = builtin_str,    .argc = 1 } },
+    { "float",  { .native = builtin_float,  .argc = 1 } },
+    { "bool",   { .native = builtin_bool,   .argc = 1 } },
+    { "len",    { .native = builtin_len,    .argc = 1 } },
+    { "sqrt",   { .native = builtin_sqrt,   .argc = 1 } },
+    { "pow",    { .native = builtin_pow,    .argc = 2 } },
+    { "time",   { .native = builtin_time,   .argc = 0 } },
+    { "delay",  { .native = builtin_delay,  .argc = 1 } },
+};
+
+builtin* builtin_find(symbol name)
+{
+    const char* s = symbol_name(name);
+
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtin); i++) {
+        if (streq(s, builtins[i].name)) return &builtins[i];
+    }
+
+    for (size_t i = 0; current_vm != NULL && i < current_vm->natives.size; i++)
+    {
+        builtin* b = vector_get(&current_vm->natives, i);
+        if (streq(s, b->name)) return b;
+    }
+    return NULL;
+}
+
+builtin* builtin_of(program* p)
+{
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtin); i++) {
+        if (&builtins[i].p == p) return &builtins[i];
+    }
+
+    for (size_t i = 0; current_vm != NULL && i < current_vm->natives.size; i++)
+    {
+        builtin* b = vector_get(&current_vm->natives, i);
+        if (&b->p == p) return b;
+    }
+    return NULL;
+}
+
+boolean register_native(virtual_machine* vm, const char* name, native_fn f, size_t argc, boolean variadic)
+{
+    virtual_machine* previous = current_vm;
+    current_vm = vm;
+    boolean taken = builtin_find(intern(name)) != NULL;
+    current_vm = previous;
+
+    if (taken) {
+        return false;
+    }
+
+    builtin* b = calloc(1, sizeof(builtin));
+    b->name = strdup(name);
+    b->p.native = f;
+    b->p.argc = argc;
+    b->p.variadic = variadic;
+    b->code.p = &b->p;
+
+    if (vm->natives.capacity == 0) {
+        vm->natives = vector_new(8);
+    }
+
+    vector_push(&vm->natives, b);
+    return true;
 }
 
-Value native_table_remove(Value v[])
+// Stores a built-in in its global if the program names it
+void bind_builtin(virtual_machine* vm, program* p, size_t from, builtin* b)
 {
-    if (v[0].type != VM_TABLE)
-        runtimeerr(current_vm, "First argument should be a Table!");
+    int address = idmap_get(&p->symbol_table, intern(b->name));
 
-    return vTableRm(v[0].value.to_table, v[1]);
+    if (address != -1 && (size_t) address >= from) {
+        b->code.p = &b->p;
+        vm->heap[address] = (Value) { .type = VM_PROGRAM, .value.to_code = &b->code };
+    }
 }
 
-void register_all_natives(program* p)
+void bind_builtins(virtual_machine* vm, program* p, size_t from)
 {
-    create_native(p, "popkey", native_table_remove, 2);
-    create_native(p, "print", native_print, 1);
-    create_native(p, "input", native_input, 1);
-    create_native(p, "int", native_int_cast, 1);
-    create_native(p, "str", native_str_cast, 1);
-    create_native(p, "float", native_float_cast, 1);
-    create_native(p, "bool", native_bool_cast, 1);
-    create_native(p, "len", native_length, 1);
-    create_native(p, "sqrt", native_sqrt, 1);
-    create_native(p, "pow", native_pow, 2);
-    create_native(p, "time", native_time, 0);
-    create_native(p, "delay", native_delay, 1);
-}
\ No newline at end of file
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtin); i++) {
+        bind_builtin(vm, p, from, &builtins[i]);
+    }
+
+    for (size_t i = 0; i < vm->natives.size; i++) {
+        bind_builtin(vm, p, from, vector_get(&vm->natives, i));
+    }
+}
@@ -5,14 +5,57 @@
 #include "compiler.h"
 #include "vm.h"
 
+// built-in function, with a native program allocated with the binary
+typedef struct builtin {
+    const char* name;
+    program p;
+    code_object code;
+} builtin;
+
+/**
+ * @brief Returns the built-in function of a name, among those of the
+ *      library and the natives registered with the current virtual
+ *      machine. Built-ins are called through the native_fn convention,
+ *      print with any number of arguments.
+ * 
+ * @param name Variable name
+ * @return Reference to built-in, or NULL if there is none of the name
+ */
+builtin* builtin_find(symbol name);
+
+/**
+ * @brief Returns the built-in function of a native program.
+ * 
+ * @param p Native program
+ * @return Reference to built-in, or NULL if p is not a built-in
+ */
+builtin* builtin_of(program* p);
+
 /**
- * @brief Registers all native, in-built methods to the specified
- *      program's local scope. These methods will be available in
- *      the local symbol table and can be called by child methods
+ * @brief Registers a native function with a virtual machine, named as a
+ *      built-in by the programs compiled and run on it.
  * 
- * @param p Program scope
+ * @param vm Reference to virtual machine
+ * @param name Name of the function
+ * @param f Native function
+ * @param argc Number of arguments, any number if variadic
+ * @param variadic Whether the function accepts any number of arguments
+ * @return False if the name is taken by another built-in
  */
-void register_all_natives(program* p);
+boolean register_native(virtual_machine* vm, const char* name, native_fn f, size_t argc, boolean variadic);
+
+/**
+ * @brief Stores the built-ins named by a compiled program in their global
+ *      variables. The compiler only registers globals for the built-ins
+ *      a program names, so no others are bound. Functions compiled on
+ *      their first call may name more, which are bound from the first
+ *      global registered since.
+ * 
+ * @param vm Reference to virtual machine, holding the global variables
+ * @param p Global program
+ * @param from Address of the first global to bind
+ */
+void bind_builtins(virtual_machine* vm, program* p, size_t from);
 
 /**
  * @brief Casts generic tagged value to int-tagged value.
@@ -46,4 +89,29 @@ Value native_bool_cast(Value v[]);
  */
 Value native_str_cast(Value v[]);
 
+/**
+ * @brief Returns the length of a string or table, or the number of
+ *      arguments of a function.
+ * 
+ * @param v Value
+ * @return Int value
+ */
+Value native_length(Value v[]);
+
+/**
+ * @brief Calculates the square root of a numeric value.
+ * 
+ * @param v Value
+ * @return Float value
+ */
+Value native_sqrt(Value v[]);
+
+/**
+ * @brief Raises the first numeric value to the power of the second.
+ * 
+ * @param v Values
+ * @return Numeric value
+ */
+Value native_pow(Value v[]);
+
 #endif
\ No newline at end of file
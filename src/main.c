@@ -1,88 +1,141 @@
 
 #include "he.h"
 
-virtual_machine* current_vm;
+// forward declarations
+program* compile_file(const char* fpath, boolean fuse);
+boolean compile_ahead(program* p);
 
 int main(int argc, const char* argv[])
 {
-    const char* src;
+    const char* fname = NULL;
+    const char* pairs_path = NULL;
+    const char* image_path = NULL;
+    boolean compile_only = false;
+    boolean use_cache = false;
     char fpath[256];
+    char cpath[260];
 
-    if (argc < 2) {
-        failure("File not specified!");
-    } else {
-        sprintf(fpath, "%s/%s", getcwd(fpath, sizeof(fpath)), argv[1]);
-        src = read_file(fpath);
+    for (int i = 1; i < argc; i++)
+    {
+        if (streq(argv[i], "--inline-budget") && i + 1 < argc) {
+            inline_budget = atoi(argv[++i]);
+        } else if (streq(argv[i], "--dump-opcode-pairs") && i + 1 < argc) {
+            pairs_path = argv[++i];
+        } else if (streq(argv[i], "--compile")) {
+            compile_only = true;
+        } else if (streq(argv[i], "-o") && i + 1 < argc) {
+            image_path = argv[++i];
+        } else if (streq(argv[i], "--cache")) {
+            use_cache = true;
+        } else if (streq(argv[i], "--tree-shake")) {
+            tree_shaking = true;
+        } else if (streq(argv[i], "--snapshot-after") && i + 1 < argc) {
+            snapshot_marker = argv[++i];
+        } else {
+            fname = argv[i];
+        }
     }
 
-#ifdef HE_DEBUG_MODE
-    printf("\n%s Reading code:\n\n%s\n", MESSAGE, src);
-
-    printf("%s Beginning lexical anaylsis:\n\n", MESSAGE);
-#endif
-
-    vector tokens = vector_new(64);
-    lexer lx = lexer_new(src, fpath);
-    lexify(&lx, &tokens);
-    
-#ifdef HE_DEBUG_MODE
-    for (size_t i = 0; i < tokens.size; i++) {
-        lxtoken_display(tokens.items[i]);
+    if (fname == NULL) {
+        failure("File not specified!");
+    } else {
+        sprintf(fpath, "%s/%s", getcwd(fpath, sizeof(fpath)), fname);
     }
 
-    printf("\n%s Beginning syntax parsing:\n\n", MESSAGE);
-#endif
-
-    parser p = {
-        .position = 0,
-        .source = src,
-        .tokens = tokens
+    virtual_machine vm = {
+        .ci = -1,
+        .call_stack = malloc(sizeof(call_info) * MAX_CALL_STACK),
+        .heap = calloc(MAX_HEAP_SIZE, sizeof(Value)),
+        .stack = calloc(MAX_STACK_SIZE, sizeof(Value)),
+        .region = malloc(MAX_REGION_SIZE),
+        .region_top = 0,
+        .pair_counts = pairs_path == NULL ? NULL : calloc(VM_BASE_OPS * VM_BASE_OPS, sizeof(size_t)),
+        .entry = 0,
     };
 
-    astnode* tree = parse(&p);
+    program* pp;
+    size_t n = strlen(fpath);
 
-#ifdef HE_DEBUG_MODE
-    printf("%s\n", astnode_tostr(tree));
-    
-    print_ast(tree, 0, 0, true);
+    if (snapshot_marker != NULL)
+    {
+        if (image_path == NULL) {
+            sprintf(cpath, "%ss", fname);
+            image_path = cpath;
+        }
+        snapshot_path = image_path;
+    }
 
-    printf("\n%s Beginning compilation:\n\n", MESSAGE);
-#endif
+    if (n > 4 && (streq(fpath + n - 4, ".hec") || streq(fpath + n - 4, ".hes")))
+    {
+        // superinstructions are fused before an image is written
+        if (pairs_path != NULL) {
+            failure("Cannot profile operation pairs of a bytecode image!");
+        } else if (snapshot_marker != NULL) {
+            failure("Cannot take a heap snapshot of a bytecode image!");
+        }
+
+        if (fpath[n - 1] == 'c') {
+            pp = image_load(fpath, false);
+        } else {
+            // resumes the global program from where the snapshot was taken
+            pp = image_load_snapshot(fpath, vm.heap, &vm.entry);
+        }
+
+        if (pp == NULL) {
+            file_error("Bytecode image is invalid or was built by another interpreter version", fpath);
+        }
+    }
+    else if (use_cache && !compile_only && pairs_path == NULL && snapshot_marker == NULL)
+    {
+        // cached image is kept next to the source and rebuilt when stale
+        sprintf(cpath, "%sc", fpath);
+        pp = image_load(cpath, true);
+
+        if (pp == NULL) {
+            pp = compile_file(fpath, true);
+
+            // errors in functions never called must not end the program,
+            // which is then compiled again and run without caching
+            if (compile_ahead(pp)) {
+                image_write(pp, cpath);
+            } else {
+                pp = compile_file(fpath, true);
+            }
+        }
+    }
+    else
+    {
+        // profiles the unfused operations to choose superinstructions
+        pp = compile_file(fpath, pairs_path == NULL);
+    }
 
-    program pp = {
-        .code = malloc(sizeof(instruction) * MAX_LOCAL_VARIABLES),
-        .length = 0,
-        .argc = 0,
-        .constants = malloc(sizeof(Value) * MAX_LOCAL_CONSTANTS),
-        .prev = NULL,
-
-        .constant_table = map_new(37),
-        .symbol_table = map_new(37),
-        .closure_table = map_new(37),
-        .line_address_table = map_new(37),
-    };
-    
-    register_all_natives(&pp);
-    compile(&pp, tree);
+    if (compile_only && snapshot_marker == NULL)
+    {
+        if (image_path == NULL) {
+            sprintf(cpath, "%sc", fname);
+            image_path = cpath;
+        }
+
+        if (!image_write(pp, image_path)) {
+            file_error("Failed to write bytecode image", image_path);
+        }
+        return 0;
+    }
 
 #ifdef HE_DEBUG_MODE
-    printf(disassemble_program(&pp));
-    
     printf("\n%s Beginning bytecode execution:\n\n", MESSAGE);
     
     clock_t begin = clock();
 #endif
 
-    virtual_machine vm = {
-        .ci = -1,
-        .call_stack = malloc(sizeof(call_info) * MAX_CALL_STACK),
-        .heap = calloc(MAX_HEAP_SIZE, sizeof(Value)),
-        .stack = calloc(MAX_STACK_SIZE, sizeof(Value)),
-    };
-
     current_vm = &vm;
+    bind_builtins(&vm, pp, 0);
 
-    run_program(&vm, NULL, vCode(&pp, NULL).value.to_code);
+    run_program(&vm, NULL, vCode(pp, NULL).value.to_code);
+
+    if (pairs_path != NULL) {
+        dump_opcode_pairs(pairs_path, vm.pair_counts);
+    }
 
 #ifdef HE_DEBUG_MODE
     clock_t end = clock();
@@ -103,4 +156,26 @@ int main(int argc, const char* argv[])
     printf("\n%s Program has ended successfully!\n\n", MESSAGE);
 #endif
     return 0;
-}
\ No newline at end of file
+}
+
+program* compile_file(const char* fpath, boolean fuse)
+{
+    const char* src = read_file(fpath);
+    vector tokens = vector_new(64);
+    return compile_script(fpath, src, &tokens, fuse);
+}
+
+// Compiles every deferred function of a program to be written as an
+// image, returns false if one of them has a compile error
+boolean compile_ahead(program* p)
+{
+    error_trap trap = { .raised = false };
+    current_trap = &trap;
+
+    if (setjmp(trap.env) == 0) {
+        compile_all(p);
+    }
+
+    current_trap = NULL;
+    return !trap.raised;
+}
@@ -0,0 +1,993 @@
+#include "optimiser.h"
+
+// what a loop may change on each iteration, deciding which of its
+// expressions are invariant
+struct licm_context {
+    idmap* assigned;
+    idmap* params;
+    idmap writes;
+    boolean clobbers;
+    boolean puts;
+    astnode* preheader;
+};
+
+// globals and field names read by the reachable code of a program
+struct shake_context {
+    idmap referenced;
+    idmap fields;
+    boolean dynamic;
+};
+
+// forward declarations
+void collect_assigned(astnode* node, idmap* assigned);
+boolean has_registrations(astnode* node);
+boolean fold_unary(astnode* node);
+boolean fold_binary(astnode* node);
+boolean fold_native_call(astnode* node, idmap* assigned);
+void literal_from_value(astnode* node, Value v);
+void splice_block(astnode* block, size_t index, astnode* body);
+void hoist_loop(astnode* loop, idmap* assigned, idmap* params);
+boolean hoist_statement(struct licm_context* c, astnode* st);
+void hoist_expression(struct licm_context* c, astnode** slot);
+boolean is_invariant(struct licm_context* c, astnode* node);
+void collect_effects(struct licm_context* c, astnode* node);
+boolean is_pure_call(astnode* node, idmap* assigned);
+boolean is_inert_call(astnode* node, idmap* assigned);
+boolean has_side_effects(astnode* node, idmap* assigned);
+astnode* copy_tree(astnode* node);
+boolean is_definition(astnode* st);
+boolean is_inert_value(astnode* node);
+boolean definition_reachable(struct shake_context* c, astnode* st);
+void mark_live(struct shake_context* c, astnode* node);
+
+#define ISNUMERIC(t) (t == VM_INT || t == VM_FLOAT || t == VM_BOOL)
+
+// built-in methods without side effects which can be evaluated at
+// compile time when their arguments are constant
+struct pure_native {
+    const char* name;
+    Value (*f)(Value[]);
+    size_t argc;
+    boolean numeric;
+} pure_natives[] = {
+    { "sqrt",   native_sqrt,        1, true  },
+    { "pow",    native_pow,         2, true  },
+    { "int",    native_int_cast,    1, false },
+    { "float",  native_float_cast,  1, false },
+    { "bool",   native_bool_cast,   1, false },
+    { "str",    native_str_cast,    1, false },
+    { "len",    native_length,      1, false },
+};
+
+// built-in methods which do not modify variables or tables
+const char* inert_natives[] = { "print", "input", "time", "delay" };
+
+// counter naming the hidden variables holding hoisted values
+size_t hoisted_count = 0;
+
+// whether unreachable global definitions are removed before compiling
+boolean tree_shaking = false;
+
+void optimise(astnode* tree)
+{
+    idmap assigned = idmap_new(64);
+
+    idmap params = idmap_new(8);
+
+    // names of hoisted values only need to be unique within a program
+    hoisted_count = 0;
+
+    collect_assigned(tree, &assigned);
+    fold_block(tree, &assigned);
+    hoist_invariants(tree, &assigned, &params);
+
+    idmap_delete(&assigned);
+    idmap_delete(&params);
+}
+
+void fold_block(astnode* block, idmap* assigned)
+{
+    for (size_t i = 0; i < block->children.size; i++)
+    {
+        astnode* st = vector_get(&block->children, i);
+        astnode* cond;
+        astnode* alt;
+
+        switch (st->type)
+        {
+            case AST_ASSIGN:
+            case AST_RETURN:
+                fold_expression(vector_get(&st->children, 0), assigned);
+                break;
+
+            case AST_PUT:
+                fold_expression(vector_get(&st->children, 0), assigned);
+                fold_expression(vector_get(&st->children, 1), assigned);
+                break;
+
+            case AST_CALL:
+                // call statements must remain calls, only operands are folded
+                for (size_t j = 0; j < st->children.size; j++) {
+                    fold_expression(vector_get(&st->children, j), assigned);
+                }
+                break;
+
+            case AST_LOOP:
+                cond = vector_get(&st->children, 0);
+                fold_block(vector_get(&st->children, 1), assigned);
+
+                if (fold_expression(cond, assigned) && !native_bool_cast((Value[]) { value_from_node(cond) }).value.to_bool
+                        && !has_registrations(st)) {
+                    vector_rm(&block->children, i--);
+                }
+                break;
+
+            case AST_RANGE_LOOP:
+                fold_expression(vector_get(&((astnode*) vector_get(&st->children, 0))->children, 0), assigned);
+                fold_expression(vector_get(&st->children, 1), assigned);
+                fold_expression(vector_get(&st->children, 2), assigned);
+                fold_block(vector_get(&st->children, 3), assigned);
+                break;
+
+            case AST_EACH_LOOP:
+                fold_expression(vector_get(&st->children, 0), assigned);
+                fold_block(vector_get(&st->children, 1), assigned);
+                break;
+
+            case AST_BRANCHES:
+                fold_branches(st, assigned);
+
+                cond = vector_get(&st->children, 0);
+                alt = vector_get(&st->children, 2);
+
+                if (!is_literal(cond)) {
+                    break;
+                }
+
+                if (native_bool_cast((Value[]) { value_from_node(cond) }).value.to_bool)
+                {
+                    // condition always met, alternative branches are dead
+                    if (alt == NULL || !has_registrations(alt)) {
+                        splice_block(block, i--, vector_get(&st->children, 1));
+                    }
+                }
+                else if (!has_registrations(vector_get(&st->children, 1)))
+                {
+                    // condition never met, body is dead
+                    if (alt == NULL) {
+                        vector_rm(&block->children, i--);
+                    } else if (streq(alt->value, "alt")) {
+                        splice_block(block, i--, vector_get(&alt->children, 0));
+                    } else {
+                        vector_set(&block->children, i--, alt);
+                    }
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+}
+
+void fold_branches(astnode* branches, idmap* assigned)
+{
+    fold_expression(vector_get(&branches->children, 0), assigned);
+    fold_block(vector_get(&branches->children, 1), assigned);
+
+    astnode* alt = vector_get(&branches->children, 2);
+
+    if (alt == NULL) {
+        return;
+    } else if (streq(alt->value, "alt")) {
+        fold_block(vector_get(&alt->children, 0), assigned);
+        return;
+    }
+
+    fold_branches(alt, assigned);
+
+    astnode* cond = vector_get(&alt->children, 0);
+    astnode* next = vector_get(&alt->children, 2);
+
+    if (!is_literal(cond)) {
+        return;
+    }
+
+    if (native_bool_cast((Value[]) { value_from_node(cond) }).value.to_bool)
+    {
+        // else-if always met becomes the final else branch
+        if (next == NULL || !has_registrations(next)) {
+            alt->value = "alt";
+            vector_rm(&alt->children, 0);
+            alt->children.size = 1;
+        }
+    }
+    else if (!has_registrations(vector_get(&alt->children, 1)))
+    {
+        // else-if never met is unlinked from the chain
+        if (next == NULL) {
+            vector_rm(&branches->children, 2);
+        } else {
+            vector_set(&branches->children, 2, next);
+        }
+    }
+}
+
+boolean fold_expression(astnode* node, idmap* assigned)
+{
+    switch (node->type)
+    {
+        case AST_INTEGER:
+        case AST_FLOAT:
+        case AST_STRING:
+        case AST_BOOL:
+        case AST_NULL:
+            return true;
+
+        case AST_UNARY_EXPRESSION:
+            fold_expression(vector_get(&node->children, 0), assigned);
+            return fold_unary(node);
+
+        case AST_BINARY_EXPRESSION:
+            fold_expression(vector_get(&node->children, 0), assigned);
+            fold_expression(vector_get(&node->children, 1), assigned);
+            return fold_binary(node);
+
+        case AST_CALL:
+            for (size_t i = 0; i < node->children.size; i++) {
+                fold_expression(vector_get(&node->children, i), assigned);
+            }
+            return fold_native_call(node, assigned);
+
+        case AST_FUNCTION:
+            fold_block(vector_get(&node->children, 1), assigned);
+            return false;
+
+        case AST_TABLE:
+            for (size_t i = 0; i < node->children.size; i++) {
+                astnode* pair = vector_get(&node->children, i);
+                fold_expression(vector_get(&pair->children, 0), assigned);
+                fold_expression(vector_get(&pair->children, 1), assigned);
+            }
+            return false;
+
+        default:
+            return false;
+    }
+}
+
+boolean is_literal(astnode* node)
+{
+    switch (node->type)
+    {
+        case AST_INTEGER:
+        case AST_FLOAT:
+        case AST_STRING:
+        case AST_BOOL:
+        case AST_NULL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// ------------------ FOLDING ------------------
+
+boolean fold_unary(astnode* node)
+{
+    astnode* operand = vector_get(&node->children, 0);
+
+    // unary plus compiles to no operation
+    if (streq(node->value, "+")) {
+        *node = *operand;
+        return is_literal(node);
+    }
+
+    if (!is_literal(operand)) {
+        return false;
+    }
+
+    Value v = value_from_node(operand);
+
+    if (streq(node->value, "-") && ISNUMERIC(v.type)) {
+        literal_from_value(node, vNegate(v));
+    } else if (streq(node->value, "!")) {
+        literal_from_value(node, vBool(!native_bool_cast(&v).value.to_bool));
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+boolean fold_binary(astnode* node)
+{
+    astnode* lhs = vector_get(&node->children, 0);
+    astnode* rhs = vector_get(&node->children, 1);
+
+    // right operand is never evaluated once the left decides the result
+    if (is_literal(lhs) && (streq(node->value, "&&") || streq(node->value, "||")))
+    {
+        boolean left = native_bool_cast((Value[]) { value_from_node(lhs) }).value.to_bool;
+        boolean disjunction = streq(node->value, "||");
+
+        if (left == disjunction) {
+            literal_from_value(node, vBool(left));
+            return true;
+        }
+    }
+
+    if (!is_literal(lhs) || !is_literal(rhs)) {
+        return false;
+    }
+
+    const char* op = node->value;
+    Value a = value_from_node(lhs);
+    Value b = value_from_node(rhs);
+    Value r;
+
+    boolean numeric = ISNUMERIC(a.type) && ISNUMERIC(b.type);
+
+    // mirrors zero checks of vDiv and vMod so errors are left to runtime
+    boolean zero = (b.type == VM_INT && b.value.to_int == 0) || b.value.to_float == 0.0;
+
+    if (streq(op, "+") && (numeric || (TYPEPAIR(a.type, b.type)) == (TYPEMATCH(VM_STRING))))
+        r = vAdd(a, b);
+    else if (streq(op, "-") && numeric)
+        r = vSub(a, b);
+    else if (streq(op, "*") && numeric)
+        r = vMul(a, b);
+    else if (streq(op, "/") && numeric && b.type != VM_BOOL && !zero)
+        r = vDiv(a, b);
+    else if (streq(op, "%") && (a.type == VM_INT || a.type == VM_BOOL) && b.type == VM_INT && b.value.to_int != 0)
+        r = vMod(a, b);
+    else if (streq(op, "%") && a.type == VM_STRING && b.type == VM_INT
+            && 0 <= b.value.to_int && b.value.to_int < strlen(a.value.to_str))
+        r = vMod(a, b);
+    else if (streq(op, "=="))
+        r = vEqual(a, b);
+    else if (streq(op, "!="))
+        r = vNotEqual(a, b);
+    else if (streq(op, "<") && numeric)
+        r = vLess(a, b);
+    else if (streq(op, "<=") && numeric)
+        r = vLessEqual(a, b);
+    else if (streq(op, ">") && numeric)
+        r = vLess(b, a);
+    else if (streq(op, ">=") && numeric)
+        r = vLessEqual(b, a);
+    else if (streq(op, "&&"))
+        r = vBool(native_bool_cast(&a).value.to_bool && native_bool_cast(&b).value.to_bool);
+    else if (streq(op, "||"))
+        r = vBool(native_bool_cast(&a).value.to_bool || native_bool_cast(&b).value.to_bool);
+    else
+        return false;
+
+    literal_from_value(node, r);
+    return true;
+}
+
+boolean fold_native_call(astnode* node, idmap* assigned)
+{
+    astnode* callee = vector_get(&node->children, 0);
+
+    // built-in may have been rebound by the program
+    if (callee->type != AST_REFERENCE || idmap_has(assigned, callee->sym)) {
+        return false;
+    }
+
+    for (size_t i = 0; i < sizeof(pure_natives) / sizeof(struct pure_native); i++)
+    {
+        struct pure_native* n = &pure_natives[i];
+
+        if (!streq(callee->value, n->name) || node->children.size - 1 != n->argc) {
+            continue;
+        }
+
+        Value args[2];
+
+        for (size_t j = 0; j < n->argc; j++)
+        {
+            astnode* arg = vector_get(&node->children, j + 1);
+
+            if (!is_literal(arg)) {
+                return false;
+            }
+
+            args[j] = value_from_node(arg);
+
+            if (n->numeric && args[j].type != VM_INT && args[j].type != VM_FLOAT) {
+                return false;
+            }
+        }
+
+        literal_from_value(node, n->f(args));
+        return true;
+    }
+
+    return false;
+}
+
+// ------------------ LOOP INVARIANTS ------------------
+
+void hoist_invariants(astnode* node, idmap* assigned, idmap* params)
+{
+    if (node == NULL) {
+        return;
+    }
+
+    if (node->type == AST_FUNCTION)
+    {
+        astnode* ps = vector_get(&node->children, 0);
+        idmap inner = idmap_new(8);
+
+        for (size_t i = 0; i < ps->children.size; i++) {
+            idmap_put(&inner, ((astnode*) vector_get(&ps->children, i))->sym);
+        }
+
+        hoist_invariants(vector_get(&node->children, 1), assigned, &inner);
+        idmap_delete(&inner);
+        return;
+    }
+
+    // inner loops first so their preheaders can be hoisted further out
+    for (size_t i = 0; i < node->children.size; i++) {
+        hoist_invariants(vector_get(&node->children, i), assigned, params);
+    }
+
+    if (node->type == AST_LOOP) {
+        hoist_loop(node, assigned, params);
+    }
+}
+
+void hoist_loop(astnode* loop, idmap* assigned, idmap* params)
+{
+    astnode* cond = vector_get(&loop->children, 0);
+    astnode* body = vector_get(&loop->children, 1);
+
+    // condition is evaluated before any preheader, so it must not be
+    // observable when evaluated twice
+    if (has_side_effects(cond, assigned)) {
+        return;
+    }
+
+    struct licm_context c = {
+        .assigned = assigned,
+        .params = params,
+        .writes = idmap_new(16),
+        .clobbers = false,
+        .puts = false,
+        .preheader = astnode_new("block", AST_BLOCK, loop->pos),
+    };
+
+    collect_effects(&c, loop);
+
+    astnode* guard = copy_tree(cond);
+    hoist_expression(&c, (astnode**) &loop->children.items[0]);
+
+    size_t from_condition = c.preheader->children.size;
+
+    // body statements run on every iteration up to the first one with
+    // side effects, hoisting beyond would reorder observable behaviour
+    for (size_t i = 0; i < body->children.size; i++) {
+        if (!hoist_statement(&c, vector_get(&body->children, i))) break;
+    }
+
+    if (c.preheader->children.size > 0) {
+        vector_push(&loop->children, c.preheader);
+    }
+
+    // values hoisted out of the body are only computed if the loop is entered
+    if (c.preheader->children.size > from_condition) {
+        vector_push(&loop->children, guard);
+    }
+
+    idmap_delete(&c.writes);
+}
+
+// Hoists from a top level statement of a loop body, returning false if
+// statements after it cannot be hoisted from
+boolean hoist_statement(struct licm_context* c, astnode* st)
+{
+    astnode* call = NULL;
+
+    switch (st->type)
+    {
+        case AST_ASSIGN:
+            if (!has_side_effects(st, c->assigned)) {
+                hoist_expression(c, (astnode**) &st->children.items[0]);
+                return true;
+            }
+            call = vector_get(&st->children, 0);
+            break;
+
+        case AST_PUT:
+            if (!has_side_effects(st, c->assigned)) {
+                // table and key of the target, which must stay an index
+                astnode* target = vector_get(&st->children, 0);
+                hoist_expression(c, (astnode**) &target->children.items[0]);
+                hoist_expression(c, (astnode**) &target->children.items[1]);
+                hoist_expression(c, (astnode**) &st->children.items[1]);
+                return true;
+            }
+            break;
+
+        case AST_CALL:
+            call = st;
+            break;
+
+        case AST_BRANCHES:
+            if (!has_side_effects(st, c->assigned)) {
+                hoist_expression(c, (astnode**) &st->children.items[0]);
+                return true;
+            }
+            hoist_expression(c, (astnode**) &st->children.items[0]);
+            return false;
+
+        case AST_LOOP:
+            // unguarded preheaders always run once the statement is reached
+            if (st->children.size == 3 && !has_side_effects(vector_get(&st->children, 0), c->assigned))
+            {
+                astnode* pre = vector_get(&st->children, 2);
+
+                for (size_t i = 0; i < pre->children.size; i++) {
+                    astnode* assign = vector_get(&pre->children, i);
+                    hoist_expression(c, (astnode**) &assign->children.items[0]);
+                }
+            }
+            return false;
+
+        default:
+            return false;
+    }
+
+    // arguments are evaluated before the call itself takes effect
+    if (call == NULL || call->type != AST_CALL) {
+        return false;
+    }
+
+    for (size_t i = 1; i < call->children.size; i++) {
+        if (has_side_effects(vector_get(&call->children, i), c->assigned)) return false;
+    }
+
+    for (size_t i = 1; i < call->children.size; i++) {
+        hoist_expression(c, (astnode**) &call->children.items[i]);
+    }
+    return false;
+}
+
+// Replaces the largest invariant sub-expressions with hidden variables
+// assigned in the preheader
+void hoist_expression(struct licm_context* c, astnode** slot)
+{
+    astnode* e = *slot;
+
+    if (is_invariant(c, e))
+    {
+        // literals and single loads cost no more than loading the copy
+        if (e->type != AST_BINARY_EXPRESSION && e->type != AST_UNARY_EXPRESSION && e->type != AST_CALL) {
+            return;
+        }
+
+        char buf[32];
+        sprintf(buf, "$licm%lu", hoisted_count++);
+        symbol sym = intern(buf);
+        const char* name = symbol_name(sym);
+
+        astnode* assign = astnode_new(name, AST_ASSIGN, e->pos);
+        assign->sym = sym;
+        vector_push(&assign->children, e);
+        vector_push(&c->preheader->children, assign);
+
+        astnode* ref = astnode_new(name, AST_REFERENCE, e->pos);
+        ref->sym = assign->sym;
+        *slot = ref;
+        return;
+    }
+
+    switch (e->type)
+    {
+        case AST_BINARY_EXPRESSION:
+            // right operands of && and || are evaluated conditionally
+            if (streq(e->value, "&&") || streq(e->value, "||")) {
+                hoist_expression(c, (astnode**) &e->children.items[0]);
+                break;
+            }
+
+        case AST_UNARY_EXPRESSION:
+            for (size_t i = 0; i < e->children.size; i++) {
+                hoist_expression(c, (astnode**) &e->children.items[i]);
+            }
+            break;
+
+        case AST_CALL:
+            for (size_t i = 1; i < e->children.size; i++) {
+                hoist_expression(c, (astnode**) &e->children.items[i]);
+            }
+            break;
+
+        case AST_TABLE:
+            for (size_t i = 0; i < e->children.size; i++) {
+                astnode* pair = vector_get(&e->children, i);
+                hoist_expression(c, (astnode**) &pair->children.items[0]);
+                hoist_expression(c, (astnode**) &pair->children.items[1]);
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+boolean is_invariant(struct licm_context* c, astnode* node)
+{
+    switch (node->type)
+    {
+        case AST_INTEGER:
+        case AST_FLOAT:
+        case AST_STRING:
+        case AST_BOOL:
+        case AST_NULL:
+            return true;
+
+        case AST_REFERENCE:
+            // parameters are locals which no call can reassign
+            return !idmap_has(&c->writes, node->sym) && (!c->clobbers || idmap_has(c->params, node->sym));
+
+        case AST_UNARY_EXPRESSION:
+            return is_invariant(c, vector_get(&node->children, 0));
+
+        case AST_BINARY_EXPRESSION:
+            // indexing reads table contents
+            if ((streq(node->value, "[]") || streq(node->value, "%")) && (c->puts || c->clobbers)) {
+                return false;
+            }
+            return is_invariant(c, vector_get(&node->children, 0)) && is_invariant(c, vector_get(&node->children, 1));
+
+        case AST_CALL:
+            if (!is_pure_call(node, c->assigned) || c->puts || c->clobbers) {
+                return false;
+            }
+
+            for (size_t i = 1; i < node->children.size; i++) {
+                if (!is_invariant(c, vector_get(&node->children, i))) return false;
+            }
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+// Collects variables assigned within a loop and whether it writes to
+// tables or makes calls which may change globals or tables
+void collect_effects(struct licm_context* c, astnode* node)
+{
+    // function bodies only take effect when called
+    if (node == NULL || node->type == AST_FUNCTION) {
+        return;
+    }
+
+    if (node->type == AST_ASSIGN) {
+        idmap_put(&c->writes, node->sym);
+    } else if (node->type == AST_PUT) {
+        c->puts = true;
+    } else if (node->type == AST_INCLUDE || (node->type == AST_CALL && !is_inert_call(node, c->assigned))) {
+        c->clobbers = true;
+    }
+
+    for (size_t i = 0; i < node->children.size; i++) {
+        collect_effects(c, vector_get(&node->children, i));
+    }
+}
+
+// Returns true for calls to built-ins without side effects which have not
+// been rebound by the program
+boolean is_pure_call(astnode* node, idmap* assigned)
+{
+    astnode* callee = vector_get(&node->children, 0);
+
+    if (callee->type != AST_REFERENCE || idmap_has(assigned, callee->sym)) {
+        return false;
+    }
+
+    for (size_t i = 0; i < sizeof(pure_natives) / sizeof(struct pure_native); i++) {
+        if (streq(callee->value, pure_natives[i].name) && node->children.size - 1 == pure_natives[i].argc) return true;
+    }
+    return false;
+}
+
+// Returns true for calls which cannot change variables or tables
+boolean is_inert_call(astnode* node, idmap* assigned)
+{
+    astnode* callee = vector_get(&node->children, 0);
+
+    if (is_pure_call(node, assigned)) {
+        return true;
+    } else if (callee->type != AST_REFERENCE || idmap_has(assigned, callee->sym)) {
+        return false;
+    }
+
+    for (size_t i = 0; i < sizeof(inert_natives) / sizeof(const char*); i++) {
+        if (streq(callee->value, inert_natives[i])) return true;
+    }
+    return false;
+}
+
+// Returns true if evaluating the node may have observable effects other
+// than assignments, or leave the enclosing function
+boolean has_side_effects(astnode* node, idmap* assigned)
+{
+    if (node == NULL || node->type == AST_FUNCTION) {
+        return false;
+    } else if (node->type == AST_RETURN || node->type == AST_INCLUDE || node->type == AST_PUT) {
+        return true;
+    } else if (node->type == AST_CALL && !is_pure_call(node, assigned)) {
+        return true;
+    }
+
+    for (size_t i = 0; i < node->children.size; i++) {
+        if (has_side_effects(vector_get(&node->children, i), assigned)) return true;
+    }
+    return false;
+}
+
+// ------------------ TREE SHAKING ------------------
+
+void shake_tree(astnode* tree)
+{
+    struct shake_context c = {
+        .referenced = idmap_new(64),
+        .fields = idmap_new(64),
+        .dynamic = false,
+    };
+
+    size_t n = tree->children.size;
+    boolean* live = calloc(n + 1, sizeof(boolean));
+
+    // statements with effects of their own always run
+    for (size_t i = 0; i < n; i++)
+    {
+        astnode* st = vector_get(&tree->children, i);
+
+        if (!is_definition(st)) {
+            live[i] = true;
+            mark_live(&c, st);
+        }
+    }
+
+    // a definition reached by live code may reach further definitions
+    boolean changed = true;
+
+    while (changed)
+    {
+        changed = false;
+
+        for (size_t i = 0; i < n; i++)
+        {
+            astnode* st = vector_get(&tree->children, i);
+
+            if (!live[i] && definition_reachable(&c, st)) {
+                live[i] = true;
+                changed = true;
+                mark_live(&c, vector_top(&st->children));
+            }
+        }
+    }
+
+    size_t kept = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        if (live[i]) tree->children.items[kept++] = tree->children.items[i];
+    }
+
+    tree->children.size = kept;
+    free(live);
+    idmap_delete(&c.referenced);
+    idmap_delete(&c.fields);
+}
+
+// Returns true for global statements whose only effect is to bind a
+// variable, name = value, or a named field, table.name = value, to a
+// value which can be created without running any code
+boolean is_definition(astnode* st)
+{
+    if (st->type == AST_ASSIGN) {
+        return is_inert_value(vector_get(&st->children, 0));
+    } else if (st->type != AST_PUT || !streq(st->value, "put")) {
+        return false;
+    }
+
+    astnode* target = vector_get(&st->children, 0);
+
+    if (target->type != AST_BINARY_EXPRESSION || !streq(target->value, "[]")) {
+        return false;
+    }
+
+    astnode* table = vector_get(&target->children, 0);
+    astnode* key = vector_get(&target->children, 1);
+
+    return table->type == AST_REFERENCE && key->type == AST_STRING && is_inert_value(vector_get(&st->children, 1));
+}
+
+// Returns true for literals, functions and tables built from them
+boolean is_inert_value(astnode* node)
+{
+    if (is_literal(node) || node->type == AST_FUNCTION) {
+        return true;
+    } else if (node->type != AST_TABLE) {
+        return false;
+    }
+
+    for (size_t i = 0; i < node->children.size; i++)
+    {
+        astnode* pair = vector_get(&node->children, i);
+
+        if (!is_inert_value(vector_get(&pair->children, 0)) || !is_inert_value(vector_get(&pair->children, 1))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Variables are reachable once read, fields once their table is read and
+// their name appears as a string, or any key may be computed at runtime
+boolean definition_reachable(struct shake_context* c, astnode* st)
+{
+    if (st->type == AST_ASSIGN) {
+        return idmap_has(&c->referenced, st->sym);
+    }
+
+    astnode* target = vector_get(&st->children, 0);
+    astnode* table = vector_get(&target->children, 0);
+    astnode* key = vector_get(&target->children, 1);
+
+    return idmap_has(&c->referenced, table->sym) && (c->dynamic || idmap_has(&c->fields, intern(key->value)));
+}
+
+// Collects the variables and field names read by reachable code, local
+// variables sharing the name of a global keep the global alive as well.
+// Any key may be read once a table is indexed by a computed key, by
+// position with %, iterated over or measured by len.
+void mark_live(struct shake_context* c, astnode* node)
+{
+    astnode* callee;
+
+    switch (node->type)
+    {
+        case AST_REFERENCE:
+            idmap_put(&c->referenced, node->sym);
+            break;
+
+        case AST_STRING:
+            idmap_put(&c->fields, intern(node->value));
+            break;
+
+        case AST_EACH_LOOP:
+            c->dynamic = true;
+            break;
+
+        // fields are also seen by index through % and counted by len
+        case AST_BINARY_EXPRESSION:
+            if (streq(node->value, "[]") && ((astnode*) vector_get(&node->children, 1))->type != AST_STRING) {
+                c->dynamic = true;
+            } else if (streq(node->value, "%")) {
+                c->dynamic = true;
+            }
+            break;
+
+        case AST_CALL:
+            callee = vector_get(&node->children, 0);
+
+            if (callee->type == AST_REFERENCE && streq(callee->value, "len")) {
+                c->dynamic = true;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    for (size_t i = 0; i < node->children.size; i++) {
+        mark_live(c, vector_get(&node->children, i));
+    }
+}
+
+// ------------------ UTILITY METHODS ------------------
+
+// Collects every symbol that is assigned or bound as a parameter
+void collect_assigned(astnode* node, idmap* assigned)
+{
+    if (node->type == AST_ASSIGN || node->type == AST_PARAM) {
+        idmap_put(assigned, node->sym);
+    }
+
+    for (size_t i = 0; i < node->children.size; i++) {
+        collect_assigned(vector_get(&node->children, i), assigned);
+    }
+}
+
+// Returns true if compiling the node would register variables in
+// the current scope, in which case it cannot be dropped even if dead
+boolean has_registrations(astnode* node)
+{
+    if (node->type == AST_ASSIGN || node->type == AST_INCLUDE) {
+        return true;
+    } else if (node->type == AST_FUNCTION) {
+        return false;
+    }
+
+    for (size_t i = 0; i < node->children.size; i++) {
+        if (has_registrations(vector_get(&node->children, i))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Overwrites node with a literal node holding the value
+void literal_from_value(astnode* node, Value v)
+{
+    char* buf = malloc(sizeof(char) * 32);
+    node->children.size = 0;
+
+    switch (v.type)
+    {
+        case VM_INT:
+            sprintf(buf, "%li", v.value.to_int);
+            node->type = AST_INTEGER;
+            node->value = buf;
+            break;
+
+        case VM_FLOAT:
+            // round trips through atof without losing precision
+            sprintf(buf, "%.17g", v.value.to_float);
+            node->type = AST_FLOAT;
+            node->value = buf;
+            break;
+
+        case VM_BOOL:
+            free(buf);
+            node->type = AST_BOOL;
+            node->value = v.value.to_bool ? "true" : "false";
+            break;
+
+        case VM_STRING:
+            free(buf);
+            node->type = AST_STRING;
+            node->value = v.value.to_str;
+            break;
+
+        default:
+            free(buf);
+            node->type = AST_NULL;
+            node->value = "null";
+            break;
+    }
+}
+
+// Replaces statement at index of block with the statements of body
+void splice_block(astnode* block, size_t index, astnode* body)
+{
+    vector_rm(&block->children, index);
+
+    for (size_t i = 0; i < body->children.size; i++) {
+        vector_insert(&block->children, index + i, vector_get(&body->children, i));
+    }
+}
+
+// Returns a deep copy of a syntax tree
+astnode* copy_tree(astnode* node)
+{
+    if (node == NULL) {
+        return NULL;
+    }
+
+    astnode* copy = astnode_new(node->value, node->type, node->pos);
+    copy->sym = node->sym;
+
+    for (size_t i = 0; i < node->children.size; i++) {
+        vector_push(&copy->children, copy_tree(vector_get(&node->children, i)));
+    }
+    return copy;
+}
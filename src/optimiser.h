@@ -0,0 +1,90 @@
+#ifndef HE_OPTIMISER_HEADER
+#define HE_OPTIMISER_HEADER
+
+#include "common.h"
+#include "datatypes.h"
+#include "parser.h"
+#include "value.h"
+#include "lib.h"
+
+// Whether unreachable global definitions are removed before compiling
+extern boolean tree_shaking;
+
+/**
+ * @brief Removes global definitions which the program can never reach.
+ *      Statements binding a global variable, or a field of a global table
+ *      named by a string, to a literal, function or table of these are
+ *      kept only if reachable from the other global statements through
+ *      variable references, and for fields also string constants naming
+ *      them. Every field is kept once a table is indexed by a computed
+ *      key or iterated over. Includes should be expanded beforehand so
+ *      that the definitions of every file are visible.
+ * 
+ * @param tree Global statement block
+ */
+void shake_tree(astnode* tree);
+
+/**
+ * @brief Runs the syntax tree optimisation passes over the global
+ *      program block. Constant expressions and pure built-in calls are
+ *      folded, and branches and loops with constant conditions are
+ *      pruned. Includes should be expanded beforehand so that every
+ *      assignment in the program is visible.
+ * 
+ * @param tree Global statement block
+ */
+void optimise(astnode* tree);
+
+/**
+ * @brief Folds the constant sub-expressions of a block of statements
+ *      in place and removes statements that can never run.
+ * 
+ * @param block Statement block node
+ * @param assigned Symbols assigned anywhere in the program
+ */
+void fold_block(astnode* block, idmap* assigned);
+
+/**
+ * @brief Folds the conditions and bodies of an if-else_if-else chain and
+ *      unlinks else-if branches whose conditions are constant.
+ * 
+ * @param branches Branching node
+ * @param assigned Symbols assigned anywhere in the program
+ */
+void fold_branches(astnode* branches, idmap* assigned);
+
+/**
+ * @brief Folds the constant sub-expressions of an expression node in
+ *      place. Operations are evaluated with the same semantics as the
+ *      virtual machine and are skipped where they would raise a runtime
+ *      error.
+ * 
+ * @param node Expression node
+ * @param assigned Symbols assigned anywhere in the program
+ * @return True if node has been reduced to a literal
+ */
+boolean fold_expression(astnode* node, idmap* assigned);
+
+/**
+ * @brief Hoists loop-invariant expressions out of every loop in a tree
+ *      into hidden variables assigned by a preheader block, appended to
+ *      the loop node and compiled ahead of the loop. Values hoisted from
+ *      the body are guarded by a copy of the original condition, also
+ *      appended to the loop node, so they are only computed if the loop
+ *      is entered.
+ * 
+ * @param node Abstract syntax node
+ * @param assigned Symbols assigned anywhere in the program
+ * @param params Parameters of the enclosing function
+ */
+void hoist_invariants(astnode* node, idmap* assigned, idmap* params);
+
+/**
+ * @brief Returns true if a syntax node is a literal constant.
+ * 
+ * @param node Abstract syntax node
+ * @return True if node is a literal
+ */
+boolean is_literal(astnode* node);
+
+#endif
@@ -3,8 +3,9 @@
 int precedence(parser* p, lxtoken* op);
 astnode* apply_op(vector* primaries, vector* operators);
 void strip_newlines(parser* p);
-astnode* astnode_new(const char* value, asttype type, lxpos pos);
 astnode* parse_table_subscript(parser* p);
+astnode* parse_loop_variable(parser* p);
+astnode* parse_each_body(parser* p, astnode* loop, astnode* table, astnode* key, astnode* value);
 
 #define TKISFETCH(type) type == LX_DOT || type == LX_LEFT_SQUARE
 
@@ -90,28 +91,34 @@ astnode* parse_statement(parser* p)
     {
         case LX_SYMBOL:
             if (TKISFETCH(lookahead(p)->type)) {
-                free(st);
+                astnode_free(st);
                 st = parse_table_put(p);
             } else {
                 st->type = AST_ASSIGN;
+                st->sym = peek(p)->sym;
                 st->value = eat(p)->value;
-                consume(p, LX_ASSIGN);
-                vector_push(&st->children, parse_expression(p));
+
+                if (peek(p)->type == LX_UPDATE) {
+                    vector_push(&st->children, parse_update(p, st));
+                } else {
+                    consume(p, LX_ASSIGN);
+                    vector_push(&st->children, parse_expression(p));
+                }
             }
             break;
 
         case LX_CALL:
-            free(st);
+            astnode_free(st);
             st = parse_function_call(p);
             break;
         
         case LX_LOOP:
-            free(st);
+            astnode_free(st);
             st = parse_loop(p);
             break;
         
         case LX_IF:
-            free(st);
+            astnode_free(st);
             st = parse_branching(p);
             break;
         
@@ -171,7 +178,10 @@ astnode* parse_expression(parser* p)
         vector_push(&primaries, apply_op(&primaries, &operators));
     }
 
-    return vector_pop(&primaries);
+    astnode* expression = vector_pop(&primaries);
+    free(primaries.items);
+    free(operators.items);
+    return expression;
 }
 
 astnode* parse_primary(parser* p)
@@ -180,9 +190,7 @@ astnode* parse_primary(parser* p)
         parsererror(p, "Program has ended prematurely!");
     }
 
-    astnode* node = (astnode*)malloc(sizeof(astnode));
-    node->pos = clone_pos(&peek(p)->pos);
-    node->children = vector_new(1);
+    astnode* node = astnode_new(NULL, AST_ROOT, clone_pos(&peek(p)->pos));
 
     switch (peek(p)->type)
     {
@@ -212,32 +220,33 @@ astnode* parse_primary(parser* p)
             break;
 
         case LX_LEFT_BRACE:
-            free(node);
+            astnode_free(node);
             node = parse_table_instance(p);
             break;
         
         case LX_SYMBOL:
             if (TKISFETCH(lookahead(p)->type)) {
-                free(node);
+                astnode_free(node);
                 node = parse_table_subscript(p);
             } else {
                 node->type = AST_REFERENCE;
+                node->sym = peek(p)->sym;
                 node->value = eat(p)->value;
             }
             break;
 
         case LX_FUNCTION:
-            free(node);
+            astnode_free(node);
             node = parse_function_definition(p);
             break;
         
         case LX_CALL:
-            free(node);
+            astnode_free(node);
             node = parse_function_call(p);
             break;
 
         case LX_LEFT_PAREN:
-            free(node);
+            astnode_free(node);
             consume(p, LX_LEFT_PAREN);
             node = parse_expression(p);
             consume(p, LX_RIGHT_PAREN);
@@ -266,11 +275,7 @@ astnode* parse_function_call(parser* p)
 {
     consume(p, LX_CALL);
 
-    astnode* fcall = (astnode*) malloc(sizeof(astnode));
-    fcall->type = AST_CALL;
-    fcall->pos = clone_pos(&peek(p)->pos);
-    fcall->value = "call";
-    fcall->children = vector_new(4);
+    astnode* fcall = astnode_new("call", AST_CALL, clone_pos(&peek(p)->pos));
     vector_push(&fcall->children, parse_expression(p));
 
     consume(p, LX_LEFT_PAREN);
@@ -300,7 +305,9 @@ astnode* parse_function_definition(parser* p)
     {
         do {
             lxtoken* param = consume(p, LX_SYMBOL);
-            vector_push(&params->children, astnode_new(param->value, AST_PARAM, clone_pos(&param->pos)));
+            astnode* node = astnode_new(param->value, AST_PARAM, clone_pos(&param->pos));
+            node->sym = param->sym;
+            vector_push(&params->children, node);
         } 
         while (consume_optional(p, LX_SEPARATOR));
     }
@@ -318,6 +325,16 @@ astnode* parse_function_definition(parser* p)
 astnode* parse_loop(parser* p)
 {
     astnode* loop = astnode_new("loop", AST_LOOP, clone_pos(&consume(p, LX_LOOP)->pos));
+
+    // in is only reserved after the loop keyword and loop variables
+    if (peek(p)->type == LX_SYMBOL && lookahead(p) != NULL && lookahead(p)->type == LX_SEPARATOR) {
+        return parse_each_loop(p, loop);
+    }
+
+    if (peek(p)->type == LX_SYMBOL && lookahead(p) != NULL && lookahead(p)->type == LX_SYMBOL
+            && streq(lookahead(p)->value, "in")) {
+        return parse_range_loop(p, loop);
+    }
     
     // loop condition
     vector_push(&loop->children, parse_expression(p));
@@ -331,6 +348,92 @@ astnode* parse_loop(parser* p)
     return loop;
 }
 
+astnode* parse_range_loop(parser* p, astnode* loop)
+{
+    loop->type = AST_RANGE_LOOP;
+    loop->value = "range";
+
+    astnode* counter = parse_loop_variable(p);
+    eat(p);
+
+    // start..limit step s
+    astnode* start = parse_expression(p);
+
+    // a single operand without a range is a table to iterate over
+    if (peek(p)->type != LX_RANGE) {
+        return parse_each_body(p, loop, start, counter, NULL);
+    }
+
+    vector_push(&counter->children, start);
+    vector_push(&loop->children, counter);
+    consume(p, LX_RANGE);
+    vector_push(&loop->children, parse_expression(p));
+
+    if (peek(p)->type == LX_SYMBOL && streq(peek(p)->value, "step")) {
+        eat(p);
+        vector_push(&loop->children, parse_expression(p));
+    } else {
+        vector_push(&loop->children, astnode_new("1", AST_INTEGER, clone_pos(&loop->pos)));
+    }
+
+    // loop body
+    strip_newlines(p);
+    consume(p, LX_LEFT_BRACE);
+    vector_push(&loop->children, parse_block(p, LX_RIGHT_BRACE));
+    consume(p, LX_RIGHT_BRACE);
+
+    return loop;
+}
+
+astnode* parse_each_loop(parser* p, astnode* loop)
+{
+    astnode* key = parse_loop_variable(p);
+    consume(p, LX_SEPARATOR);
+    astnode* value = parse_loop_variable(p);
+
+    if (is_empty(p) || peek(p)->type != LX_SYMBOL || !streq(peek(p)->value, "in")) {
+        parsererror(p, "Unexpected token");
+    }
+    eat(p);
+
+    return parse_each_body(p, loop, parse_expression(p), key, value);
+}
+
+// Parses the variable of a counted or table loop into an assignment
+// without a value
+astnode* parse_loop_variable(parser* p)
+{
+    astnode* var = astnode_new(NULL, AST_ASSIGN, clone_pos(&peek(p)->pos));
+    var->sym = peek(p)->sym;
+    var->value = consume(p, LX_SYMBOL)->value;
+    return var;
+}
+
+// Completes a table loop with its body, loop variables are assigned null
+// in the tree as their values are only known to the iterator
+astnode* parse_each_body(parser* p, astnode* loop, astnode* table, astnode* key, astnode* value)
+{
+    loop->type = AST_EACH_LOOP;
+    loop->value = "each";
+
+    vector_push(&loop->children, table);
+
+    strip_newlines(p);
+    consume(p, LX_LEFT_BRACE);
+    vector_push(&loop->children, parse_block(p, LX_RIGHT_BRACE));
+    consume(p, LX_RIGHT_BRACE);
+
+    vector_push(&key->children, astnode_new("null", AST_NULL, clone_pos(&key->pos)));
+    vector_push(&loop->children, key);
+
+    if (value != NULL) {
+        vector_push(&value->children, astnode_new("null", AST_NULL, clone_pos(&value->pos)));
+        vector_push(&loop->children, value);
+    }
+
+    return loop;
+}
+
 astnode* parse_branching(parser* p)
 {
     astnode* branch0 = astnode_new("conditional", AST_BRANCHES, clone_pos(&consume(p, LX_IF)->pos));
@@ -401,16 +504,35 @@ astnode* parse_table_put(parser* p)
 {
     astnode* put = astnode_new("put", AST_PUT, clone_pos(&peek(p)->pos));
     vector_push(&put->children, parse_expression(p));
-    consume(p, LX_ASSIGN);
+
+    // updates of an element name the operation in place of put
+    if (peek(p)->type == LX_UPDATE) {
+        put->value = eat(p)->value;
+    } else {
+        consume(p, LX_ASSIGN);
+    }
+
     vector_push(&put->children, parse_expression(p));
     return put;
 }
 
+astnode* parse_update(parser* p, astnode* assign)
+{
+    lxtoken* op = eat(p);
+    astnode* update = astnode_new(op->value, AST_BINARY_EXPRESSION, clone_pos(&op->pos));
+    astnode* var = astnode_new(assign->value, AST_REFERENCE, clone_pos(&assign->pos));
+
+    var->sym = assign->sym;
+    vector_push(&update->children, var);
+    vector_push(&update->children, parse_expression(p));
+    return update;
+}
+
 astnode* parse_table_subscript(parser* p)
 {
     astnode* rhs = NULL;
     astnode* lhs = astnode_new(peek(p)->value, AST_REFERENCE, clone_pos(&peek(p)->pos));
-    consume(p, LX_SYMBOL);
+    lhs->sym = consume(p, LX_SYMBOL)->sym;
 
     while (TKISFETCH(peek(p)->type))
     {
@@ -443,16 +565,52 @@ astnode* parse_table_subscript(parser* p)
 
 // ------------------ UTILITY METHODS ------------------
 
+__thread vector* node_arena = NULL;
+
 astnode* astnode_new(const char* value, asttype type, lxpos pos) 
 {
     astnode* node = (astnode*)malloc(sizeof(astnode));
     node->value = value;
+    node->sym = 0;
     node->type = type;
     node->children = vector_new(4);
     node->pos = pos;
+
+    if (node_arena != NULL) {
+        vector_push(node_arena, node);
+    }
+
     return node;
 }
 
+void astnode_free(astnode* node)
+{
+    // nodes are freed soon after being allocated, so are found near the top
+    for (size_t i = node_arena != NULL ? node_arena->size : 0; i > 0; i--)
+    {
+        if (node_arena->items[i - 1] == node) {
+            vector_rm(node_arena, i - 1);
+            break;
+        }
+    }
+
+    free(node->children.items);
+    free(node);
+}
+
+void astnode_release(vector* nodes)
+{
+    for (size_t i = 0; i < nodes->size; i++)
+    {
+        astnode* node = vector_get(nodes, i);
+        free(node->children.items);
+        free(node);
+    }
+
+    free(nodes->items);
+    *nodes = (vector) { NULL, 0, 0 };
+}
+
 /**
  * Returns an integer value signifying the operator order precedence for
  * the provided operator token. 
@@ -535,7 +693,7 @@ const char* astnode_tostr(astnode* node)
 
     sprintf(buf + strlen(buf), node->type == AST_BLOCK ? "]" : ")");
 
-    char* out = (char*)malloc(sizeof(char) * strlen(buf));
+    char* out = (char*)malloc(sizeof(char) * (strlen(buf) + 1));
     strcpy(out, buf);
     return out;
 }
@@ -575,9 +733,15 @@ void print_ast(astnode* n, long stem, int level, boolean last)
 void parsererror(parser* p, const char* msg) 
 {
     lxtoken* tk = peek(p);
-    fprintf(stderr, "%s[err] %s (%d, %d) in %s:\n", ERR_COL, msg, tk->pos.line_pos + 1, tk->pos.col_pos + 1, tk->pos.origin);
-    fprintf(stderr, "\t|\n");
-    fprintf(stderr, "\t| %04i %s\n", tk->pos.line_pos + 1, get_line(p->source, tk->pos.line_offset));
-    fprintf(stderr, "\t| %s'\n%s", paddchar('~', 5 + tk->pos.col_pos), DEF_COL);
-    exit(0);
-}
\ No newline at end of file
+    char buf[512];
+    snprintf(buf, sizeof(buf), "%s (%d, %d) in %s", msg, tk->pos.line_pos + 1, tk->pos.col_pos + 1, tk->pos.origin);
+
+    if (current_trap == NULL) {
+        fprintf(stderr, "%s[err] %s:\n", ERR_COL, buf);
+        fprintf(stderr, "\t|\n");
+        fprintf(stderr, "\t| %04i %s\n", tk->pos.line_pos + 1, get_line(p->source, tk->pos.line_offset));
+        fprintf(stderr, "\t| %s'\n%s", paddchar('~', 5 + tk->pos.col_pos), DEF_COL);
+    }
+    error_exit(buf);
+}
+
@@ -36,15 +36,23 @@ typedef enum asttype {
     AST_TABLE,
     AST_KV_PAIR,
     AST_PUT,
+    AST_RANGE_LOOP,
+    AST_EACH_LOOP,
+    AST_SNAPSHOT,
 } asttype;
 
 typedef struct astnode {
     const char* value;
+    symbol sym;
     asttype type;
     vector children;
     lxpos pos;
 } astnode;
 
+// Records the nodes allocated by the calling thread while set, so a tree
+// can be freed along with the nodes passes have detached from it
+extern __thread vector* node_arena;
+
 /**
  * @brief Returns the token at the current parser position without
  *      removing it from the token stream.
@@ -147,6 +155,31 @@ astnode* parse_function_definition(parser* p);
  */
 astnode* parse_expression(parser* p);
 
+/**
+ * @brief Allocates a syntax node without children.
+ * 
+ * @param value Node value
+ * @param type Node type
+ * @param pos Source position
+ * @return AST node
+ */
+astnode* astnode_new(const char* value, asttype type, lxpos pos);
+
+/**
+ * @brief Frees a syntax node which was never linked into a tree.
+ * 
+ * @param node AST node
+ */
+void astnode_free(astnode* node);
+
+/**
+ * @brief Frees every node recorded by a node arena, whether or not it is
+ *      still reachable from a tree. Node values are not freed.
+ * 
+ * @param nodes Node arena
+ */
+void astnode_release(vector* nodes);
+
 /**
  * @brief Parses an expression primary i.e integers, variable refs,
  *      parenthesis enclosed expressions, function calls and unary
@@ -174,6 +207,29 @@ astnode* parse_function_call(parser* p);
  */
 astnode* parse_loop(parser* p);
 
+/**
+ * @brief Parses counted loop over a numeric range, loop i in a..b step s,
+ *      into an assignment of the start to the counter, the exclusive
+ *      limit, the step and the body. The step defaults to 1.
+ * 
+ * @param p Reference to parser
+ * @param loop Loop node, with the loop keyword consumed
+ * @return AST node
+ */
+astnode* parse_range_loop(parser* p, astnode* loop);
+
+/**
+ * @brief Parses loop over the entries of a table, loop k, v in t, into
+ *      the table, the body and the key and value variables. A loop with
+ *      a single variable and no range, loop k in t, iterates over keys
+ *      only and has no value variable.
+ * 
+ * @param p Reference to parser
+ * @param loop Loop node, with the loop keyword consumed
+ * @return AST node
+ */
+astnode* parse_each_loop(parser* p, astnode* loop);
+
 /**
  * @brief Parses if-else_if-else block, branching control structure.
  * 
@@ -191,13 +247,25 @@ astnode* parse_branching(parser* p);
 astnode* parse_table_instance(parser* p);
 
 /**
- * @brief Parses table key-value insertion statement e.g t[k] <- v
+ * @brief Parses table key-value insertion statement e.g t[k] <- v, or
+ *      an update of the element e.g t[k] += v, whose node is named by
+ *      the operation applied instead of put
  * 
  * @param p Reference to parser
  * @return AST node
  */
 astnode* parse_table_put(parser* p);
 
+/**
+ * @brief Parses the operand of an update statement e.g x += v into the
+ *      expression assigned to the variable, x + v
+ * 
+ * @param p Reference to parser
+ * @param assign Assignment node, with the variable name consumed
+ * @return AST node
+ */
+astnode* parse_update(parser* p, astnode* assign);
+
 /**
  * @brief Represents abstract syntax tree into a string representation
  *      to be printed out.
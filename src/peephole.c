@@ -0,0 +1,313 @@
+#include "peephole.h"
+
+// forward declarations
+size_t next_live(boolean* dead, size_t n, size_t i);
+void mark_reachable(program* p, int* target, boolean* dead, boolean* reachable);
+void remap_line_addresses(program* p, size_t* index);
+vm_op fused_branch(vm_op compare, vm_op jump);
+
+#define SUPERINSTRUCTION_PAIR(a, b) { OP_##a, OP_##b },
+const vm_op superinstruction_ops[][2] = { SUPERINSTRUCTIONS(SUPERINSTRUCTION_PAIR) };
+#undef SUPERINSTRUCTION_PAIR
+
+const size_t superinstruction_count = sizeof(superinstruction_ops) / sizeof(superinstruction_ops[0]);
+
+boolean superinstructions_fused = false;
+
+void peephole(program* p)
+{
+    size_t n = p->length;
+    instruction* code = p->code;
+
+    int* target = malloc(sizeof(int) * (n + 1));
+    boolean* dead = calloc(n + 1, sizeof(boolean));
+    boolean* label = malloc(sizeof(boolean) * (n + 1));
+    boolean* reachable = malloc(sizeof(boolean) * (n + 1));
+    boolean* slot = calloc(n + 1, sizeof(boolean));
+
+    // decodes relative jump offsets into absolute targets
+    for (size_t i = 0; i < n; i++) {
+        target[i] = is_jump(code[i].stackop.op) ? (int) i + code[i].sx.sx + 1 : -1;
+        dead[i] = code[i].stackop.op == OP_NOP;
+    }
+
+    // jumps of a switch are selected by their position and must stay
+    for (size_t i = 0; i < n; i++) {
+        if (code[i].stackop.op == OP_SWITCH) {
+            for (size_t k = 1; k <= switch_slots(p, code[i]); k++) slot[i + k] = true;
+        }
+    }
+
+    // conditional skip over a jump becomes a single jump if false
+    for (size_t i = 0; i + 1 < n; i++) {
+        if (code[i].stackop.op == OP_JIF && code[i + 1].stackop.op == OP_JMP) {
+            code[i].sx.op = OP_JFALSE;
+            target[i] = target[i + 1];
+            dead[i + 1] = true;
+        }
+    }
+
+    boolean changed;
+
+    do {
+        changed = false;
+
+        // resolves jumps landing on removed instructions
+        for (size_t i = 0; i < n; i++) {
+            if (!dead[i] && target[i] != -1) {
+                target[i] = next_live(dead, n, target[i]);
+            }
+        }
+
+        memset(label, false, sizeof(boolean) * (n + 1));
+
+        for (size_t i = 0; i < n; i++) {
+            if (dead[i]) {
+                continue;
+            } else if (target[i] != -1) {
+                label[target[i]] = true;
+            } else if (code[i].stackop.op == OP_JIF) {
+                // instructions around a conditional skip must stay in place
+                label[i + 1] = true;
+                label[i + 2] = true;
+            } else if (code[i].stackop.op == OP_SWITCH) {
+                for (size_t k = 1; k <= switch_slots(p, code[i]); k++) label[i + k] = true;
+            }
+        }
+
+        // removes code which can never be executed
+        mark_reachable(p, target, dead, reachable);
+
+        for (size_t i = 0; i < n; i++) {
+            if (!dead[i] && !reachable[i]) {
+                dead[i] = changed = true;
+            }
+        }
+
+        for (size_t i = 0; i < n; i++)
+        {
+            if (dead[i]) {
+                continue;
+            }
+
+            vm_op op = code[i].stackop.op;
+            size_t j = next_live(dead, n, i + 1);
+
+            // threads jumps to unconditional jumps and returns
+            if (target[i] != -1 && target[i] < n && code[target[i]].stackop.op == OP_JMP && target[target[i]] != target[i]) {
+                target[i] = target[target[i]];
+                changed = true;
+            }
+            else if (op == OP_JMP && target[i] < n && code[target[i]].stackop.op == OP_RET) {
+                code[i].stackop.op = OP_RET;
+                target[i] = -1;
+                changed = true;
+            }
+            // jumps to the following instruction have no effect
+            else if (op == OP_JMP && target[i] == j && !slot[i]) {
+                dead[i] = changed = true;
+            }
+            else if ((op == OP_JFALSE || op == OP_JTRUE) && target[i] == j) {
+                code[i].stackop.op = OP_POP;
+                target[i] = -1;
+                changed = true;
+            }
+            // values pushed only to be discarded
+            else if (j < n && !label[j] && code[j].stackop.op == OP_POP
+                    && (op == OP_PUSHK || op == OP_LOADL || op == OP_LOADG || op == OP_LOADC)) {
+                dead[i] = dead[j] = changed = true;
+            }
+            // comparisons deciding a conditional jump branch directly
+            else if (j < n && !label[j] && (code[j].stackop.op == OP_JFALSE || code[j].stackop.op == OP_JTRUE)
+                    && fused_branch(op, code[j].stackop.op) != OP_NOP) {
+                code[i].sx.op = fused_branch(op, code[j].stackop.op);
+                target[i] = target[j];
+                dead[j] = changed = true;
+            }
+            // store followed by a load of the same address keeps the value
+            else if (j < n && !label[j] && code[j].sx.sx == code[i].sx.sx
+                    && ((op == OP_STORL && code[j].stackop.op == OP_LOADL) || (op == OP_STORG && code[j].stackop.op == OP_LOADG))) {
+                code[i].sx.op = op == OP_STORL ? OP_STORLK : OP_STORGK;
+                dead[j] = changed = true;
+            }
+        }
+    }
+    while (changed);
+
+    // compacts live instructions and rewrites jump offsets
+    size_t* index = malloc(sizeof(size_t) * (n + 1));
+    size_t length = 0;
+
+    for (size_t i = 0; i <= n; i++) {
+        index[i] = length;
+        if (i < n && !dead[i]) length++;
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (dead[i]) {
+            continue;
+        }
+
+        code[index[i]] = code[i];
+
+        if (target[i] != -1) {
+            code[index[i]].sx.sx = index[target[i]] - index[i] - 1;
+        }
+    }
+
+    p->length = length;
+    remap_line_addresses(p, index);
+
+    free(target);
+    free(dead);
+    free(label);
+    free(reachable);
+    free(slot);
+    free(index);
+}
+
+void fuse_superinstructions(program* p)
+{
+    superinstructions_fused = true;
+
+    // second operation stays in place, so jumps may still land on it
+    for (size_t i = 0; i + 1 < p->length; i++)
+    {
+        for (size_t s = 0; s < superinstruction_count; s++)
+        {
+            if (p->code[i].stackop.op == superinstruction_ops[s][0] && p->code[i + 1].stackop.op == superinstruction_ops[s][1]) {
+                p->code[i].stackop.op = VM_BASE_OPS + s;
+                break;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < p->constant_table.size; i++)
+    {
+        Value k = p->constants[i];
+
+        // deferred functions are fused once compiled
+        if (k.type == VM_PROGRAM && k.value.to_code->p->native == NULL && k.value.to_code->p->deferred == NULL) {
+            fuse_superinstructions(k.value.to_code->p);
+        }
+    }
+}
+
+boolean is_jump(vm_op op)
+{
+    return op == OP_JMP || op == OP_JFALSE || op == OP_JTRUE || (OP_JLT <= op && op <= OP_JNGE)
+        || op == OP_FORPREP || op == OP_FORLOOP || op == OP_TITER || op == OP_TNEXT;
+}
+
+size_t switch_slots(program* p, instruction i)
+{
+    jump_table* t = vector_get(&p->jump_tables, i.ux.ux);
+    return t->count + 1;
+}
+
+vm_op unfused_op(instruction i)
+{
+    return i.stackop.op < VM_BASE_OPS ? i.stackop.op : superinstruction_ops[i.stackop.op - VM_BASE_OPS][0];
+}
+
+// ------------------ UTILITY METHODS ------------------
+
+// Returns the index of the first live instruction at or after i
+size_t next_live(boolean* dead, size_t n, size_t i)
+{
+    while (i < n && dead[i]) i++;
+    return i;
+}
+
+// Flags instructions reachable from the program entry point
+void mark_reachable(program* p, int* target, boolean* dead, boolean* reachable)
+{
+    size_t n = p->length;
+    // each instruction adds at most three successors, besides switch jumps
+    size_t* worklist = malloc(sizeof(size_t) * 4 * (n + 1));
+    size_t top = 0;
+
+    memset(reachable, false, sizeof(boolean) * (n + 1));
+
+    worklist[top++] = next_live(dead, n, 0);
+
+    while (top > 0)
+    {
+        size_t i = worklist[--top];
+
+        if (i >= n || reachable[i]) {
+            continue;
+        }
+
+        reachable[i] = true;
+        vm_op op = p->code[i].stackop.op;
+
+        if (target[i] != -1) {
+            worklist[top++] = target[i];
+        }
+
+        if (op == OP_JIF) {
+            worklist[top++] = i + 2;
+        }
+
+        for (size_t k = 2; op == OP_SWITCH && k <= switch_slots(p, p->code[i]); k++) {
+            worklist[top++] = i + k;
+        }
+
+        if (op != OP_JMP && op != OP_RET) {
+            worklist[top++] = op == OP_JIF ? i + 1 : next_live(dead, n, i + 1);
+        }
+    }
+
+    free(worklist);
+}
+
+// Returns the compare-and-branch operation testing a comparison, or its
+// negation when jumping if false, OP_NOP if the operation does not compare
+vm_op fused_branch(vm_op compare, vm_op jump)
+{
+    boolean taken = jump == OP_JTRUE;
+
+    switch (compare)
+    {
+        case OP_LT: case OP_ILT: case OP_FLT: return taken ? OP_JLT : OP_JNLT;
+        case OP_LE: case OP_ILE: case OP_FLE: return taken ? OP_JLE : OP_JNLE;
+        case OP_GT: case OP_IGT: case OP_FGT: return taken ? OP_JGT : OP_JNGT;
+        case OP_GE: case OP_IGE: case OP_FGE: return taken ? OP_JGE : OP_JNGE;
+        case OP_EQ: case OP_IEQ: return taken ? OP_JEQ : OP_JNE;
+        case OP_NE: case OP_INE: return taken ? OP_JNE : OP_JEQ;
+        default: return OP_NOP;
+    }
+}
+
+// Maps recorded instruction positions onto the compacted code
+void remap_line_addresses(program* p, size_t* index)
+{
+    map table = map_new(p->line_address_table.size + 1);
+
+    for (size_t i = 0; i < p->line_address_table.size; i++)
+    {
+        char* buf = malloc(sizeof(char) * 8);
+        sprintf(buf, "%lu", index[atoi(p->line_address_table.keys[i])]);
+
+        // positions of removed code may share the address of the next one,
+        // which replaces them
+        boolean taken = map_has(&table, buf);
+
+        if (taken) {
+            line_entry_free(map_get(&table, buf));
+        }
+
+        map_put(&table, buf, p->line_address_table.values[i]);
+
+        if (taken) {
+            free(buf);
+        }
+        free((char*) p->line_address_table.keys[i]);
+    }
+
+    free(p->line_address_table.keys);
+    free(p->line_address_table.values);
+    p->line_address_table = table;
+}
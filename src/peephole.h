@@ -0,0 +1,67 @@
+#ifndef HE_PEEPHOLE_HEADER
+#define HE_PEEPHOLE_HEADER
+
+#include "common.h"
+#include "datatypes.h"
+#include "compiler.h"
+
+// operations fused by each superinstruction, indexed from VM_BASE_OPS
+extern const vm_op superinstruction_ops[][2];
+
+// number of superinstructions of this build
+extern const size_t superinstruction_count;
+
+// set once a program is fused, functions compiled later are then fused too
+extern boolean superinstructions_fused;
+
+/**
+ * @brief Runs peephole optimisations over the bytecode of a compiled
+ *      program: removes no-ops and unreachable code, threads chains of
+ *      jumps, fuses conditional skips with the jump that follows them
+ *      and fuses stores immediately followed by a load of the same
+ *      variable. Jump offsets and the line address table are rewritten
+ *      to match the compacted code.
+ *
+ * @param p Reference to program
+ */
+void peephole(program* p);
+
+/**
+ * @brief Replaces adjacent pairs of operations by the superinstruction
+ *      executing both with a single dispatch, in the program and all
+ *      functions among its constants. Only the first operation of a pair
+ *      is rewritten. Must run after all other bytecode passes.
+ *
+ * @param p Reference to program
+ */
+void fuse_superinstructions(program* p);
+
+/**
+ * @brief Returns true if the instruction is a jump carrying a relative
+ *      offset in its signed operand.
+ *
+ * @param op Operation code
+ * @return True if jump instruction
+ */
+boolean is_jump(vm_op op);
+
+/**
+ * @brief Returns the number of jumps following a switch instruction, one
+ *      per case and a last one to the default case.
+ *
+ * @param p Reference to program
+ * @param i Switch instruction
+ * @return Number of jumps
+ */
+size_t switch_slots(program* p, instruction i);
+
+/**
+ * @brief Returns the first operation of a superinstruction, or the
+ *      operation of any other instruction.
+ *
+ * @param i Instruction
+ * @return Operation code
+ */
+vm_op unfused_op(instruction i);
+
+#endif
@@ -0,0 +1,811 @@
+#include "specialise.h"
+#include "peephole.h"
+
+// forward declarations
+boolean transfer(cfg* g, size_t pc, typeset* stack, size_t* depth, typeset* vars, boolean rewrite);
+typeset binary_result(vm_op op, typeset a, typeset b);
+typeset intrinsic_result(vm_op op);
+typeset scalar_result(vm_op op, vm_type a, vm_type b);
+void specialise_binary(cfg* g, size_t pc, typeset a, typeset b);
+boolean strength_reduce(cfg* g, size_t pc);
+void eliminate_dead_stores(cfg* g);
+void live_at_entry(cfg* g, block* b, boolean* live);
+void collect_clobbered(program* p, boolean* clobbered, size_t nvars);
+void collect_assigned_globals(astnode* node, program* global, boolean* clobbered, size_t nvars);
+
+#define INTEGRAL(t) ((t) == VM_INT || (t) == VM_BOOL)
+#define NUMERIC(t) ((t) == VM_INT || (t) == VM_BOOL || (t) == VM_FLOAT)
+
+// generic operations and their guard-free counterparts for operands
+// proven to be ints or floats, OP_NOP where no counterpart exists
+struct specialisation {
+    vm_op generic;
+    vm_op int_op;
+    vm_op float_op;
+} specialisations[] = {
+    { OP_ADD,   OP_IADD,    OP_FADD },
+    { OP_SUB,   OP_ISUB,    OP_FSUB },
+    { OP_MUL,   OP_IMUL,    OP_FMUL },
+    { OP_DIV,   OP_NOP,     OP_FDIV },
+    { OP_LT,    OP_ILT,     OP_FLT  },
+    { OP_LE,    OP_ILE,     OP_FLE  },
+    { OP_GT,    OP_IGT,     OP_FGT  },
+    { OP_GE,    OP_IGE,     OP_FGE  },
+    { OP_EQ,    OP_IEQ,     OP_NOP  },
+    { OP_NE,    OP_INE,     OP_NOP  },
+};
+
+void specialise(program* p)
+{
+    cfg g = cfg_build(p);
+
+    if (!cfg_infer_types(&g)) {
+        cfg_delete(&g);
+        return;
+    }
+
+    typeset* stack = malloc(sizeof(typeset) * (p->length + 1));
+    typeset* vars = malloc(sizeof(typeset) * (g.nvars + 1));
+
+    // replays every reachable block from its entry types, rewriting
+    // instructions as the operand types become known
+    for (size_t i = 0; i < g.size; i++)
+    {
+        block* b = &g.blocks[i];
+
+        if (!b->visited) {
+            continue;
+        }
+
+        size_t depth = b->depth;
+        memcpy(stack, b->stack, sizeof(typeset) * depth);
+        memcpy(vars, b->vars, sizeof(typeset) * g.nvars);
+
+        for (size_t pc = b->start; pc < b->end; pc++) {
+            transfer(&g, pc, stack, &depth, vars, true);
+        }
+    }
+
+    // globals remain observable by every function after a store
+    if (!g.global) {
+        cfg_liveness(&g);
+        eliminate_dead_stores(&g);
+    }
+
+    free(stack);
+    free(vars);
+    cfg_delete(&g);
+}
+
+cfg cfg_build(program* p)
+{
+    size_t n = p->length;
+
+    cfg g = {
+        .p = p,
+        .blocks = NULL,
+        .size = 0,
+        .block_of = malloc(sizeof(size_t) * (n + 1)),
+        .nvars = p->symbol_table.size,
+        .global = p->prev == NULL,
+        .clobbered = calloc(p->symbol_table.size + 1, sizeof(boolean)),
+    };
+
+    // a block begins at the entry point, at jump targets and after
+    // any instruction which may transfer control
+    boolean* leader = calloc(n + 2, sizeof(boolean));
+    leader[0] = true;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        vm_op op = p->code[i].stackop.op;
+
+        if (is_jump(op)) {
+            long target = (long) i + p->code[i].sx.sx + 1;
+            if (0 <= target && target <= n) leader[target] = true;
+            leader[i + 1] = true;
+        } else if (op == OP_JIF) {
+            leader[i + 1] = true;
+            leader[i + 2] = true;
+        } else if (op == OP_RET || op == OP_SWITCH) {
+            leader[i + 1] = true;
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (leader[i]) g.size++;
+    }
+
+    g.blocks = calloc(g.size + 1, sizeof(block));
+
+    for (size_t i = 0, b = -1; i < n; i++)
+    {
+        if (leader[i]) {
+            g.blocks[++b].start = i;
+        }
+
+        g.blocks[b].end = i + 1;
+        g.block_of[i] = b;
+    }
+
+    g.block_of[n] = g.size;
+
+    // links blocks to their successors, leaving the program ends unlinked
+    for (size_t i = 0; i < g.size; i++)
+    {
+        block* b = &g.blocks[i];
+        size_t last = b->end - 1;
+        vm_op op = p->code[last].stackop.op;
+
+        size_t slots = op == OP_SWITCH ? switch_slots(p, p->code[last]) : 0;
+        size_t* next = malloc(sizeof(size_t) * (slots + 2));
+        size_t count = 0;
+
+        if (is_jump(op)) {
+            next[count++] = last + p->code[last].sx.sx + 1;
+        }
+
+        if (op == OP_JIF) {
+            next[count++] = last + 1;
+            next[count++] = last + 2;
+        } else if (op == OP_SWITCH) {
+            for (size_t k = 1; k <= slots; k++) next[count++] = last + k;
+        } else if (op != OP_JMP && op != OP_RET) {
+            next[count++] = b->end;
+        }
+
+        b->succ = malloc(sizeof(size_t) * (count + 1));
+
+        for (size_t j = 0; j < count; j++) {
+            if (next[j] < n) b->succ[b->nsucc++] = g.block_of[next[j]];
+        }
+
+        free(next);
+    }
+
+    if (g.global) {
+        collect_clobbered(p, g.clobbered, g.nvars);
+    }
+
+    free(leader);
+    return g;
+}
+
+boolean cfg_infer_types(cfg* g)
+{
+    if (g->size == 0) {
+        return true;
+    }
+
+    typeset* stack = malloc(sizeof(typeset) * (g->p->length + 1));
+    typeset* vars = malloc(sizeof(typeset) * (g->nvars + 1));
+    size_t* worklist = malloc(sizeof(size_t) * g->size);
+    boolean* queued = calloc(g->size, sizeof(boolean));
+    size_t top = 0;
+    boolean consistent = true;
+
+    // nothing is known about variables on entry
+    block* entry = &g->blocks[0];
+    entry->visited = true;
+    entry->depth = 0;
+    entry->stack = malloc(sizeof(typeset));
+    entry->vars = malloc(sizeof(typeset) * (g->nvars + 1));
+    memset(entry->vars, TS_ANY, sizeof(typeset) * g->nvars);
+
+    worklist[top++] = 0;
+    queued[0] = true;
+
+    while (consistent && top > 0)
+    {
+        size_t bi = worklist[--top];
+        block* b = &g->blocks[bi];
+        queued[bi] = false;
+
+        size_t depth = b->depth;
+        memcpy(stack, b->stack, sizeof(typeset) * depth);
+        memcpy(vars, b->vars, sizeof(typeset) * g->nvars);
+
+        for (size_t pc = b->start; consistent && pc < b->end; pc++) {
+            consistent = transfer(g, pc, stack, &depth, vars, false);
+        }
+
+        // merges exit types into the entry types of each successor
+        for (size_t j = 0; consistent && j < b->nsucc; j++)
+        {
+            size_t si = b->succ[j];
+            block* s = &g->blocks[si];
+            boolean changed = false;
+
+            if (!s->visited)
+            {
+                s->visited = changed = true;
+                s->depth = depth;
+                s->stack = malloc(sizeof(typeset) * (depth + 1));
+                s->vars = malloc(sizeof(typeset) * (g->nvars + 1));
+                memcpy(s->stack, stack, sizeof(typeset) * depth);
+                memcpy(s->vars, vars, sizeof(typeset) * g->nvars);
+            }
+            else if (s->depth != depth)
+            {
+                consistent = false;
+            }
+            else
+            {
+                for (size_t k = 0; k < depth; k++) {
+                    changed |= (s->stack[k] | stack[k]) != s->stack[k];
+                    s->stack[k] |= stack[k];
+                }
+
+                for (size_t k = 0; k < g->nvars; k++) {
+                    changed |= (s->vars[k] | vars[k]) != s->vars[k];
+                    s->vars[k] |= vars[k];
+                }
+            }
+
+            if (changed && !queued[si]) {
+                queued[si] = true;
+                worklist[top++] = si;
+            }
+        }
+    }
+
+    free(stack);
+    free(vars);
+    free(worklist);
+    free(queued);
+
+    return consistent;
+}
+
+void cfg_liveness(cfg* g)
+{
+    boolean* live = malloc(sizeof(boolean) * (g->nvars + 1));
+    boolean changed;
+
+    for (size_t i = 0; i < g->size; i++) {
+        g->blocks[i].live = calloc(g->nvars + 1, sizeof(boolean));
+    }
+
+    do {
+        changed = false;
+
+        for (size_t i = g->size; i-- > 0;)
+        {
+            block* b = &g->blocks[i];
+
+            for (size_t j = 0; j < b->nsucc; j++)
+            {
+                live_at_entry(g, &g->blocks[b->succ[j]], live);
+
+                for (size_t k = 0; k < g->nvars; k++) {
+                    changed |= live[k] && !b->live[k];
+                    b->live[k] |= live[k];
+                }
+            }
+        }
+    }
+    while (changed);
+
+    free(live);
+}
+
+void cfg_delete(cfg* g)
+{
+    for (size_t i = 0; i < g->size; i++)
+    {
+        free(g->blocks[i].stack);
+        free(g->blocks[i].vars);
+        free(g->blocks[i].live);
+        free(g->blocks[i].succ);
+    }
+
+    free(g->blocks);
+    free(g->block_of);
+    free(g->clobbered);
+}
+
+// ------------------ TYPE INFERENCE ------------------
+
+// Applies the effect of one instruction to the abstract stack and variable
+// types, specialising it first when rewrite is set
+boolean transfer(cfg* g, size_t pc, typeset* stack, size_t* depth, typeset* vars, boolean rewrite)
+{
+    program* p = g->p;
+    instruction i = p->code[pc];
+    size_t d = *depth;
+
+    // variables of other scopes may be changed by code not seen here
+    boolean tracked = i.sx.sx >= 0 && i.sx.sx < g->nvars;
+    boolean heap = g->global && tracked;
+    boolean local = !g->global && tracked;
+
+    switch (i.stackop.op)
+    {
+        case OP_NOP:
+        case OP_JMP:
+        case OP_SNAPSHOT:
+            break;
+
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+        case OP_EQ:
+        case OP_NE:
+        case OP_LT:
+        case OP_LE:
+        case OP_GT:
+        case OP_GE:
+            if (d < 2) return false;
+
+            if (rewrite) {
+                specialise_binary(g, pc, stack[d - 2], stack[d - 1]);
+            }
+
+            stack[d - 2] = binary_result(i.stackop.op, stack[d - 2], stack[d - 1]);
+            d--;
+            break;
+
+        case OP_IADD:
+        case OP_ISUB:
+        case OP_IMUL:
+            if (d < 2) return false;
+            stack[d - 2] = TS(VM_INT);
+            d--;
+            break;
+
+        case OP_FADD:
+        case OP_FSUB:
+        case OP_FMUL:
+        case OP_FDIV:
+            if (d < 2) return false;
+            stack[d - 2] = TS(VM_FLOAT);
+            d--;
+            break;
+
+        case OP_ILT:
+        case OP_ILE:
+        case OP_IGT:
+        case OP_IGE:
+        case OP_IEQ:
+        case OP_INE:
+        case OP_FLT:
+        case OP_FLE:
+        case OP_FGT:
+        case OP_FGE:
+            if (d < 2) return false;
+            stack[d - 2] = TS(VM_BOOL);
+            d--;
+            break;
+
+        case OP_ISHL:
+        case OP_IMODP:
+            if (d < 1) return false;
+            stack[d - 1] = TS(VM_INT);
+            break;
+
+        case OP_NEG:
+            if (d < 1) return false;
+            stack[d - 1] &= TS(VM_BOOL) | TS(VM_INT) | TS(VM_FLOAT);
+            break;
+
+        case OP_NOT:
+            if (d < 1) return false;
+            stack[d - 1] = TS(VM_BOOL);
+            break;
+
+        // casts of values already of the type leave them unchanged
+        case OP_TOINT:
+        case OP_TOFLOAT:
+        case OP_TOBOOL:
+            if (d < 1) return false;
+
+            if (rewrite && stack[d - 1] == intrinsic_result(i.stackop.op)) {
+                p->code[pc].stackop.op = OP_NOP;
+            }
+
+            stack[d - 1] = intrinsic_result(i.stackop.op);
+            break;
+
+        case OP_LEN:
+        case OP_SQRT:
+        case OP_TOSTR:
+            if (d < 1) return false;
+            stack[d - 1] = intrinsic_result(i.stackop.op);
+            break;
+
+        // integers raised to integers stay integers, as in the library
+        case OP_POW:
+            if (d < 2) return false;
+            stack[d - 2] = stack[d - 2] == TS(VM_INT) && stack[d - 1] == TS(VM_INT) ? TS(VM_INT) : TS_ANY;
+            d--;
+            break;
+
+        case OP_PUSHK:
+            stack[d++] = TS(p->constants[i.ux.ux].type);
+            break;
+
+        case OP_LOADG:
+            stack[d++] = heap ? vars[i.sx.sx] : TS_ANY;
+            break;
+
+        case OP_LOADL:
+            stack[d++] = local ? vars[i.sx.sx] : TS_ANY;
+            break;
+
+        case OP_LOADC:
+            stack[d++] = TS_ANY;
+            break;
+
+        case OP_STORG:
+        case OP_STORGK:
+        case OP_STORL:
+        case OP_STORLK:
+            if (d < 1) return false;
+
+            if ((heap && (i.stackop.op == OP_STORG || i.stackop.op == OP_STORGK))
+                    || (local && (i.stackop.op == OP_STORL || i.stackop.op == OP_STORLK))) {
+                vars[i.sx.sx] = stack[d - 1];
+            }
+
+            if (i.stackop.op == OP_STORG || i.stackop.op == OP_STORL) d--;
+            break;
+
+        // appends apply addition, other updates name their operation
+        case OP_UPDATEL:
+        case OP_UPDATEG:
+        case OP_APPENDL:
+        case OP_APPENDG:
+            if (d < 1) return false;
+
+            if ((heap && (i.stackop.op == OP_UPDATEG || i.stackop.op == OP_APPENDG))
+                    || (local && (i.stackop.op == OP_UPDATEL || i.stackop.op == OP_APPENDL))) {
+                vm_op op = i.stackop.op == OP_UPDATEL || i.stackop.op == OP_UPDATEG ? i.ax.a : OP_ADD;
+                vars[i.ax.sx] = binary_result(op, vars[i.ax.sx], stack[d - 1]);
+            }
+
+            d--;
+            break;
+
+        case OP_STORC:
+        case OP_POP:
+        case OP_RET:
+        case OP_JIF:
+        case OP_JFALSE:
+        case OP_JTRUE:
+        case OP_SWITCH:
+            if (d < 1) return false;
+            d--;
+            break;
+
+        // methods are looked up from the receiver in place of the callee
+        case OP_CALL:
+        case OP_INVOKE:
+        {
+            size_t argc = i.stackop.op == OP_CALL ? i.ux.ux : i.ax.a;
+            if (d < argc + 1) return false;
+            d -= argc;
+            stack[d - 1] = TS_ANY;
+
+            // callee may reassign globals
+            for (size_t k = 0; g->global && k < g->nvars; k++) {
+                if (g->clobbered[k]) vars[k] = TS_ANY;
+            }
+            break;
+        }
+
+        case OP_CLOSE:
+        case OP_CLOSER:
+            if (d < i.ux.ux + 1) return false;
+            d -= i.ux.ux;
+            stack[d - 1] = TS(VM_PROGRAM);
+            break;
+
+        case OP_TNEW:
+        case OP_TNEWR:
+            stack[d++] = TS(VM_TABLE);
+            break;
+
+        case OP_TPUT:
+        case OP_TUPDATE:
+            if (d < 3) return false;
+            d -= 3;
+            break;
+
+        case OP_TPUTK:
+            if (d < 3) return false;
+            d -= 2;
+            break;
+
+        case OP_JLT:
+        case OP_JLE:
+        case OP_JGT:
+        case OP_JGE:
+        case OP_JEQ:
+        case OP_JNE:
+        case OP_JNLT:
+        case OP_JNLE:
+        case OP_JNGT:
+        case OP_JNGE:
+            if (d < 2) return false;
+            d -= 2;
+            break;
+
+        case OP_TGET:
+            if (d < 2) return false;
+            stack[d - 2] = TS_ANY;
+            d--;
+            break;
+
+        // ranges of integers and booleans count in integers, any float
+        // turns the whole range into floats
+        case OP_FORPREP:
+            if (d < 3) return false;
+
+            if (((stack[d - 3] | stack[d - 2] | stack[d - 1]) & ~(TS(VM_INT) | TS(VM_BOOL))) == 0) {
+                stack[d - 3] = stack[d - 2] = stack[d - 1] = TS(VM_INT);
+            } else {
+                stack[d - 3] = stack[d - 2] = stack[d - 1] = TS(VM_INT) | TS(VM_FLOAT);
+            }
+
+            stack[d] = stack[d - 3];
+            d++;
+            break;
+
+        case OP_FORLOOP:
+            if (d < 3) return false;
+            stack[d] = stack[d - 3];
+            d++;
+            break;
+
+        // table loops push the index and key of the first entry, then
+        // every step pushes the value of the entry
+        case OP_TITER:
+            if (d < 1) return false;
+            stack[d++] = TS(VM_INT);
+            stack[d++] = TS_ANY;
+            stack[d++] = TS_ANY;
+            break;
+
+        case OP_TNEXT:
+            if (d < 3) return false;
+            stack[d - 1] = TS_ANY;
+            stack[d++] = TS_ANY;
+            break;
+
+        default:
+            return false;
+    }
+
+    *depth = d;
+    return d <= p->length;
+}
+
+// Returns the types an intrinsic built-in of one operand may produce
+typeset intrinsic_result(vm_op op)
+{
+    switch (op)
+    {
+        case OP_LEN: return TS(VM_INT);
+        case OP_SQRT: return TS(VM_FLOAT);
+        case OP_TOINT: return TS(VM_INT);
+        case OP_TOFLOAT: return TS(VM_FLOAT);
+        case OP_TOBOOL: return TS(VM_BOOL);
+        case OP_TOSTR: return TS(VM_STRING);
+        default: return TS_ANY;
+    }
+}
+
+typeset binary_result(vm_op op, typeset a, typeset b)
+{
+    typeset r = 0;
+
+    for (vm_type ta = VM_NULL; ta <= VM_TABLE; ta++) {
+        for (vm_type tb = VM_NULL; tb <= VM_TABLE; tb++) {
+            if ((a & TS(ta)) && (b & TS(tb))) r |= scalar_result(op, ta, tb);
+        }
+    }
+    return r;
+}
+
+// Result type of a binary operation between two values, mirroring the
+// arithmetic rules of value.c, or none if the operation raises an error
+typeset scalar_result(vm_op op, vm_type a, vm_type b)
+{
+    switch (op)
+    {
+        case OP_ADD:
+            if (a == VM_STRING && b == VM_STRING) return TS(VM_STRING);
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+            if (a == VM_BOOL && b == VM_BOOL) return TS(VM_BOOL);
+            if (INTEGRAL(a) && INTEGRAL(b)) return TS(VM_INT);
+            if (NUMERIC(a) && NUMERIC(b)) return TS(VM_FLOAT);
+            return 0;
+
+        case OP_MOD:
+            if (a == VM_BOOL && b == VM_BOOL) return TS(VM_BOOL);
+            if (INTEGRAL(a) && INTEGRAL(b)) return TS(VM_INT);
+            if (a == VM_STRING && b == VM_INT) return TS(VM_STRING);
+            if (a == VM_TABLE && b == VM_INT) return TS_ANY;
+            return 0;
+
+        default:
+            return TS(VM_BOOL);
+    }
+}
+
+// ------------------ REWRITING ------------------
+
+void specialise_binary(cfg* g, size_t pc, typeset a, typeset b)
+{
+    boolean ints = a == TS(VM_INT) && b == TS(VM_INT);
+    boolean floats = a == TS(VM_FLOAT) && b == TS(VM_FLOAT);
+
+    if (ints && strength_reduce(g, pc)) {
+        return;
+    }
+
+    for (size_t i = 0; i < sizeof(specialisations) / sizeof(struct specialisation); i++)
+    {
+        struct specialisation* s = &specialisations[i];
+
+        if (s->generic != g->p->code[pc].stackop.op) {
+            continue;
+        }
+
+        if (ints && s->int_op != OP_NOP) {
+            g->p->code[pc].stackop.op = s->int_op;
+        } else if (floats && s->float_op != OP_NOP) {
+            g->p->code[pc].stackop.op = s->float_op;
+        }
+        return;
+    }
+}
+
+// Rewrites integer multiplication or modulo by a constant power of two
+// pushed immediately before into a shift or mask with the exponent inline
+boolean strength_reduce(cfg* g, size_t pc)
+{
+    program* p = g->p;
+    vm_op op = p->code[pc].stackop.op;
+
+    if ((op != OP_MUL && op != OP_MOD) || pc == 0 || g->block_of[pc - 1] != g->block_of[pc]
+            || p->code[pc - 1].stackop.op != OP_PUSHK) {
+        return false;
+    }
+
+    Value k = p->constants[p->code[pc - 1].ux.ux];
+
+    if (k.type != VM_INT || k.value.to_int < 2 || (k.value.to_int & (k.value.to_int - 1)) != 0) {
+        return false;
+    }
+
+    uint16_t exponent = 0;
+    while ((1L << exponent) != k.value.to_int) exponent++;
+
+    p->code[pc - 1].stackop.op = OP_NOP;
+    p->code[pc].ux.op = op == OP_MUL ? OP_ISHL : OP_IMODP;
+    p->code[pc].ux.ux = exponent;
+
+    return true;
+}
+
+// Replaces stores to locals which are overwritten or go out of scope
+// before being loaded again
+void eliminate_dead_stores(cfg* g)
+{
+    boolean* live = malloc(sizeof(boolean) * (g->nvars + 1));
+
+    for (size_t i = 0; i < g->size; i++)
+    {
+        block* b = &g->blocks[i];
+
+        if (!b->visited) {
+            continue;
+        }
+
+        memcpy(live, b->live, sizeof(boolean) * g->nvars);
+
+        for (size_t pc = b->end; pc-- > b->start;)
+        {
+            instruction* ins = &g->p->code[pc];
+
+            if (ins->sx.sx < 0 || ins->sx.sx >= g->nvars) {
+                continue;
+            }
+
+            if (ins->stackop.op == OP_LOADL || ins->stackop.op == OP_UPDATEL) {
+                live[ins->sx.sx] = true;
+            } else if (ins->stackop.op == OP_APPENDL) {
+                live[ins->ax.sx] = live[ins->ax.a] = true;
+            } else if (ins->stackop.op == OP_STORL || ins->stackop.op == OP_STORLK) {
+                if (!live[ins->sx.sx]) {
+                    ins->stackop.op = ins->stackop.op == OP_STORL ? OP_POP : OP_NOP;
+                }
+                live[ins->sx.sx] = false;
+            }
+        }
+    }
+
+    free(live);
+}
+
+// ------------------ UTILITY METHODS ------------------
+
+// Computes the locals live on entry to a block from those live at its exit
+void live_at_entry(cfg* g, block* b, boolean* live)
+{
+    memcpy(live, b->live, sizeof(boolean) * g->nvars);
+
+    for (size_t pc = b->end; pc-- > b->start;)
+    {
+        instruction i = g->p->code[pc];
+
+        if (i.sx.sx < 0 || i.sx.sx >= g->nvars) {
+            continue;
+        } else if (i.stackop.op == OP_LOADL || i.stackop.op == OP_UPDATEL) {
+            live[i.sx.sx] = true;
+        } else if (i.stackop.op == OP_APPENDL) {
+            live[i.ax.sx] = live[i.ax.a] = true;
+        } else if (i.stackop.op == OP_STORL || i.stackop.op == OP_STORLK) {
+            live[i.sx.sx] = false;
+        }
+    }
+}
+
+// Flags global slots stored to by any function nested within program
+void collect_clobbered(program* p, boolean* clobbered, size_t nvars)
+{
+    for (size_t i = 0; i < p->constant_table.size; i++)
+    {
+        Value c = p->constants[i];
+
+        if (c.type != VM_PROGRAM || c.value.to_code->p->native != NULL) {
+            continue;
+        }
+
+        program* f = c.value.to_code->p;
+
+        // deferred functions have no code yet, any global they assign to
+        // by name is taken to be stored to
+        if (f->deferred != NULL) {
+            program* global = f;
+            while (global->prev != NULL) global = global->prev;
+
+            collect_assigned_globals(f->deferred, global, clobbered, nvars);
+            continue;
+        }
+
+        for (size_t pc = 0; pc < f->length; pc++)
+        {
+            instruction ins = f->code[pc];
+
+            if ((ins.stackop.op == OP_STORG || ins.stackop.op == OP_STORGK || ins.stackop.op == OP_UPDATEG || ins.stackop.op == OP_APPENDG)
+                    && ins.sx.sx >= 0 && ins.sx.sx < nvars) {
+                clobbered[ins.sx.sx] = true;
+            }
+        }
+
+        collect_clobbered(f, clobbered, nvars);
+    }
+}
+
+// Flags global slots named by assignments within a syntax tree
+void collect_assigned_globals(astnode* node, program* global, boolean* clobbered, size_t nvars)
+{
+    if (node == NULL) {
+        return;
+    }
+
+    if (node->type == AST_ASSIGN) {
+        int address = idmap_get(&global->symbol_table, node->sym);
+        if (address >= 0 && address < nvars) clobbered[address] = true;
+    }
+
+    for (size_t i = 0; i < node->children.size; i++) {
+        collect_assigned_globals(vector_get(&node->children, i), global, clobbered, nvars);
+    }
+}
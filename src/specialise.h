@@ -0,0 +1,85 @@
+#ifndef HE_SPECIALISE_HEADER
+#define HE_SPECIALISE_HEADER
+
+#include "common.h"
+#include "datatypes.h"
+#include "compiler.h"
+
+// Set of value types a stack slot or variable may hold, one bit per vm_type
+typedef uint8_t typeset;
+
+#define TS(t) ((typeset) (1 << (t)))
+#define TS_ANY ((typeset) 0x7f)
+
+typedef struct block {
+    size_t start;
+    size_t end;
+    size_t* succ;
+    size_t nsucc;
+
+    boolean visited;
+    size_t depth;
+    typeset* stack;
+    typeset* vars;
+    boolean* live;
+} block;
+
+typedef struct cfg {
+    program* p;
+    block* blocks;
+    size_t size;
+    size_t* block_of;
+    size_t nvars;
+    boolean global;
+    boolean* clobbered;
+} cfg;
+
+/**
+ * @brief Runs type inference over the bytecode of a program and rewrites
+ *      arithmetic and comparisons whose operand types are proven into
+ *      guard-free int or float operations. Integer multiplication and
+ *      modulo by constant powers of two are strength reduced, and stores
+ *      to function locals that are never read again are removed. Must run
+ *      before the peephole pass, which compacts the no-ops left behind.
+ *
+ * @param p Reference to program
+ */
+void specialise(program* p);
+
+/**
+ * @brief Splits the bytecode of a program into basic blocks and links
+ *      each block to its successors. Variables tracked by the graph are
+ *      the heap slots of the global program, or the stack locals of a
+ *      function.
+ *
+ * @param p Reference to program
+ * @return Control flow graph
+ */
+cfg cfg_build(program* p);
+
+/**
+ * @brief Propagates value types forward through the control flow graph
+ *      until a fixed point is reached. Calls invalidate the globals which
+ *      any function body may assign.
+ *
+ * @param g Reference to control flow graph
+ * @return False if stack depths disagree where control flow merges
+ */
+boolean cfg_infer_types(cfg* g);
+
+/**
+ * @brief Computes the function locals live at the exit of each block by
+ *      backwards propagation of loads through the control flow graph.
+ *
+ * @param g Reference to control flow graph
+ */
+void cfg_liveness(cfg* g);
+
+/**
+ * @brief Frees the blocks and analysis results of a control flow graph.
+ *
+ * @param g Reference to control flow graph
+ */
+void cfg_delete(cfg* g);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef HE_SUPERINSTRUCTIONS_HEADER
+#define HE_SUPERINSTRUCTIONS_HEADER
+
+// Generated by tools/superinstructions.c from opcode pair counts dumped
+// with --dump-opcode-pairs, regenerate with make superinstructions.
+// Each entry fuses two adjacent operations into a single dispatch.
+
+#define SUPERINSTRUCTIONS(X) \
+    X(LOADG, LOADG) /* 774 */ \
+    X(LOADG, JLE) /* 369 */ \
+    X(LOADG, PUSHK) /* 285 */ \
+    X(PUSHK, TPUT) /* 276 */ \
+    X(TPUT, LOADG) /* 175 */ \
+    X(TPUT, PUSHK) /* 100 */ \
+    X(LOADG, TGET) /* 99 */ \
+    X(TGET, JFALSE) /* 99 */ \
+    X(POP, LOADG) /* 27 */ \
+    X(LOADG, JNLE) /* 27 */ \
+    X(STORGK, LOADG) /* 27 */ \
+    X(TOSTR, ADD) /* 26 */
+
+#endif
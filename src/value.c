@@ -1,6 +1,7 @@
 #include "value.h"
 
 void runtimeerr(virtual_machine* vm, const char* msg);
+size_t jump_table_slot(jump_table* t, Value k);
 
 const char* vm_type_strings[] = {
     "Null",
@@ -14,13 +15,13 @@ const char* vm_type_strings[] = {
 
 Value value_from_node(astnode* node)
 {
-    Value v;
+    Value v = {};
     
     switch (node->type)
     {
         case AST_INTEGER:
             v.type = VM_INT;
-            v.value.to_int = atoi(node->value);
+            v.value.to_int = atol(node->value);
             break;
         
         case AST_FLOAT:
@@ -383,13 +384,36 @@ Value vTable(size_t init_capacity)
     v.value.to_table->capacity = init_capacity;
     v.value.to_table->size = 0;
     v.value.to_table->pairs = calloc(init_capacity, 2 * sizeof(Value));
+    v.value.to_table->region = false;
+
+    return v;
+}
+
+Value vTableAt(void* memory, size_t init_capacity)
+{
+    Value v = {
+        .type = VM_TABLE,
+        .value.to_table = memory
+    };
+
+    v.value.to_table->capacity = init_capacity;
+    v.value.to_table->size = 0;
+    v.value.to_table->pairs = (struct pair*) (v.value.to_table + 1);
+    v.value.to_table->region = true;
 
     return v;
 }
 
 void _vTable_resize(Table* t, size_t new_capacity)
 {
-    t->pairs = realloc(t->pairs, 2 * sizeof(Value) * new_capacity);
+    if (t->region) {
+        struct pair* pairs = calloc(new_capacity, 2 * sizeof(Value));
+        memcpy(pairs, t->pairs, sizeof(struct pair) * (t->size < new_capacity ? t->size : new_capacity));
+        t->pairs = pairs;
+        t->region = false;
+    } else {
+        t->pairs = realloc(t->pairs, 2 * sizeof(Value) * new_capacity);
+    }
     
     if (t->pairs) {
         t->capacity = new_capacity;
@@ -410,12 +434,16 @@ Value vTableGet(Table* t, Value k)
 }
 
 void vTablePut(Table* t, Value k, Value v)
+{
+    *vTableRef(t, k) = v;
+}
+
+Value* vTableRef(Table* t, Value k)
 {
     for (size_t i = 0; i < t->size; i++) 
     {
         if (vEqual(t->pairs[i].key, k).value.to_bool) {
-            t->pairs[i].value = v;
-            return;
+            return &t->pairs[i].value;
         }
     }
 
@@ -424,9 +452,8 @@ void vTablePut(Table* t, Value k, Value v)
     }
 
     t->pairs[t->size].key = k;
-    t->pairs[t->size].value = v;
-    t->size++;
-    return;
+    t->pairs[t->size].value = vNull();
+    return &t->pairs[t->size++].value;
 }
 
 Value vTableRm(Table* t, Value k)
@@ -461,5 +488,199 @@ Value vTableRm(Table* t, Value k)
 
 void vTableDelete(Table* t) 
 {
-    free(t->pairs);
-}
\ No newline at end of file
+    if (!t->region) free(t->pairs);
+}
+
+// --------------- STRING BUFFERS ---------------
+
+void vAppend(Value* a, Value* buffer, Value b)
+{
+    if (a->type != VM_STRING || b.type != VM_STRING) {
+        *a = vAdd(*a, b);
+        return;
+    }
+
+    size_t n = strlen(b.value.to_str);
+    string_buffer* s;
+
+    if (buffer->type == VM_STRING && buffer->value.to_str == a->value.to_str) {
+        s = (string_buffer*) a->value.to_str - 1;
+    } else {
+        size_t length = strlen(a->value.to_str);
+
+        s = malloc(sizeof(string_buffer) + length + 1);
+        s->capacity = s->length = length;
+        memcpy(s->chars, a->value.to_str, length + 1);
+    }
+
+    if (s->length + n > s->capacity)
+    {
+        // a string appended to itself moves with the buffer
+        boolean self = b.value.to_str == s->chars;
+        size_t capacity = 2 * (s->length + n);
+
+        s = realloc(s, sizeof(string_buffer) + capacity + 1);
+
+        if (s == NULL) {
+            runtimeerr(current_vm, "Failed to resize string!");
+        }
+
+        s->capacity = capacity;
+
+        if (self) {
+            b.value.to_str = s->chars;
+        }
+    }
+
+    memmove(s->chars + s->length, b.value.to_str, n + 1);
+    s->length += n;
+    *a = *buffer = vString(s->chars);
+}
+
+// ------------- SWITCH JUMP TABLE --------------
+
+jump_table* jump_table_new(Value* keys, size_t count)
+{
+    jump_table* t = malloc(sizeof(jump_table));
+    t->type = keys[0].type;
+    t->count = count;
+    t->dense = false;
+    t->keys = NULL;
+
+    long min = keys[0].value.to_int, max = keys[0].value.to_int;
+
+    for (size_t i = 0; t->type == VM_INT && i < count; i++) {
+        if (keys[i].value.to_int < min) min = keys[i].value.to_int;
+        if (keys[i].value.to_int > max) max = keys[i].value.to_int;
+    }
+
+    // integer keys spanning at most twice their number are indexed directly
+    if (t->type == VM_INT && (unsigned long) max - (unsigned long) min < 2 * count)
+    {
+        t->dense = true;
+        t->base = min;
+        t->capacity = (unsigned long) max - (unsigned long) min + 1;
+        t->cases = malloc(sizeof(uint16_t) * t->capacity);
+
+        for (size_t i = 0; i < t->capacity; i++) t->cases[i] = count;
+
+        for (size_t i = count; i-- > 0;) {
+            t->cases[(unsigned long) keys[i].value.to_int - (unsigned long) min] = i;
+        }
+
+        return t;
+    }
+
+    // open addressing with linear probing, at most half full
+    for (t->capacity = 4; t->capacity < 2 * count; t->capacity *= 2);
+
+    t->keys = calloc(t->capacity, sizeof(Value));
+    t->cases = malloc(sizeof(uint16_t) * t->capacity);
+
+    for (size_t i = 0; i < t->capacity; i++) t->cases[i] = count;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t s = jump_table_slot(t, keys[i]);
+
+        while (t->cases[s] != count && !vEqual(t->keys[s], keys[i]).value.to_bool) {
+            s = (s + 1) & (t->capacity - 1);
+        }
+
+        if (t->cases[s] == count) {
+            t->keys[s] = keys[i];
+            t->cases[s] = i;
+        }
+    }
+
+    return t;
+}
+
+jump_table* jump_table_copy(jump_table* t)
+{
+    jump_table* copy = malloc(sizeof(jump_table));
+    *copy = *t;
+
+    copy->cases = malloc(sizeof(uint16_t) * t->capacity);
+    memcpy(copy->cases, t->cases, sizeof(uint16_t) * t->capacity);
+
+    if (t->keys != NULL) {
+        copy->keys = malloc(sizeof(Value) * t->capacity);
+        memcpy(copy->keys, t->keys, sizeof(Value) * t->capacity);
+    }
+
+    return copy;
+}
+
+size_t jump_table_find(jump_table* t, Value k)
+{
+    // booleans and whole floats equal integer keys, like vEqual
+    if (t->type == VM_INT)
+    {
+        if (k.type == VM_BOOL) {
+            k = vInt(k.value.to_bool);
+        } else if (k.type == VM_FLOAT && fabs(k.value.to_float) < 1e18 && k.value.to_float == floor(k.value.to_float)) {
+            k = vInt((long) k.value.to_float);
+        } else if (k.type != VM_INT) {
+            return t->count;
+        }
+
+        if (t->dense) {
+            unsigned long index = (unsigned long) k.value.to_int - (unsigned long) t->base;
+            return index < t->capacity ? t->cases[index] : t->count;
+        }
+    }
+    else if (k.type != VM_STRING) {
+        return t->count;
+    }
+
+    for (size_t s = jump_table_slot(t, k); t->cases[s] != t->count; s = (s + 1) & (t->capacity - 1))
+    {
+        if (vEqual(t->keys[s], k).value.to_bool) {
+            return t->cases[s];
+        }
+    }
+
+    return t->count;
+}
+
+// Returns the first slot of a hashed key in a table of capacity slots
+size_t jump_table_slot(jump_table* t, Value k)
+{
+    size_t hash = t->type == VM_STRING ? strhash(k.value.to_str) : (size_t) k.value.to_int * 0x9e3779b97f4a7c15;
+    return (hash ^ (hash >> 29)) & (t->capacity - 1);
+}
+
+// ---------------- METHOD CACHE ----------------
+
+invoke_cache* invoke_cache_new(Value key)
+{
+    invoke_cache* c = calloc(1, sizeof(invoke_cache));
+    c->key = key;
+    return c;
+}
+
+Value invoke_cache_find(invoke_cache* c, Table* t)
+{
+    for (size_t i = 0; i < INVOKE_CACHE_ENTRIES; i++)
+    {
+        size_t index = c->entries[i].index;
+
+        if (index < t->size && t->pairs[index].key.type == VM_STRING && t->pairs[index].key.value.to_str == c->entries[i].key) {
+            return t->pairs[index].value;
+        }
+    }
+
+    for (size_t i = 0; i < t->size; i++)
+    {
+        if (vEqual(t->pairs[i].key, c->key).value.to_bool)
+        {
+            c->entries[c->next].key = t->pairs[i].key.value.to_str;
+            c->entries[c->next].index = i;
+            c->next = (c->next + 1) % INVOKE_CACHE_ENTRIES;
+            return t->pairs[i].value;
+        }
+    }
+
+    return vNull();
+}
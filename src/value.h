@@ -14,8 +14,8 @@ typedef struct Value Value;
 typedef struct Table Table;
 typedef struct virtual_machine virtual_machine;
 
-// Globally accessible virtual machine instance
-extern virtual_machine* current_vm;
+// Virtual machine running on the calling thread
+extern __thread virtual_machine* current_vm;
 
 // ------------------ VM TYPES ------------------
 
@@ -211,6 +211,7 @@ typedef struct Table {
 
     size_t capacity;
     size_t size;
+    boolean region; // pairs are not owned and are copied out on resize
 } Table;
 
 /**
@@ -221,6 +222,16 @@ typedef struct Table {
  */
 Value vTable(size_t init_capacity);
 
+/**
+ * @brief Constructs an empty table in memory provided by the caller,
+ *      large enough for the table followed by its initial pairs.
+ * 
+ * @param memory Zeroed memory holding the table
+ * @param init_capacity Initial size of table
+ * @return Value containing reference to table
+ */
+Value vTableAt(void* memory, size_t init_capacity);
+
 /**
  * @brief Inserts new key-value pair into table
  * 
@@ -239,6 +250,17 @@ void vTablePut(Table* t, Value k, Value v);
  */
 Value vTableGet(Table* t, Value k);
 
+/**
+ * @brief Retrieves the value slot of a key, inserting the key with a null
+ *      value if absent, so that an element can be updated with a single
+ *      lookup. The slot is invalidated by further insertions.
+ * 
+ * @param t Reference to table
+ * @param k Key value
+ * @return Reference to mapped value
+ */
+Value* vTableRef(Table* t, Value k);
+
 /**
  * @brief Removes value from table by key.
  * 
@@ -256,4 +278,104 @@ Value vTableRm(Table* t, Value k);
  */
 void vTableDelete(Table* t);
 
-#endif
\ No newline at end of file
+// --------------- STRING BUFFERS --------------
+
+// string with room to grow, values refer to its characters
+typedef struct string_buffer {
+    size_t capacity;
+    size_t length;
+    char chars[];
+} string_buffer;
+
+/**
+ * @brief Appends value b to the variable a. If a holds the string last
+ *      grown in buffer it is extended in place, otherwise it is copied
+ *      into a new buffer first. Capacity doubles when exhausted, so that
+ *      repeated appends take amortised linear time. The string held by a
+ *      must not be shared with any other value. Values other than two
+ *      strings are added instead.
+ * 
+ * @param a Variable appended to
+ * @param buffer Variable recording the buffer last grown for a
+ * @param b Value to append
+ */
+void vAppend(Value* a, Value* buffer, Value b);
+
+// -------------- SWITCH JUMP TABLE ------------
+
+typedef struct jump_table {
+    vm_type type;       // type of every case key, VM_INT or VM_STRING
+    boolean dense;      // integer keys are indexed directly from base
+    long base;
+    size_t capacity;    // range of dense keys or number of hashed slots
+    Value* keys;        // hashed slots, null when empty
+    uint16_t* cases;    // case of each slot, count when empty
+    uint16_t count;
+} jump_table;
+
+/**
+ * @brief Builds the lookup table of a switch over constant keys of one
+ *      type. Integer keys close together are indexed directly, other
+ *      keys are hashed. Repeated keys map to their first case.
+ * 
+ * @param keys Case keys, all VM_INT or all VM_STRING
+ * @param count Number of cases
+ * @return Reference to jump table
+ */
+jump_table* jump_table_new(Value* keys, size_t count);
+
+/**
+ * @brief Finds the case whose key is equal to a value, with the same
+ *      equality as the == operator.
+ * 
+ * @param t Reference to jump table
+ * @param k Switched value
+ * @return Index of the matching case, or the number of cases if none
+ */
+size_t jump_table_find(jump_table* t, Value k);
+
+/**
+ * @brief Copies a jump table, so that each program owns the tables of
+ *      its switches.
+ * 
+ * @param t Reference to jump table
+ * @return Reference to the copy
+ */
+jump_table* jump_table_copy(jump_table* t);
+
+// ---------------- METHOD CACHE ----------------
+
+#define INVOKE_CACHE_ENTRIES 4
+
+typedef struct invoke_cache {
+    Value key;          // string key of the method
+    struct {
+        const char* key;    // key string stored by a table holding the method
+        size_t index;       // index of the method entry in that table
+    } entries[INVOKE_CACHE_ENTRIES];
+    size_t next;        // entry replaced on the next miss
+} invoke_cache;
+
+/**
+ * @brief Builds the method cache of a call site looking up a constant
+ *      string key.
+ * 
+ * @param key Method key
+ * @return Reference to method cache
+ */
+invoke_cache* invoke_cache_new(Value key);
+
+/**
+ * @brief Retrieves the method of a table through the cache. Tables built
+ *      alike store their keys at the same index and share the key strings
+ *      of the code which inserted them, so an entry hits whenever the key
+ *      at its index is its string. Misses search the table and replace an
+ *      entry, so a site may hit for tables of several layouts.
+ * 
+ * @param c Reference to method cache
+ * @param t Reference to table
+ * @return Method, or null if the table has no such key
+ */
+Value invoke_cache_find(invoke_cache* c, Table* t);
+
+#endif
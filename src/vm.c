@@ -1,14 +1,23 @@
 #include "vm.h"
+#include "image.h"
+
+// forward declarations
+void dispatch(virtual_machine* vm, call_info* call, code_object* code);
+void dispatch_counting_pairs(virtual_machine* vm, call_info* call, code_object* code);
+void print_trace_line(program* p, line_entry* e);
+
+__thread virtual_machine* current_vm = NULL;
 
 void run_program(virtual_machine* vm, call_info* prev, code_object* code)
 {
     size_t ci = ++vm->ci;
 
     vm->call_stack[ci].program = code;
-    vm->call_stack[ci].pc = 0;
+    vm->call_stack[ci].pc = prev == NULL ? vm->entry : 0;
     vm->call_stack[ci].bp = prev == NULL ? 0 : prev->tp;
     vm->call_stack[ci].sp = prev == NULL ? 0 : prev->tp + code->p->symbol_table.size;
     vm->call_stack[ci].tp = prev == NULL ? 0 : prev->tp + code->p->symbol_table.size;
+    vm->call_stack[ci].region_mark = vm->region_top;
     vm->call_stack[ci].prev = prev;
 
     call_info* call = &vm->call_stack[ci];
@@ -19,135 +28,402 @@ void run_program(virtual_machine* vm, call_info* prev, code_object* code)
         runtimeerr(vm, "Stack overflow!");
     }
 
-    if (code->p->native != NULL) 
-    {
-        vm->stack[call->tp++] = code->p->native(&vm->stack[call->bp]);
-        vm->stack[call->prev->tp++] = vm->stack[--call->tp];
+    // profiling is chosen once per call, keeping it out of the dispatch loop
+    if (vm->pair_counts == NULL) {
+        dispatch(vm, call, code);
+    } else {
+        dispatch_counting_pairs(vm, call, code);
     }
 
+    // releases tables and closures which never escaped the call
+    vm->region_top = call->region_mark;
+    vm->ci--;
+}
+
+void dispatch(virtual_machine* vm, call_info* call, code_object* code)
+{
     while (call->pc < code->p->length)
     {
-        decode_execute(vm, call, code->p->code[call->pc]);
+        instruction i = code->p->code[call->pc];
+        decode_execute(vm, call, i);
         
-        if (code->p->code[call->pc].stackop.op == OP_RET) {
+        if (i.stackop.op == OP_RET) {
             break;
         }
         
         call->pc++;
     }
-
-    vm->ci--;
 }
 
-void decode_execute(virtual_machine* vm, call_info* call, instruction i)
+// Runs a call as dispatch does, counting operations executed right after
+// their predecessor for --dump-opcode-pairs
+void dispatch_counting_pairs(virtual_machine* vm, call_info* call, code_object* code)
 {
-    Value v0, v1;
-    Value* closure;
+    size_t last = -1;
 
-    switch (i.stackop.op)
+    while (call->pc < code->p->length)
     {
-        case OP_NOP: break;
-        case OP_ADD:
-        case OP_SUB:
-        case OP_MUL:
-        case OP_DIV:
-        case OP_MOD:
-        case OP_AND:
-        case OP_OR:
-        case OP_LT:
-        case OP_LE:
-        case OP_GT:
-        case OP_GE:
-        case OP_EQ:
-        case OP_NE:
-            v1 = vm->stack[--call->tp];
-            v0 = vm->stack[--call->tp];
-            vm->stack[call->tp++] = apply_vm_op(i.stackop.op, v0, v1);
-            break;
-
-        case OP_NEG:
-            vm->stack[call->tp - 1] = vNegate(vm->stack[call->tp - 1]);
-            break;
-
-        case OP_NOT:
-            vm->stack[call->tp - 1] = vBool(!native_bool_cast(&vm->stack[call->tp - 1]).value.to_bool);
-            break;
-
-        case OP_PUSHK:
-            vm->stack[call->tp++] = call->program->p->constants[i.ux.ux];
-            
-            if (call->tp >= MAX_STACK_SIZE) runtimeerr(vm, "Stack overflow!");
-            break;
+        instruction i = code->p->code[call->pc];
 
-        case OP_STORG:
-            vm->heap[i.sx.sx] = vm->stack[--call->tp];
+        if (last + 1 == call->pc) {
+            vm->pair_counts[code->p->code[last].stackop.op * VM_BASE_OPS + i.stackop.op]++;
+        }
 
-            if (i.sx.sx >= MAX_HEAP_SIZE) runtimeerr(vm, "Stack overflow!");
+        last = call->pc;
+        decode_execute(vm, call, i);
+        
+        if (i.stackop.op == OP_RET) {
             break;
+        }
+        
+        call->pc++;
+    }
+}
 
-        case OP_LOADG:
-            vm->stack[call->tp++] = vm->heap[i.sx.sx];
+void* region_alloc(virtual_machine* vm, size_t size)
+{
+    size = (size + 7) & ~(size_t) 7;
 
-            if (call->tp >= MAX_STACK_SIZE) runtimeerr(vm, "Stack overflow!");
-            break;
-        
-        case OP_STORL:
-            vm->stack[call->bp + i.sx.sx] = vm->stack[--call->tp];
+    if (vm->region_top + size > MAX_REGION_SIZE) {
+        return calloc(1, size);
+    }
 
-            if (call->bp + i.sx.sx >= MAX_STACK_SIZE) runtimeerr(vm, "Stack overflow!");
-            break;
-        
-        case OP_LOADL:
-            vm->stack[call->tp++] = vm->stack[call->bp + i.sx.sx];
+    void* memory = &vm->region[vm->region_top];
+    vm->region_top += size;
+    memset(memory, 0, size);
+    return memory;
+}
 
-            if (call->tp >= MAX_STACK_SIZE) runtimeerr(vm, "Stack overflow!");
-            break;
-        
-        case OP_STORC:
-            call->program->closure[i.ux.ux] = vm->stack[--call->tp];
-            break;
+void dump_opcode_pairs(const char* path, size_t* counts)
+{
+    FILE* file = fopen(path, "a");
+
+    if (file == NULL) {
+        failure("Failed to open opcode pair dump!");
+    }
 
-        case OP_LOADC:
-            vm->stack[call->tp++] = call->program->closure[i.ux.ux];
+    // selects the most frequent remaining pair until all are written
+    for (;;)
+    {
+        size_t best = 0;
 
-            if (call->tp >= MAX_STACK_SIZE) runtimeerr(vm, "Stack overflow!");
+        for (size_t i = 1; i < VM_BASE_OPS * VM_BASE_OPS; i++) {
+            if (counts[i] > counts[best]) best = i;
+        }
+
+        if (counts[best] == 0) {
             break;
+        }
 
-        case OP_CALL:
-            if (vm->stack[--call->tp].type != VM_PROGRAM) {
-                char msg[1000];
-                msg[0] = '\0';
-                sprintf(msg, "Cannot call value %s, expected function type!", value_to_str(&vm->stack[call->tp]));
-                runtimeerr(vm, msg);
-            }
+        char a[16], b[16];
+        sscanf(operation_strings[best / VM_BASE_OPS], "%15s", a);
+        sscanf(operation_strings[best % VM_BASE_OPS], "%15s", b);
+        fprintf(file, "%lu %s %s\n", counts[best], a, b);
+        counts[best] = 0;
+    }
 
-            code_object* code = vm->stack[call->tp].value.to_code;
+    fclose(file);
+}
 
-            call->tp -= code->p->argc;
+// operands of specialised operations are known to be of matching type
+#define INT_ARITH(op) call->tp--; \
+    vm->stack[call->tp - 1].value.to_int = vm->stack[call->tp - 1].value.to_int op vm->stack[call->tp].value.to_int
+#define FLOAT_ARITH(op) call->tp--; \
+    vm->stack[call->tp - 1].value.to_float = vm->stack[call->tp - 1].value.to_float op vm->stack[call->tp].value.to_float
+#define INT_COMPARE(op) call->tp--; \
+    vm->stack[call->tp - 1] = vBool(vm->stack[call->tp - 1].value.to_int op vm->stack[call->tp].value.to_int)
+#define FLOAT_COMPARE(op) call->tp--; \
+    vm->stack[call->tp - 1] = vBool(vm->stack[call->tp - 1].value.to_float op vm->stack[call->tp].value.to_float)
+
+// handlers of straight-line operations and jumps, shared by the fused
+// handlers of superinstructions
+#define NUMERIC_TYPE(t) ((t) == VM_INT || (t) == VM_FLOAT || (t) == VM_BOOL)
+
+#define GENERIC_BINARY(op) v1 = vm->stack[--call->tp]; \
+    v0 = vm->stack[--call->tp]; \
+    vm->stack[call->tp++] = apply_vm_op(op, v0, v1)
+#define COMPARE_BRANCH(op) call->tp -= 2; \
+    if (compare_branch(op, vm->stack[call->tp], vm->stack[call->tp + 1])) call->pc += i.sx.sx
+
+#define EXEC_NOP(i)
+#define EXEC_ADD(i) GENERIC_BINARY(OP_ADD)
+#define EXEC_SUB(i) GENERIC_BINARY(OP_SUB)
+#define EXEC_MUL(i) GENERIC_BINARY(OP_MUL)
+#define EXEC_DIV(i) GENERIC_BINARY(OP_DIV)
+#define EXEC_MOD(i) GENERIC_BINARY(OP_MOD)
+#define EXEC_EQ(i) GENERIC_BINARY(OP_EQ)
+#define EXEC_NE(i) GENERIC_BINARY(OP_NE)
+#define EXEC_LT(i) GENERIC_BINARY(OP_LT)
+#define EXEC_LE(i) GENERIC_BINARY(OP_LE)
+#define EXEC_GT(i) GENERIC_BINARY(OP_GT)
+#define EXEC_GE(i) GENERIC_BINARY(OP_GE)
+#define EXEC_IADD(i) INT_ARITH(+)
+#define EXEC_ISUB(i) INT_ARITH(-)
+#define EXEC_IMUL(i) INT_ARITH(*)
+#define EXEC_ILT(i) INT_COMPARE(<)
+#define EXEC_ILE(i) INT_COMPARE(<=)
+#define EXEC_IGT(i) INT_COMPARE(>)
+#define EXEC_IGE(i) INT_COMPARE(>=)
+#define EXEC_IEQ(i) INT_COMPARE(==)
+#define EXEC_INE(i) INT_COMPARE(!=)
+#define EXEC_FADD(i) FLOAT_ARITH(+)
+#define EXEC_FSUB(i) FLOAT_ARITH(-)
+#define EXEC_FMUL(i) FLOAT_ARITH(*)
+#define EXEC_FLT(i) FLOAT_COMPARE(<)
+#define EXEC_FLE(i) FLOAT_COMPARE(<=)
+#define EXEC_FGT(i) FLOAT_COMPARE(>)
+#define EXEC_FGE(i) FLOAT_COMPARE(>=)
+
+#define EXEC_FDIV(i) \
+    if (vm->stack[call->tp - 1].value.to_float == 0.0) runtimeerr(vm, "Zero division error!"); \
+    FLOAT_ARITH(/)
+
+// shifts as unsigned to wrap on overflow like multiplication
+#define EXEC_ISHL(i) \
+    vm->stack[call->tp - 1].value.to_int = (long) ((unsigned long) vm->stack[call->tp - 1].value.to_int << i.ux.ux)
+
+// masks low bits, keeping the sign of the dividend like %
+#define EXEC_IMODP(i) { \
+    long x = vm->stack[call->tp - 1].value.to_int; \
+    long mask = (1L << i.ux.ux) - 1; \
+    long r = x & mask; \
+    vm->stack[call->tp - 1].value.to_int = x < 0 && r != 0 ? r - mask - 1 : r; }
+
+#define EXEC_NEG(i) vm->stack[call->tp - 1] = vNegate(vm->stack[call->tp - 1])
+#define EXEC_NOT(i) vm->stack[call->tp - 1] = vBool(!native_bool_cast(&vm->stack[call->tp - 1]).value.to_bool)
+
+#define EXEC_PUSHK(i) vm->stack[call->tp++] = call->program->p->constants[i.ux.ux]; \
+    if (call->tp >= MAX_STACK_SIZE) runtimeerr(vm, "Stack overflow!")
+#define EXEC_STORG(i) vm->heap[i.sx.sx] = vm->stack[--call->tp]; \
+    if (i.sx.sx >= MAX_HEAP_SIZE) runtimeerr(vm, "Stack overflow!")
+#define EXEC_LOADG(i) vm->stack[call->tp++] = vm->heap[i.sx.sx]; \
+    if (call->tp >= MAX_STACK_SIZE) runtimeerr(vm, "Stack overflow!")
+#define EXEC_STORL(i) vm->stack[call->bp + i.sx.sx] = vm->stack[--call->tp]; \
+    if (call->bp + i.sx.sx >= MAX_STACK_SIZE) runtimeerr(vm, "Stack overflow!")
+#define EXEC_LOADL(i) vm->stack[call->tp++] = vm->stack[call->bp + i.sx.sx]; \
+    if (call->tp >= MAX_STACK_SIZE) runtimeerr(vm, "Stack overflow!")
+#define EXEC_STORC(i) call->program->closure[i.ux.ux] = vm->stack[--call->tp]
+#define EXEC_LOADC(i) vm->stack[call->tp++] = call->program->closure[i.ux.ux]; \
+    if (call->tp >= MAX_STACK_SIZE) runtimeerr(vm, "Stack overflow!")
+#define EXEC_STORLK(i) vm->stack[call->bp + i.sx.sx] = vm->stack[call->tp - 1]; \
+    if (call->bp + i.sx.sx >= MAX_STACK_SIZE) runtimeerr(vm, "Stack overflow!")
+#define EXEC_STORGK(i) vm->heap[i.sx.sx] = vm->stack[call->tp - 1]; \
+    if (i.sx.sx >= MAX_HEAP_SIZE) runtimeerr(vm, "Stack overflow!")
+#define EXEC_POP(i) call->tp--
+#define EXEC_UPDATEL(i) update_value(&vm->stack[call->bp + i.ax.sx], i.ax.a, vm->stack[--call->tp])
+#define EXEC_UPDATEG(i) update_value(&vm->heap[i.ax.sx], i.ax.a, vm->stack[--call->tp])
+
+// variables appended to may equally count numbers
+#define APPEND(var, buffer) v1 = vm->stack[--call->tp]; \
+    if (v1.type == VM_STRING) vAppend(var, buffer, v1); \
+    else update_value(var, OP_ADD, v1)
+#define EXEC_APPENDL(i) APPEND(&vm->stack[call->bp + i.ax.sx], &vm->stack[call->bp + i.ax.a])
+#define EXEC_APPENDG(i) APPEND(&vm->heap[i.ax.sx], &vm->heap[i.ax.a])
+
+#define EXEC_JMP(i) call->pc += i.sx.sx
+#define EXEC_JFALSE(i) if (!native_bool_cast(&vm->stack[--call->tp]).value.to_bool) call->pc += i.sx.sx
+#define EXEC_JTRUE(i) if (native_bool_cast(&vm->stack[--call->tp]).value.to_bool) call->pc += i.sx.sx
+#define EXEC_JLT(i) COMPARE_BRANCH(OP_JLT)
+#define EXEC_JLE(i) COMPARE_BRANCH(OP_JLE)
+#define EXEC_JGT(i) COMPARE_BRANCH(OP_JGT)
+#define EXEC_JGE(i) COMPARE_BRANCH(OP_JGE)
+#define EXEC_JEQ(i) COMPARE_BRANCH(OP_JEQ)
+#define EXEC_JNE(i) COMPARE_BRANCH(OP_JNE)
+#define EXEC_JNLT(i) COMPARE_BRANCH(OP_JNLT)
+#define EXEC_JNLE(i) COMPARE_BRANCH(OP_JNLE)
+#define EXEC_JNGT(i) COMPARE_BRANCH(OP_JNGT)
+#define EXEC_JNGE(i) COMPARE_BRANCH(OP_JNGE)
+
+#define EXEC_TNEW(i) vm->stack[call->tp++] = vTable(10)
+#define EXEC_TGET(i) v0 = vm->stack[--call->tp]; \
+    if (vm->stack[call->tp - 1].type != VM_TABLE) runtimeerr(vm, "Cannot retrieve element from non-table object"); \
+    vm->stack[call->tp - 1] = vTableGet(vm->stack[call->tp - 1].value.to_table, v0)
+#define EXEC_TPUT(i) v1 = vm->stack[--call->tp]; \
+    v0 = vm->stack[--call->tp]; \
+    if (vm->stack[--call->tp].type != VM_TABLE) runtimeerr(vm, "Cannot add element to non-table object"); \
+    vTablePut(vm->stack[call->tp].value.to_table, v0, v1)
+#define EXEC_TPUTK(i) v1 = vm->stack[--call->tp]; \
+    v0 = vm->stack[--call->tp]; \
+    vTablePut(vm->stack[call->tp - 1].value.to_table, v0, v1)
+#define EXEC_TUPDATE(i) v1 = vm->stack[--call->tp]; \
+    v0 = vm->stack[--call->tp]; \
+    if (vm->stack[--call->tp].type != VM_TABLE) runtimeerr(vm, "Cannot update element of non-table object"); \
+    update_value(vTableRef(vm->stack[call->tp].value.to_table, v0), i.ax.a, v1)
+
+
+// built-ins with the common cases inlined, other types take the library path
+#define EXEC_LEN(i) v0 = vm->stack[call->tp - 1]; \
+    vm->stack[call->tp - 1] = v0.type == VM_STRING ? vInt(strlen(v0.value.to_str)) \
+        : v0.type == VM_TABLE ? vInt(v0.value.to_table->size) : native_length(&v0)
+#define EXEC_SQRT(i) v0 = vm->stack[call->tp - 1]; \
+    vm->stack[call->tp - 1] = vFloat(sqrt(v0.type == VM_FLOAT ? v0.value.to_float : v0.value.to_int))
+#define EXEC_POW(i) call->tp--; \
+    vm->stack[call->tp - 1] = native_pow(&vm->stack[call->tp - 1])
+#define EXEC_TOINT(i) v0 = vm->stack[call->tp - 1]; \
+    if (v0.type == VM_FLOAT) vm->stack[call->tp - 1] = vInt((long) v0.value.to_float); \
+    else if (v0.type != VM_INT) vm->stack[call->tp - 1] = native_int_cast(&v0)
+#define EXEC_TOFLOAT(i) v0 = vm->stack[call->tp - 1]; \
+    if (v0.type == VM_INT) vm->stack[call->tp - 1] = vFloat((double) v0.value.to_int); \
+    else if (v0.type != VM_FLOAT) vm->stack[call->tp - 1] = native_float_cast(&v0)
+#define EXEC_TOBOOL(i) v0 = vm->stack[call->tp - 1]; \
+    if (v0.type == VM_INT) vm->stack[call->tp - 1] = vBool(v0.value.to_int != 0); \
+    else if (v0.type != VM_BOOL) vm->stack[call->tp - 1] = native_bool_cast(&v0)
+#define EXEC_TOSTR(i) vm->stack[call->tp - 1] = native_str_cast(&vm->stack[call->tp - 1])
+
+// executes the first operation of a fused pair, then the second with
+// the operand left in the following instruction
+#define SUPERINSTRUCTION_CASE(a, b) case OP_##a##_##b: \
+    EXEC_##a(i); \
+    i = call->program->p->code[++call->pc]; \
+    EXEC_##b(i); \
+    break;
 
-            if (i.ux.ux == code->p->argc)
-                run_program(vm, call, code);
-            else {
-                runtimeerr(vm, "Invalid number of arguments passed to function!");
-            }
+void decode_execute(virtual_machine* vm, call_info* call, instruction i)
+{
+    Value v0, v1;
+    Value* closure;
+    code_object* code;
+
+    switch (i.stackop.op)
+    {
+        case OP_NOP: break;
+        case OP_ADD: EXEC_ADD(i); break;
+        case OP_SUB: EXEC_SUB(i); break;
+        case OP_MUL: EXEC_MUL(i); break;
+        case OP_DIV: EXEC_DIV(i); break;
+        case OP_MOD: EXEC_MOD(i); break;
+        case OP_LT: EXEC_LT(i); break;
+        case OP_LE: EXEC_LE(i); break;
+        case OP_GT: EXEC_GT(i); break;
+        case OP_GE: EXEC_GE(i); break;
+        case OP_EQ: EXEC_EQ(i); break;
+        case OP_NE: EXEC_NE(i); break;
+
+        case OP_IADD: EXEC_IADD(i); break;
+        case OP_ISUB: EXEC_ISUB(i); break;
+        case OP_IMUL: EXEC_IMUL(i); break;
+        case OP_ILT: EXEC_ILT(i); break;
+        case OP_ILE: EXEC_ILE(i); break;
+        case OP_IGT: EXEC_IGT(i); break;
+        case OP_IGE: EXEC_IGE(i); break;
+        case OP_IEQ: EXEC_IEQ(i); break;
+        case OP_INE: EXEC_INE(i); break;
+        case OP_FADD: EXEC_FADD(i); break;
+        case OP_FSUB: EXEC_FSUB(i); break;
+        case OP_FMUL: EXEC_FMUL(i); break;
+        case OP_FDIV: EXEC_FDIV(i); break;
+        case OP_FLT: EXEC_FLT(i); break;
+        case OP_FLE: EXEC_FLE(i); break;
+        case OP_FGT: EXEC_FGT(i); break;
+        case OP_FGE: EXEC_FGE(i); break;
+        case OP_ISHL: EXEC_ISHL(i); break;
+        case OP_IMODP: EXEC_IMODP(i); break;
+
+        case OP_NEG: EXEC_NEG(i); break;
+        case OP_NOT: EXEC_NOT(i); break;
+
+        case OP_PUSHK: EXEC_PUSHK(i); break;
+        case OP_STORG: EXEC_STORG(i); break;
+        case OP_LOADG: EXEC_LOADG(i); break;
+        case OP_STORL: EXEC_STORL(i); break;
+        case OP_LOADL: EXEC_LOADL(i); break;
+        case OP_STORC: EXEC_STORC(i); break;
+        case OP_LOADC: EXEC_LOADC(i); break;
+        case OP_STORLK: EXEC_STORLK(i); break;
+        case OP_STORGK: EXEC_STORGK(i); break;
+        case OP_POP: EXEC_POP(i); break;
+        case OP_UPDATEL: EXEC_UPDATEL(i); break;
+        case OP_UPDATEG: EXEC_UPDATEG(i); break;
+        case OP_APPENDL: EXEC_APPENDL(i); break;
+        case OP_APPENDG: EXEC_APPENDG(i); break;
+
+        case OP_CALL:
+            call_value(vm, call, i.ux.ux);
+            break;
+
+        case OP_INVOKE:
+            // the receiver is replaced by its method, then called
+            if (vm->stack[call->tp - 1].type != VM_TABLE) runtimeerr(vm, "Cannot retrieve element from non-table object");
+            vm->stack[call->tp - 1] = invoke_cache_find(vector_get(&call->program->p->invoke_caches, i.ax.sx), vm->stack[call->tp - 1].value.to_table);
+            call_value(vm, call, i.ax.a);
             break;
         
         case OP_RET:
             vm->stack[call->prev->tp++] = vm->stack[--call->tp];
             break;
         
-        case OP_POP:
-            call->tp--;
-            break;
-        
         case OP_JIF:
             if (native_bool_cast(&vm->stack[--call->tp]).value.to_bool) {
                 call->pc++;
             }
             break;
 
-        case OP_JMP:
-            call->pc += i.sx.sx;
+        case OP_JMP: EXEC_JMP(i); break;
+        case OP_JFALSE: EXEC_JFALSE(i); break;
+        case OP_JTRUE: EXEC_JTRUE(i); break;
+        case OP_JLT: EXEC_JLT(i); break;
+        case OP_JLE: EXEC_JLE(i); break;
+        case OP_JGT: EXEC_JGT(i); break;
+        case OP_JGE: EXEC_JGE(i); break;
+        case OP_JEQ: EXEC_JEQ(i); break;
+        case OP_JNE: EXEC_JNE(i); break;
+        case OP_JNLT: EXEC_JNLT(i); break;
+        case OP_JNLE: EXEC_JNLE(i); break;
+        case OP_JNGT: EXEC_JNGT(i); break;
+        case OP_JNGE: EXEC_JNGE(i); break;
+
+        case OP_FORPREP:
+            if (!for_prepare(vm, &vm->stack[call->tp - 3])) call->pc += i.sx.sx;
+            vm->stack[call->tp] = vm->stack[call->tp - 3];
+
+            if (++call->tp >= MAX_STACK_SIZE) runtimeerr(vm, "Stack overflow!");
+            break;
+
+        case OP_FORLOOP:
+            // integer loops count down the remaining iterations instead
+            // of comparing against the limit, so they never overflow
+            v0 = vm->stack[call->tp - 2];
+            v1 = vm->stack[call->tp - 1];
+
+            if (vm->stack[call->tp - 3].type == VM_INT) {
+                if (v0.value.to_int != 0) {
+                    vm->stack[call->tp - 2].value.to_int = (long) ((unsigned long) v0.value.to_int - 1);
+                    vm->stack[call->tp - 3].value.to_int = (long) ((unsigned long) vm->stack[call->tp - 3].value.to_int + v1.value.to_int);
+                    call->pc += i.sx.sx;
+                }
+            } else {
+                vm->stack[call->tp - 3].value.to_float += v1.value.to_float;
+
+                if (v1.value.to_float > 0 ? vm->stack[call->tp - 3].value.to_float < v0.value.to_float
+                        : vm->stack[call->tp - 3].value.to_float > v0.value.to_float) {
+                    call->pc += i.sx.sx;
+                }
+            }
+
+            vm->stack[call->tp] = vm->stack[call->tp - 3];
+            call->tp++;
+            break;
+
+        case OP_TITER:
+            if (vm->stack[call->tp - 1].type != VM_TABLE) runtimeerr(vm, "Cannot iterate over non-table object");
+            if (call->tp + 3 >= MAX_STACK_SIZE) runtimeerr(vm, "Stack overflow!");
+
+            // starts before the first entry
+            vm->stack[call->tp++] = vInt(-1);
+            vm->stack[call->tp++] = vNull();
+
+            if (!table_next(&vm->stack[call->tp - 3], &vm->stack[call->tp])) call->pc += i.sx.sx;
+            call->tp++;
+            break;
+
+        case OP_TNEXT:
+            if (table_next(&vm->stack[call->tp - 3], &vm->stack[call->tp])) call->pc += i.sx.sx;
+            if (++call->tp >= MAX_STACK_SIZE) runtimeerr(vm, "Stack overflow!");
+            break;
+
+        case OP_SWITCH:
+            // lands on the jump of the matching case, or the default
+            call->pc += jump_table_find(vector_get(&call->program->p->jump_tables, i.ux.ux), vm->stack[--call->tp]);
             break;
         
         case OP_CLOSE:
@@ -161,38 +437,182 @@ void decode_execute(virtual_machine* vm, call_info* call, instruction i)
             vm->stack[call->tp - 1] = vCode(vm->stack[call->tp - 1].value.to_code->p, closure);
             break;
 
-        case OP_TNEW:
-            vm->stack[call->tp++] = vTable(10);
+        case OP_CLOSER:
+            code = region_alloc(vm, sizeof(code_object) + sizeof(Value) * i.ux.ux);
+            code->p = vm->stack[call->tp - i.ux.ux - 1].value.to_code->p;
+            code->closure = (Value*) (code + 1);
+            call->tp -= i.ux.ux;
+
+            for (size_t i0 = 0; i0 < i.ux.ux; i0++) {
+                code->closure[i0] = vm->stack[call->tp + i0];
+            }
+
+            vm->stack[call->tp - 1].value.to_code = code;
+            break;
+
+        case OP_TNEW: EXEC_TNEW(i); break;
+
+        case OP_TNEWR:
+            vm->stack[call->tp++] = vTableAt(region_alloc(vm, sizeof(Table) + 10 * sizeof(struct pair)), 10);
             break;
         
-        case OP_TPUT:
-            v1 = vm->stack[--call->tp];
-            v0 = vm->stack[--call->tp];
-            call->tp--;
-            
-            if (vm->stack[call->tp].type == VM_TABLE)
-                vTablePut(vm->stack[call->tp].value.to_table, v0, v1);
-            else
-                runtimeerr(vm, "Cannot add element to non-table object");
-            break;
-
-        case OP_TGET:
-            v0 = vm->stack[--call->tp];
-            call->tp--;
-            if (vm->stack[call->tp].type == VM_TABLE)
-                vm->stack[call->tp] = vTableGet(vm->stack[call->tp].value.to_table, v0);
-            else
-                runtimeerr(vm, "Cannot retrieve element from non-table object");
-            call->tp++;
+        case OP_TPUT: EXEC_TPUT(i); break;
+        case OP_TPUTK: EXEC_TPUTK(i); break;
+        case OP_TGET: EXEC_TGET(i); break;
+        case OP_TUPDATE: EXEC_TUPDATE(i); break;
+        case OP_LEN: EXEC_LEN(i); break;
+        case OP_SQRT: EXEC_SQRT(i); break;
+        case OP_POW: EXEC_POW(i); break;
+        case OP_TOINT: EXEC_TOINT(i); break;
+        case OP_TOFLOAT: EXEC_TOFLOAT(i); break;
+        case OP_TOBOOL: EXEC_TOBOOL(i); break;
+        case OP_TOSTR: EXEC_TOSTR(i); break;
+
+        case OP_SNAPSHOT:
+            // the rest of the program runs from the snapshot instead
+            if (!image_write_snapshot(vm, call, snapshot_path)) {
+                runtimeerr(vm, "Failed to write heap snapshot!");
+            }
+            exit(0);
             break;
+
+        SUPERINSTRUCTIONS(SUPERINSTRUCTION_CASE)
         
         default:
-            fprintf(stderr, "%s Failed to execute instruction: %i\n", ERROR, i.stackop.op);
-            exit(0);
+            runtimeerr(vm, "Failed to execute instruction!");
             break;
     }
 }
 
+void call_value(virtual_machine* vm, call_info* call, size_t argc)
+{
+    if (vm->stack[--call->tp].type != VM_PROGRAM) {
+        char msg[1000];
+        msg[0] = '\0';
+        sprintf(msg, "Cannot call value %s, expected function type!", value_to_str(&vm->stack[call->tp]));
+        runtimeerr(vm, msg);
+    }
+
+    code_object* code = vm->stack[call->tp].value.to_code;
+
+    // natives run on the arguments in place, without a frame of their own
+    if (code->p->native != NULL) {
+        call_native(vm, call, code->p, argc);
+        return;
+    }
+
+    if (code->p->deferred != NULL) {
+        compile_on_call(vm, code->p);
+    }
+
+    call->tp -= code->p->argc;
+
+    if (argc == code->p->argc)
+        run_program(vm, call, code);
+    else {
+        runtimeerr(vm, "Invalid number of arguments passed to function!");
+    }
+}
+
+void compile_on_call(virtual_machine* vm, program* p)
+{
+    program* global = p;
+    while (global->prev != NULL) global = global->prev;
+
+    size_t globals = global->symbol_table.size;
+    compile_deferred(p);
+    bind_builtins(vm, global, globals);
+}
+
+void call_native(virtual_machine* vm, call_info* call, program* p, size_t argc)
+{
+    if (!p->variadic && argc != p->argc) {
+        runtimeerr(vm, "Invalid number of arguments passed to function!");
+    }
+
+    Value out = vNull();
+
+    // arguments stay below the top while the native runs, so that it may
+    // call back into the virtual machine
+    if (p->native(vm, &vm->stack[call->tp - argc], argc, &out) != NATIVE_OK) {
+        runtimeerr(vm, out.type == VM_STRING ? out.value.to_str : "Native function failed!");
+    }
+
+    call->tp -= argc;
+    vm->stack[call->tp++] = out;
+}
+
+boolean table_next(Value* state, Value* value)
+{
+    Table* t = state[0].value.to_table;
+    long i = state[1].value.to_int;
+    Value key = state[2];
+
+    // popkey shifts the entries after a removed one down, so the current
+    // key is searched for below its index, if it was itself removed the
+    // next entry now sits at its index
+    if (i >= 0 && !((size_t) i < t->size && t->pairs[i].key.type == key.type && t->pairs[i].key.value.to_int == key.value.to_int))
+    {
+        long j = ((size_t) i < t->size ? i : (long) t->size) - 1;
+        while (j >= 0 && !vEqual(t->pairs[j].key, key).value.to_bool) j--;
+        i = j >= 0 ? j : i - 1;
+    }
+
+    // size is read on every step so entries added by the body are visited
+    if ((size_t) ++i >= t->size) {
+        state[1] = vInt(i);
+        state[2] = *value = vNull();
+        return false;
+    }
+
+    state[1] = vInt(i);
+    state[2] = t->pairs[i].key;
+    *value = t->pairs[i].value;
+    return true;
+}
+
+boolean for_prepare(virtual_machine* vm, Value* range)
+{
+    Value start = range[0], limit = range[1], step = range[2];
+
+    if (!NUMERIC_TYPE(start.type) || !NUMERIC_TYPE(limit.type) || !NUMERIC_TYPE(step.type)) {
+        runtimeerr(vm, "Loop range must be numeric!");
+    }
+
+    if (start.type != VM_FLOAT && limit.type != VM_FLOAT && step.type != VM_FLOAT)
+    {
+        long a = start.type == VM_BOOL ? start.value.to_bool : start.value.to_int;
+        long b = limit.type == VM_BOOL ? limit.value.to_bool : limit.value.to_int;
+        long s = step.type == VM_BOOL ? step.value.to_bool : step.value.to_int;
+
+        if (s == 0) {
+            runtimeerr(vm, "Loop step cannot be zero!");
+        }
+
+        // iterations left after the first, computed without overflow
+        unsigned long distance = s > 0 ? (unsigned long) b - (unsigned long) a : (unsigned long) a - (unsigned long) b;
+        unsigned long stride = s > 0 ? (unsigned long) s : 0UL - (unsigned long) s;
+
+        range[0] = vInt(a);
+        range[1] = vInt((long) ((distance - 1) / stride));
+        range[2] = vInt(s);
+        return s > 0 ? a < b : a > b;
+    }
+
+    double a = start.type == VM_FLOAT ? start.value.to_float : start.type == VM_BOOL ? start.value.to_bool : start.value.to_int;
+    double b = limit.type == VM_FLOAT ? limit.value.to_float : limit.type == VM_BOOL ? limit.value.to_bool : limit.value.to_int;
+    double s = step.type == VM_FLOAT ? step.value.to_float : step.type == VM_BOOL ? step.value.to_bool : step.value.to_int;
+
+    if (s == 0) {
+        runtimeerr(vm, "Loop step cannot be zero!");
+    }
+
+    range[0] = vFloat(a);
+    range[1] = vFloat(b);
+    range[2] = vFloat(s);
+    return s > 0 ? a < b : a > b;
+}
+
 Value apply_vm_op(vm_op op, Value v0, Value v1)
 {
     switch (op)
@@ -208,35 +628,86 @@ Value apply_vm_op(vm_op op, Value v0, Value v1)
         case OP_LT: return vLess(v0, v1);
         case OP_GE: return vLessEqual(v1, v0);
         case OP_GT: return vLess(v1, v0);
-        
-        case OP_AND: return vBool(native_bool_cast(&v0).value.to_bool && native_bool_cast(&v1).value.to_bool);
-        case OP_OR: return vBool(native_bool_cast(&v0).value.to_bool || native_bool_cast(&v1).value.to_bool);
+
         default:
-            fprintf(stderr, "%s Failed to apply binary operation: %i!\n", ERROR, op);
-            exit(0);
+            failure("Failed to apply binary operation!");
+            return vNull();
+    }
+}
+
+void update_value(Value* v, vm_op op, Value k)
+{
+    // integer counters skip dispatching on the pair of types
+    if (v->type == VM_INT && k.type == VM_INT && op == OP_ADD) {
+        v->value.to_int += k.value.to_int;
+    } else if (v->type == VM_INT && k.type == VM_INT && op == OP_SUB) {
+        v->value.to_int -= k.value.to_int;
+    } else {
+        *v = apply_vm_op(op, *v, k);
+    }
+}
+
+// ints and floats are compared inline, other operands as by apply_vm_op
+#define RELATION(rel, generic) (v0.type == VM_INT && v1.type == VM_INT ? v0.value.to_int rel v1.value.to_int \
+    : v0.type == VM_FLOAT && v1.type == VM_FLOAT ? v0.value.to_float rel v1.value.to_float : generic.value.to_bool)
+
+boolean compare_branch(vm_op op, Value v0, Value v1)
+{
+    switch (op)
+    {
+        case OP_JLT: return RELATION(<, vLess(v0, v1));
+        case OP_JLE: return RELATION(<=, vLessEqual(v0, v1));
+        case OP_JGT: return RELATION(>, vLess(v1, v0));
+        case OP_JGE: return RELATION(>=, vLessEqual(v1, v0));
+        case OP_JEQ: return RELATION(==, vEqual(v0, v1));
+        case OP_JNE: return RELATION(!=, vNotEqual(v0, v1));
+        case OP_JNLT: return !RELATION(<, vLess(v0, v1));
+        case OP_JNLE: return !RELATION(<=, vLessEqual(v0, v1));
+        case OP_JNGT: return !RELATION(>, vLess(v1, v0));
+        case OP_JNGE: return !RELATION(>=, vLessEqual(v1, v0));
+        default:
+            failure("Failed to apply comparison!");
+            return false;
     }
 }
 
 void runtimeerr(virtual_machine* vm, const char* msg)
 {
+    // embedding programs receive the message with the line it was raised at
+    if (current_trap != NULL && vm->ci != (size_t) -1)
+    {
+        char buf[512];
+        lxpos* pos = &getaddresspos(vm->call_stack[vm->ci].program->p, vm->call_stack[vm->ci].pc)->pos;
+        snprintf(buf, sizeof(buf), "%s (line %d) in %s", msg, pos->line_pos + 1, pos->origin);
+        error_exit(buf);
+    }
+    else if (current_trap != NULL)
+    {
+        error_exit(msg);
+    }
+
     fprintf(stderr, "%sError Stack Trace: \n", ERR_COL);
     
     // prints stack trace.
     for (size_t i = 0; i <= vm->ci; i++)
     {
         call_info call = vm->call_stack[i];
+        print_trace_line(call.program->p, getaddresspos(call.program->p, call.pc));
+    }
 
-        // native methods have no instructions
-        if (call.program->p->native) {
-            continue;
-        }
+    fprintf(stderr, "Runtime error: %s%s\n", msg, DEF_COL);
+    error_exit(msg);
+}
 
-        lxpos* pos = getaddresspos(call.program->p, call.pc);
-        Value v = vCode(call.program->p, NULL);
-        fprintf(stderr, "\t%s In file %s at line %i:\n", value_to_str(&v), pos->origin, pos->line_pos + 1);
-        fprintf(stderr, "\t\t| %04i %s\n", pos->line_pos + 1, get_line(pos->src, pos->line_offset));
+// Prints the line of a frame, after the lines of the calls its code was
+// inlined at, as the frames of those calls would have been
+void print_trace_line(program* p, line_entry* e)
+{
+    if (e->site != NULL) {
+        print_trace_line(p, e->site);
     }
 
-    fprintf(stderr, "Runtime error: %s%s\n", msg, DEF_COL);
-    exit(0);
-}
\ No newline at end of file
+    Value v = vCode(p, NULL);
+    fprintf(stderr, "\t%s In file %s at line %i:\n", value_to_str(&v), e->pos.origin, e->pos.line_pos + 1);
+    fprintf(stderr, "\t\t| %04i %s\n", e->pos.line_pos + 1, get_line(e->pos.src, e->pos.line_offset));
+}
@@ -13,6 +13,7 @@ typedef struct call_info {
     size_t sp;
     size_t tp;
     size_t pc;
+    size_t region_mark;
     struct call_info* prev;
 } call_info;
 
@@ -21,6 +22,11 @@ typedef struct virtual_machine {
     call_info* call_stack;
     Value* heap;
     Value* stack;
+    char* region;
+    size_t region_top;
+    size_t* pair_counts;
+    size_t entry;       // address the global program starts from
+    vector natives;     // native functions registered by an embedding program
 } virtual_machine;
 
 /**
@@ -42,6 +48,17 @@ void run_program(virtual_machine* vm, call_info* prev, code_object* code);
  */
 void decode_execute(virtual_machine* vm, call_info* call, instruction i);
 
+/**
+ * @brief Allocates zeroed memory from the region of the current call
+ *      frame, released when the frame returns. Falls back to the heap
+ *      once the region is full.
+ * 
+ * @param vm Reference to virtual machine
+ * @param size Number of bytes
+ * @return Allocated memory
+ */
+void* region_alloc(virtual_machine* vm, size_t size);
+
 /**
  * @brief Applies a virtual machine operation between two generic tagged
  *      values.
@@ -53,6 +70,93 @@ void decode_execute(virtual_machine* vm, call_info* call, instruction i);
  */
 Value apply_vm_op(vm_op op, Value v0, Value v1);
 
+/**
+ * @brief Applies an arithmetic operation to a variable or table element
+ *      in place, with the operand as the right hand side.
+ * 
+ * @param v Reference to updated value
+ * @param op Operation code
+ * @param k Operand
+ */
+void update_value(Value* v, vm_op op, Value k);
+
+/**
+ * @brief Evaluates the comparison of a compare-and-branch operation
+ *      between two generic tagged values. Negated comparisons hold
+ *      wherever the comparison does not, including for NaN operands.
+ * 
+ * @param op Operation code
+ * @param v0 Operand 1
+ * @param v1 Operand 2
+ * @return True if the branch is taken
+ */
+boolean compare_branch(vm_op op, Value v0, Value v1);
+
+/**
+ * @brief Calls the function on top of the stack with the arguments below
+ *      it, leaving the result in their place.
+ * 
+ * @param vm Reference to virtual machine
+ * @param call Reference to calling frame
+ * @param argc Number of arguments passed
+ */
+void call_value(virtual_machine* vm, call_info* call, size_t argc);
+
+/**
+ * @brief Compiles a deferred function on its first call, binding the
+ *      built-ins it names which the program had not named before.
+ * 
+ * @param vm Reference to virtual machine
+ * @param p Function program
+ */
+void compile_on_call(virtual_machine* vm, program* p);
+
+/**
+ * @brief Calls a native function on the arguments on top of the stack,
+ *      leaving the result in their place. A native reporting failure
+ *      raises its message as a runtime error at the calling instruction.
+ * 
+ * @param vm Reference to virtual machine
+ * @param call Reference to calling frame
+ * @param p Native function program
+ * @param argc Number of arguments passed
+ */
+void call_native(virtual_machine* vm, call_info* call, program* p, size_t argc);
+
+/**
+ * @brief Checks and converts the start, limit and step of a counted loop
+ *      in place, to floats if any of them is a float and otherwise to
+ *      integers. The limit of an integer range is replaced by the number
+ *      of iterations left after the first.
+ * 
+ * @param vm Reference to virtual machine
+ * @param range Start, limit and step on the stack
+ * @return True if the range is not empty
+ */
+boolean for_prepare(virtual_machine* vm, Value* range);
+
+/**
+ * @brief Advances a table loop to the entry after the current one. The
+ *      table may be modified by the loop body, entries added are visited
+ *      and entries removed by popkey are skipped. No other entry is skipped
+ *      unless the current entry is removed along with an earlier one.
+ * 
+ * @param state Table, index and key of the current entry on the stack
+ * @param value Slot receiving the value of the next entry
+ * @return True if there is a next entry
+ */
+boolean table_next(Value* state, Value* value);
+
+/**
+ * @brief Appends the executed pairs of adjacent operations to a file, one
+ *      line per pair with its count followed by both operation names,
+ *      most frequent first.
+ * 
+ * @param path Output file path
+ * @param counts Pair counts indexed by first * VM_BASE_OPS + second
+ */
+void dump_opcode_pairs(const char* path, size_t* counts);
+
 /**
  * @brief Throws a runtime error when an issue occurs during
  *      bytecode execution. Stack trace is used to determine the
@@ -0,0 +1,82 @@
+// Runs scripts through the library API, compiled with bare file names so
+// includes are found relative to the working directory
+#include "helium.h"
+
+native_status twice(virtual_machine* vm, Value* args, size_t argc, Value* out)
+{
+    *out = vInt(args[0].value.to_int * 2);
+    return NATIVE_OK;
+}
+
+void check(he_vm* vm, const char* what, he_status status)
+{
+    printf("%s: %s\n", what, status == HE_OK ? "ok" : he_error(vm));
+}
+
+int main()
+{
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    he_vm* vm = he_vm_new();
+    he_program* p;
+    Value result, args[] = { vInt(5) };
+
+    check(vm, "register", he_register_native(vm, "twice", twice, 1, false));
+    check(vm, "register again", he_register_native(vm, "twice", twice, 1, false));
+
+    // the script and its include are found from a bare file name
+    check(vm, "compile file", he_compile_file(vm, "main.he", &p));
+    check(vm, "run", he_run(vm, p));
+
+    for (int i = 0; i < 3; i++) {
+        check(vm, "call", he_call(vm, p, "add", args, 1, &result));
+        printf("total %ld\n", result.value.to_int);
+    }
+
+    check(vm, "runtime error", he_call(vm, p, "fail", NULL, 0, NULL));
+    check(vm, "missing global", he_call(vm, p, "nothing", NULL, 0, NULL));
+    he_program_delete(p);
+
+    // errors in inlined code are raised at the line of the inlined function
+    check(vm, "compile file", he_compile_file(vm, "inline_error.he", &p));
+    check(vm, "run", he_run(vm, p));
+    check(vm, "inlined error", he_call(vm, p, "run", NULL, 0, NULL));
+    he_program_delete(p);
+
+    // sources given as strings resolve includes the same way
+    check(vm, "compile string", he_compile_string(vm, "inline.he", "include \"util.he\"\n@print(\"string\", @square(3))\n", &p));
+    check(vm, "run", he_run(vm, p));
+    he_program_delete(p);
+
+    // compile errors are returned rather than ending the process
+    check(vm, "syntax error", he_compile_string(vm, "bad.he", "x <- (\n", &p));
+    check(vm, "missing include", he_compile_string(vm, "bad.he", "include \"none.he\"\n", &p));
+    check(vm, "missing file", he_compile_file(vm, "none.he", &p));
+
+    // included files are parsed by several workers, but the first error in
+    // include order is reported on every run
+    const char* includes = "include \"first_error.he\"\ninclude \"early_error.he\"\n";
+    check(vm, "include errors", he_compile_string(vm, "inc.he", includes, &p));
+
+    char first[512];
+    int differing = 0;
+    strcpy(first, he_error(vm));
+
+    for (int i = 0; i < 50; i++) {
+        he_compile_string(vm, "inc.he", includes, &p);
+        differing += strcmp(first, he_error(vm)) != 0;
+    }
+    printf("differing include errors: %d\n", differing);
+
+    // a program may be run by another virtual machine
+    he_vm* other = he_vm_new();
+    he_register_native(other, "twice", twice, 1, false);
+    check(other, "compile file", he_compile_file(other, "main.he", &p));
+    check(other, "run", he_run(other, p));
+    check(vm, "run elsewhere", he_run(vm, p));
+    he_program_delete(p);
+
+    he_vm_delete(other);
+    he_vm_delete(vm);
+    return 0;
+}
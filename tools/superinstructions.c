@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Reads opcode pair counts dumped with --dump-opcode-pairs and writes the
+// most frequent fusable pairs as src/superinstructions.h to stdout.
+//
+// usage: superinstructions [-n count] dump...
+
+#define MAX_PAIRS 4096
+#define DEFAULT_FUSED 12
+
+typedef struct pair {
+    char first[16];
+    char second[16];
+    unsigned long count;
+} pair;
+
+// operations which always fall through to the next instruction
+const char* straight_line[] = {
+    "NOP", "ADD", "SUB", "MUL", "DIV", "MOD", "NEG", "NOT", "EQ", "NE", "LT", "LE", "GT", "GE",
+    "IADD", "ISUB", "IMUL", "ISHL", "IMODP", "ILT", "ILE", "IGT", "IGE", "IEQ", "INE",
+    "FADD", "FSUB", "FMUL", "FDIV", "FLT", "FLE", "FGT", "FGE",
+    "PUSHK", "STORG", "LOADG", "STORL", "LOADL", "STORC", "LOADC", "STORLK", "STORGK", "POP",
+    "TNEW", "TPUT", "TPUTK", "TGET", "LEN", "SQRT", "POW", "TOINT", "TOFLOAT", "TOBOOL", "TOSTR", NULL
+};
+
+// jumps relative to their own instruction, which may end a pair
+const char* jumps[] = {
+    "JMP", "JFALSE", "JTRUE", "JLT", "JLE", "JGT", "JGE", "JEQ", "JNE", "JNLT", "JNLE", "JNGT", "JNGE", NULL
+};
+
+int listed(const char** list, const char* op)
+{
+    for (size_t i = 0; list[i] != NULL; i++) {
+        if (strcmp(list[i], op) == 0) return 1;
+    }
+    return 0;
+}
+
+int by_count(const void* a, const void* b)
+{
+    unsigned long x = ((const pair*) a)->count, y = ((const pair*) b)->count;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+int main(int argc, const char* argv[])
+{
+    static pair pairs[MAX_PAIRS];
+    size_t length = 0;
+    size_t fused = DEFAULT_FUSED;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            fused = atoi(argv[++i]);
+            continue;
+        }
+
+        FILE* file = fopen(argv[i], "r");
+
+        if (file == NULL) {
+            fprintf(stderr, "Failed to open %s\n", argv[i]);
+            return 1;
+        }
+
+        pair p;
+
+        // sums counts of the same pair across runs
+        while (fscanf(file, "%lu %15s %15s", &p.count, p.first, p.second) == 3)
+        {
+            if (!listed(straight_line, p.first) || !(listed(straight_line, p.second) || listed(jumps, p.second))) {
+                continue;
+            }
+
+            size_t j = 0;
+            while (j < length && (strcmp(pairs[j].first, p.first) != 0 || strcmp(pairs[j].second, p.second) != 0)) j++;
+
+            if (j == length && length < MAX_PAIRS) {
+                pairs[length++] = p;
+            } else if (j < length) {
+                pairs[j].count += p.count;
+            }
+        }
+
+        fclose(file);
+    }
+
+    qsort(pairs, length, sizeof(pair), by_count);
+
+    if (fused > length) {
+        fused = length;
+    }
+
+    printf("#ifndef HE_SUPERINSTRUCTIONS_HEADER\n");
+    printf("#define HE_SUPERINSTRUCTIONS_HEADER\n\n");
+    printf("// Generated by tools/superinstructions.c from opcode pair counts dumped\n");
+    printf("// with --dump-opcode-pairs, regenerate with make superinstructions.\n");
+    printf("// Each entry fuses two adjacent operations into a single dispatch.\n\n");
+    printf("#define SUPERINSTRUCTIONS(X)%s\n", fused > 0 ? " \\" : "");
+
+    for (size_t i = 0; i < fused; i++) {
+        printf("    X(%s, %s) /* %lu */%s\n", pairs[i].first, pairs[i].second, pairs[i].count, i + 1 < fused ? " \\" : "");
+    }
+
+    printf("\n#endif\n");
+    return 0;
+}